@@ -401,6 +401,10 @@ typedef enum _MR_CRASH_BUF_STATUS {
 
 /* Driver's internal Logging levels*/
 #define OCR_LOGS    (1 << 0)
+/* time PRP/IEEE SGL construction, reported through io_stats */
+#define SGL_BUILD_STATS (1 << 2)
+/* SCSI IO latency histograms, see debugfs megaraid_sas/scsi_host<N>/ */
+#define LATENCY_HIST    (1 << 3)
 
 #define SGE_BUFFER_SIZE	4096
 /*
@@ -1540,6 +1544,13 @@ struct megasas_ctrl_info {
 #define MEGASAS_IOCTL_CMD			0
 #define MEGASAS_DEFAULT_CMD_TIMEOUT		90
 #define MEGASAS_THROTTLE_QUEUE_DEPTH		16
+#define MEGASAS_QD_TICK				(HZ / 10)
+#define MEGASAS_QD_HOLD				HZ
+#define MEGASAS_QD_HOST_SPREAD			2
+#define MEGASAS_QD_SLOW_MIN			4
+#define MEGASAS_QD_LAT_MIN_SAMPLES		32
+#define MEGASAS_QD_HOST				0xffff
+#define MEGASAS_QD_HISTORY			64
 #define MEGASAS_DEFAULT_TM_TIMEOUT		50
 
 /*
@@ -1554,6 +1565,14 @@ struct megasas_ctrl_info {
 #define MEGASAS_FUSION_INTERNAL_CMDS		8
 #define MEGASAS_FUSION_IOCTL_CMDS		3
 
+/*
+ * Management ioctl buffers up to 64K come from per adapter DMA pools,
+ * one per size class (4K << 4 * class). Larger ones are allocated per call.
+ */
+#define MEGASAS_IOCTL_POOL_CLASSES		2
+#define MEGASAS_IOCTL_POOL_MIN_SZ		4096
+#define MEGASAS_IOCTL_POOL_SZ(class)		(MEGASAS_IOCTL_POOL_MIN_SZ << (4 * (class)))
+
 #define MEGASAS_MAX_MSIX_QUEUES			128
 /*
  * FW can accept both 32 and 64 bit SGLs. We want to allocate 32/64 bit
@@ -1614,6 +1633,19 @@ struct megasas_ctrl_info {
 
 #endif
 
+/*
+ * Multiple blk-mq hardware queues require the managed IRQ affinity of
+ * pci_alloc_irq_vectors() so that hctx N and reply queue N share CPUs.
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0))
+#define KERNEL_SUPPORT_BLK_MQ_MULTI_HWQ
+#endif
+
+#if ((LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)) && defined(CONFIG_IRQ_POLL))
+#define KERNEL_SUPPORT_IRQ_POLL
+#include <linux/irq_poll.h>
+#endif
+
 enum MR_ADAPTER_TYPE {
 	MFI_SERIES = 1,
 	THUNDERBOLT_SERIES = 2,
@@ -1991,6 +2023,19 @@ union megasas_frame {
 	u8 raw_bytes[64];
 };
 
+/*
+ * Adaptive queue depth control, see megasas_qd_work(). Congestion signals
+ * in decreasing order of severity, then the other history event reasons.
+ */
+enum MEGASAS_QD_REASON {
+	MEGASAS_QD_TIMEOUT,		/* IO timed out */
+	MEGASAS_QD_BUSY,		/* BUSY or TASK SET FULL from FW */
+	MEGASAS_QD_LATENCY,		/* completed above the latency target */
+	MEGASAS_QD_SIGNALS,
+	MEGASAS_QD_INCREASE = MEGASAS_QD_SIGNALS,
+	MEGASAS_QD_RESTORED,		/* back to the full depth */
+};
+
 /**
  * struct MR_PRIV_DEVICE - sdev private hostdata
  * @is_tm_capable: firmware managed tm capable flag
@@ -2003,6 +2048,13 @@ struct MR_PRIV_DEVICE {
 	u8 interface_type;
 	u8 task_abort_tmo;
 	u8 target_reset_tmo;
+	/* adaptive queue depth: signals since the last tick */
+	atomic_t qd_signals[MEGASAS_QD_SIGNALS];
+	u16 qd_depth;		/* 0 when not throttled */
+	u16 qd_max;		/* depth to grow back to */
+	unsigned long qd_hold;	/* no increase before this */
+	/* fusion only: IO frame header preset for this device */
+	MEGASAS_RAID_SCSI_IO_REQUEST io_frame_template;
 };
 
 struct megasas_cmd;
@@ -2438,21 +2490,125 @@ typedef struct _MR_IO_METRICS {
     MR_IO_METRICS_LD_OVERALL_LIST   ldIoMetrics;    // overall host IO metrics  
 } __attribute__ ((packed)) MR_IO_METRICS;
 
+/*
+ * Per CPU IO metric counters of the target IDs below nr_ld, sized to the
+ * LD count when a collection starts. fold is the AEN work's scratch.
+ */
+struct megasas_io_metric_shards {
+	u16				nr_ld;
+	MR_IO_METRICS_LD_OVERALL __percpu *ld;
+	MR_IO_METRICS_LD_OVERALL	fold[];
+};
+
 typedef struct _PERFORMANCEMETRIC
 {
     u8                          LogOn;
-    MR_IO_METRICS_LD_OVERALL    IoMetricsLD[MAX_PERF_COLLECTION_VD];
+    struct megasas_io_metric_shards __rcu *IoMetricsShard;  // folded by CopyPerfMetricData
     MR_IO_METRICS_LD_OVERALL    SavedIoMetricsLD[MAX_PERF_COLLECTION_VD];
+    MR_IO_METRICS_LD_OVERALL    BaseIoMetricsLD[MAX_PERF_COLLECTION_VD];    // shard totals when this collection started
     u64                         LastBlock[MAX_PERF_COLLECTION_VD];
-    u64                         LastIOTime[MAX_PERF_COLLECTION_VD];
+    u64                         LastIOTime[MAX_PERF_COLLECTION_VD];   // jiffies
     u64                         CollectEndTime;
     u64                         CollectStartTime;
     u32                         SavedCollectTimeSecs;
 }PERFORMANCEMETRIC;
 
+/*
+ * megasas_atomic_dec_if_positive - decrement by 1 if old value positive
+ * @v: pointer of type atomic_t
+ *
+ * The function returns the old value of *v minus 1, even if
+ * the atomic variable, v, was not decremented.
+ */
+static inline int megasas_atomic_dec_if_positive(atomic_t *v)
+{
+	int c, old, dec;
+	c = atomic_read(v);
+	for (;;) {
+		dec = c - 1;
+		if (unlikely(dec < 0))
+			break;
+		old = atomic_cmpxchg((v), c, dec);
+		if (likely(old == c))
+			break;
+		c = old;
+	}
+	return dec;
+}
+
+/*
+ * Outstanding command counter sharded per CPU.
+ * Free slots ("credits") are cached per CPU and moved to/from the shared
+ * pool in batches of MEGASAS_OUTSTANDING_BATCH, so a submit/complete pair
+ * normally touches only CPU local cache lines. Batches move with atomic
+ * operations only, no lock is taken on submit or completion. Credits are
+ * conserved, so the number of outstanding commands never exceeds limit.
+ * A negative avail is debt left by lowering the limit under load.
+ */
+#define MEGASAS_OUTSTANDING_BATCH	16
+
+struct megasas_outstanding {
+	atomic_t avail ____cacheline_aligned_in_smp;
+	atomic_t __percpu *cache;
+	int limit;
+	/* serializes limit updates and reset */
+	spinlock_t lock;
+};
+
+/*
+ * AIMD queue depth controller of one adapter. Signals are only counted in
+ * the IO path; every MEGASAS_QD_TICK megasas_qd_work() halves the depth of
+ * a device that timed out or saw BUSY (3/4 for latency), and the host
+ * depth when MEGASAS_QD_HOST_SPREAD devices signalled in the same tick or
+ * the mean completion latency is above target. Depths grow back
+ * additively once MEGASAS_QD_HOLD has passed without a decrease.
+ */
+struct megasas_qd_event {
+	unsigned long time;
+	u16 target;		/* MEGASAS_QD_HOST for the adapter */
+	u16 old_depth;
+	u16 new_depth;
+	u8 reason;		/* MEGASAS_QD_* */
+};
+
+struct megasas_qd_lat {
+	u64 sum_ns;
+	u64 count;
+};
+
+struct megasas_qd_ctrl {
+	struct delayed_work work;
+	u8 enabled;
+	u64 lat_target_ns;		/* 0: no latency feedback */
+	struct megasas_qd_lat __percpu *lat;
+	/* owned by megasas_qd_work() */
+	u32 depth;
+	unsigned long hold;
+	u64 lat_sum_ns;
+	u64 lat_count;
+	u32 lat_mean_us;		/* of the last tick */
+	u32 decreases;
+	u32 increases;
+	/* protects the history ring against readers */
+	spinlock_t lock;
+	u32 history_next;
+	struct megasas_qd_event history[MEGASAS_QD_HISTORY];
+};
+
 struct megasas_irq_context {
 	struct megasas_instance *instance;
 	u32 MSIxIndex;
+	unsigned int os_irq;
+	/* reply queue owner: ISR, irq_poll or hybrid poller */
+	atomic_t in_use;
+	atomic64_t irq_completions;
+	atomic64_t polled_completions;
+	atomic64_t poll_misses;
+	u64 poll_window_ns;
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+	struct irq_poll irqpoll;
+	bool irq_poll_scheduled;
+#endif
 };
 
 /*
@@ -2539,6 +2695,11 @@ struct megasas_instance {
 	u32 *crash_dump_buf;
 	dma_addr_t crash_dump_h;
 
+	/* management ioctl data and sense buffers, see MEGASAS_IOCTL_POOL_SZ */
+	struct dma_pool *ioctl_pool[MEGASAS_IOCTL_POOL_CLASSES];
+	/* megaraid_sas/scsi_host<N> in debugfs, NULL without debugfs */
+	struct dentry *debugfs_root;
+
 	struct MR_PD_LIST *pd_list_buf;
 	dma_addr_t pd_list_buf_h;
 
@@ -2577,7 +2738,9 @@ struct megasas_instance {
 	struct megasas_aen_event *ev;
 
 	struct megasas_cmd **cmd_list;
-	struct list_head cmd_pool;
+	/* free MFI commands, bit set means in use */
+	unsigned long *cmd_pool_bitmap;
+	/* protects cmd->list for internal_reset_pending_q */
 	spinlock_t cmd_pool_lock;
 	spinlock_t hba_lock;
 	spinlock_t stream_lock;
@@ -2601,11 +2764,16 @@ struct megasas_instance {
 	u32 unique_id;
 	u32 fw_support_ieee;
 
-	atomic_t fw_outstanding;
-	atomic_t ldio_outstanding;
+	struct megasas_outstanding fw_outstanding;
+	struct megasas_outstanding ldio_outstanding;
 	atomic_t fw_reset_no_pci_access;
 	atomic_t ieee_sgl;
 	atomic_t prp_sgl;
+	/* SGL build time and number of timed builds, SGL_BUILD_STATS only */
+	atomic64_t ieee_sgl_build_ns;
+	atomic64_t prp_sgl_build_ns;
+	atomic_t ieee_sgl_timed;
+	atomic_t prp_sgl_timed;
 	atomic_t r1_fp_writes_count;
 	atomic_t sge_holes_type1;
 	atomic_t sge_holes_type2;
@@ -2615,6 +2783,7 @@ struct megasas_instance {
 	struct tasklet_struct isr_tasklet;
 	struct work_struct work_init;
 	struct work_struct crash_init;
+	struct work_struct map_update_work;
 
 	u8 flag;
 	u8 unload;
@@ -2663,6 +2832,8 @@ struct megasas_instance {
 	unsigned int msix_vectors;
 	struct msix_entry msixentry[MEGASAS_MAX_MSIX_QUEUES];
 	struct megasas_irq_context irq_context[MEGASAS_MAX_MSIX_QUEUES];
+	/* per CPU reply queue (MSI-x index), nr_cpu_ids entries */
+	u8 *reply_map;
 	u64 map_id;
 	u64 pd_seq_map_id;
 	struct megasas_cmd *map_update_cmd;
@@ -2680,6 +2851,7 @@ struct megasas_instance {
  	u8 peerIsPresent;
  	u8 passive;
 	u16 throttlequeuedepth;
+	struct megasas_qd_ctrl qd_ctrl;
 	u8 is_imr;
 	u8 is_rdpq;
 	u8 mask_interrupts;
@@ -2699,6 +2871,24 @@ struct megasas_instance {
 	u8 task_abort_tmo;
 	u8 max_reset_tmo;
 	bool divert_io_with_chain_frame;
+	/* per blk-mq hardware queue tag depth, valid if nr_hw_queues > 1 */
+	u16 hwq_depth;
+	/* complete replies from irq_poll, at most irq_poll_budget per run */
+	u8 irq_poll_enable;
+	u32 irq_poll_budget;
+	/* max submission side reply queue poll window, 0 disables */
+	u32 hybrid_poll_us;
+	/*
+	 * Approximate FW commands in flight for the hybrid poll gate, only
+	 * kept while hybrid_poll_us is set. fw_outstanding is exact, but
+	 * reading it walks every CPU.
+	 */
+	atomic_t hybrid_poll_qd;
+	/* stream detection: streams tracked per LD, allowed forward gap */
+	u16 stream_count;
+	u16 stream_gap;
+	/* RAID-1 read load balancing policy, MR_LB_POLICY_* */
+	u8 lb_policy;
 };
 
 struct MR_LD_VF_MAP {
@@ -2850,6 +3040,22 @@ struct megasas_iocpacket {
 
 } __attribute__ ((packed));
 
+/*
+ * MEGASAS_IOC_FIRMWARE_BATCH: up to MEGASAS_IOC_BATCH_MAX packets for one
+ * adapter, issued without waiting for each other. host_no of the packets
+ * themselves is ignored. On return completed holds the number of packets
+ * processed before the first failing one, each packet's cmd_status is
+ * filled in as for MEGASAS_IOC_FIRMWARE.
+ */
+#define MEGASAS_IOC_BATCH_MAX			64
+
+struct megasas_iocbatch {
+	u16 host_no;
+	u16 count;
+	u32 completed;
+	u64 packets;	/* user address of struct megasas_iocpacket[count] */
+} __attribute__ ((packed));
+
 struct megasas_aen {
 	u16 host_no;
 	u16 __pad1;
@@ -2877,6 +3083,20 @@ struct compat_megasas_iocpacket {
 
 #define MEGASAS_IOC_FIRMWARE	_IOWR('M', 1, struct megasas_iocpacket)
 #define MEGASAS_IOC_GET_AEN	_IOW('M', 3, struct megasas_aen)
+#define MEGASAS_IOC_FIRMWARE_BATCH	_IOWR('M', 4, struct megasas_iocbatch)
+
+/*
+ * Kernel side state of one pass-through packet between being loaded into
+ * an MFI frame and being handed back to the application
+ */
+struct megasas_ioc_ctx {
+	struct megasas_cmd *cmd;
+	void *kbuff_arr[MAX_IOCTL_SGE];
+	void *sense;
+	dma_addr_t sense_handle;
+	u32 opcode;
+	u16 data_dir;
+};
 
 struct megasas_mgmt_info {
 
@@ -2906,12 +3126,27 @@ void megasas_set_dynamic_target_properties(struct scsi_device *sdev,
 					   bool is_target_prop);
 int megasas_get_target_prop(struct megasas_instance *instance,
 			    struct scsi_device *sdev);
+void megasas_init_io_frame_template(struct megasas_instance *instance,
+				    struct scsi_device *sdev);
+void megasas_init_stream_detect(struct megasas_instance *instance,
+				LD_STREAM_DETECT *current_ld_SD);
 
 int megasas_task_abort_fusion(struct scsi_cmnd *scmd);
 int megasas_reset_target_fusion(struct scsi_cmnd *scmd);
 u32 mega_mod64(u64 dividend, u32 divisor);
 void megasas_set_dma_settings(struct megasas_instance *instance,
 	struct megasas_dcmd_frame *dcmd, dma_addr_t dma_addr, u32 dma_len);
+int megasas_outstanding_alloc(struct megasas_outstanding *ctr);
+void megasas_outstanding_free(struct megasas_outstanding *ctr);
+bool megasas_outstanding_get(struct megasas_outstanding *ctr);
+void megasas_outstanding_inc(struct megasas_outstanding *ctr);
+void megasas_outstanding_put(struct megasas_outstanding *ctr);
+int megasas_outstanding_read(struct megasas_outstanding *ctr);
+void megasas_outstanding_reset(struct megasas_outstanding *ctr);
+void megasas_outstanding_set_limit(struct megasas_outstanding *ctr, int limit);
+void megasas_qd_restart(struct megasas_instance *instance);
+void megasas_qd_signal(struct megasas_instance *instance,
+		       struct scsi_device *sdev, u8 reason);
 
 #define msi_control_reg(base) (base + PCI_MSI_FLAGS)
 
@@ -51,6 +51,9 @@
 #include <linux/mutex.h>
 #include <linux/poll.h>
 #include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <scsi/scsi.h>
 #include <scsi/scsi_cmnd.h>
@@ -63,6 +66,11 @@
 #include <linux/smp_lock.h>
 #endif
 
+#include <linux/irq.h>
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0))
+#include <linux/blk-mq-pci.h>
+#endif
+
 #include "megaraid_sas_fusion.h"
 #include "megaraid_sas.h"
 
@@ -95,6 +103,15 @@ static unsigned int throttlequeuedepth = MEGASAS_THROTTLE_QUEUE_DEPTH;
 module_param(throttlequeuedepth, int, S_IRUGO);
 MODULE_PARM_DESC(throttlequeuedepth, "Adapter queue depth when throttled due to I/O timeout. Default: 16");
 
+static int adaptive_qd = 1;
+module_param(adaptive_qd, int, S_IRUGO);
+MODULE_PARM_DESC(adaptive_qd, "Adapt device and adapter queue depth to IO timeouts, FW BUSY and latency, "
+	"throttlequeuedepth is the adapter minimum. 0: drop to throttlequeuedepth for 5s on IO timeout. Default: 1");
+
+static unsigned int qd_latency_target;
+module_param(qd_latency_target, uint, S_IRUGO);
+MODULE_PARM_DESC(qd_latency_target, "Completion latency target in ms of the adaptive queue depth control. Default: 0 (off)");
+
 unsigned int resetwaittime = MEGASAS_RESET_WAIT_TIME;
 module_param(resetwaittime, int, S_IRUGO);
 MODULE_PARM_DESC(resetwaittime, "Wait time in (1-180s) after I/O timeout before resetting adapter. Default: 180s");
@@ -119,6 +136,38 @@ int event_log_level = MFI_EVT_CLASS_CRITICAL;
 module_param(event_log_level, int, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(event_log_level, "Asynchronous event logging level- range is: -2(CLASS_DEBUG) to 4(CLASS_DEAD), Default: 2(CLASS_CRITICAL)");
 
+static int multiq_enable;
+module_param(multiq_enable, int, S_IRUGO);
+MODULE_PARM_DESC(multiq_enable, "Expose one blk-mq hardware queue per MSI-x reply queue (scsi-mq only). Default: 0");
+
+static int irq_poll_enable;
+module_param(irq_poll_enable, int, S_IRUGO);
+MODULE_PARM_DESC(irq_poll_enable, "Complete replies from irq_poll with a per run budget (fusion adapters with MSI-x only). Default: 0");
+
+static unsigned int irq_poll_budget = MEGASAS_IRQ_POLL_BUDGET;
+module_param(irq_poll_budget, uint, S_IRUGO);
+MODULE_PARM_DESC(irq_poll_budget, "Max replies completed per hard IRQ or irq_poll run (16-1024). Default: 64");
+
+static unsigned int hybrid_poll_us;
+module_param(hybrid_poll_us, uint, S_IRUGO);
+MODULE_PARM_DESC(hybrid_poll_us, "Max time in usecs to poll the reply queue after a low queue depth submission (0-100, fusion adapters with MSI-x only). Default: 0 (disabled)");
+
+static unsigned int stream_count = MAX_STREAMS_TRACKED;
+module_param(stream_count, uint, S_IRUGO);
+MODULE_PARM_DESC(stream_count, "Sequential streams tracked per LD (1-256, Ventura only). Default: 8");
+
+static unsigned int stream_gap;
+module_param(stream_gap, uint, S_IRUGO);
+MODULE_PARM_DESC(stream_gap, "Max forward gap in blocks still counted as sequential (0-4095, Ventura only). Default: 0");
+
+static unsigned int lb_policy;
+module_param(lb_policy, uint, S_IRUGO);
+MODULE_PARM_DESC(lb_policy, "RAID-1 read load balancing. 0: seek distance (default), 1: queue depth, 2: measured PD latency");
+
+unsigned int chain_frame_pool = 1;
+module_param(chain_frame_pool, uint, S_IRUGO);
+MODULE_PARM_DESC(chain_frame_pool, "Allocate SG chain frames on demand from a shared pool. 0: one chain frame per command. Default: 1");
+
 MODULE_LICENSE("GPL");
 MODULE_VERSION(MEGASAS_VERSION);
 MODULE_AUTHOR("megaraidlinux.pdl@avagotech.com");
@@ -250,6 +299,7 @@ static int megasas_get_ld_vf_affiliation(struct megasas_instance *instance,
 int megasas_check_mpio_paths(struct megasas_instance *instance,
 			     struct scsi_cmnd *scmd);
 void megasas_fusion_crash_dump_wq(struct work_struct *work);
+void megasas_fusion_map_update_wq(struct work_struct *work);
 extern void megasas_free_host_crash_buffer
 		(struct megasas_instance *instance);
 extern void
@@ -258,6 +308,10 @@ static int
 megasas_setup_irqs(struct megasas_instance *instance, u8 is_probe);
 static void
 megasas_destroy_irqs(struct megasas_instance *instance);
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+extern int
+megasas_irqpoll(struct irq_poll *irqpoll, int budget);
+#endif
 extern int
 megasas_alloc_fusion_context(struct megasas_instance *instance);
 extern void
@@ -297,30 +351,59 @@ megasas_issue_dcmd(struct megasas_instance *instance, struct megasas_cmd *cmd)
 	return;
 }
 
+/**
+ * megasas_cmd_pool_find -	Claim a free bit of the command pool bitmap
+ * @bitmap:			Command pool bitmap, set bit means busy
+ * @offset:			First index to look at
+ * @size:			Search stops before this index
+ *
+ * Returns the claimed index or -1 if [offset, size) has no free command.
+ */
+static inline int
+megasas_cmd_pool_find(unsigned long *bitmap, u32 offset, u32 size)
+{
+	u32 index;
+
+	for (index = find_next_zero_bit(bitmap, size, offset); index < size;
+	     index = find_next_zero_bit(bitmap, size, index + 1)) {
+		if (!test_and_set_bit_lock(index, bitmap))
+			return index;
+	}
+
+	return -1;
+}
+
 /**
  * megasas_get_cmd -	Get a command from the free pool
  * @instance:		Adapter soft state
  *
  * Returns a free command from the pool
+ *
+ * The pool is a bitmap claimed with atomic bit operations, no lock is
+ * taken. Each CPU starts its search at its own bitmap word so concurrent
+ * callers do not contend on the same cache line. Commands reserved for
+ * AEN, map sync and blocked DCMDs stay available because ioctls are still
+ * limited by ioctl_sem.
  */
 struct megasas_cmd *megasas_get_cmd(struct megasas_instance
 						  *instance)
 {
-	unsigned long flags;
-	struct megasas_cmd *cmd = NULL;
+	u32 max_cmd = instance->max_mfi_cmds;
+	u32 start;
+	int index;
 
-	spin_lock_irqsave(&instance->cmd_pool_lock, flags);
+	start = (raw_smp_processor_id() * BITS_PER_LONG) % max_cmd;
 
-	if (!list_empty(&instance->cmd_pool)) {
-		cmd = list_entry((&instance->cmd_pool)->next,
-				 struct megasas_cmd, list);
-		list_del_init(&cmd->list);
-	} else {
+	index = megasas_cmd_pool_find(instance->cmd_pool_bitmap, start, max_cmd);
+	if (index < 0)
+		index = megasas_cmd_pool_find(instance->cmd_pool_bitmap, 0, start);
+
+	if (index < 0) {
 		printk(KERN_ERR "megasas: Command pool empty!\n");
+		return NULL;
 	}
 
-	spin_unlock_irqrestore(&instance->cmd_pool_lock, flags);
-	return cmd;
+	return instance->cmd_list[index];
 }
 
 /**
@@ -331,7 +414,6 @@ struct megasas_cmd *megasas_get_cmd(struct megasas_instance
 inline void
 megasas_return_cmd(struct megasas_instance *instance, struct megasas_cmd *cmd)
 {
-	unsigned long flags;
 	u32 blk_tags;
 	struct megasas_cmd_fusion *cmd_fusion;
 	struct fusion_context *fusion = instance->ctrl_context;
@@ -342,8 +424,6 @@ megasas_return_cmd(struct megasas_instance *instance, struct megasas_cmd *cmd)
 	if (cmd->flags & DRV_DCMD_POLLED_MODE)
 		return;
 
-	spin_lock_irqsave(&instance->cmd_pool_lock, flags);
-
 	if (fusion) {
 		blk_tags = instance->max_scsi_cmds + cmd->index;
 #if BLK_TAG_DEBUG
@@ -364,10 +444,214 @@ megasas_return_cmd(struct megasas_instance *instance, struct megasas_cmd *cmd)
 
 	if (!fusion && reset_devices)
 		cmd->frame->hdr.cmd = MFI_CMD_INVALID;
-	list_add(&cmd->list, (&instance->cmd_pool)->next);
 
-	spin_unlock_irqrestore(&instance->cmd_pool_lock, flags);
+	/* Frame must be clean before the command is visible as free */
+	clear_bit_unlock(cmd->index, instance->cmd_pool_bitmap);
+}
+
+/**
+ * megasas_outstanding_alloc -	Set up a sharded outstanding command counter
+ * @ctr:			Counter to set up
+ *
+ * The counter starts with a zero limit, callers raise it with
+ * megasas_outstanding_set_limit() once the queue depth is known.
+ */
+int megasas_outstanding_alloc(struct megasas_outstanding *ctr)
+{
+	ctr->cache = alloc_percpu(atomic_t);
+	if (!ctr->cache)
+		return -ENOMEM;
+
+	spin_lock_init(&ctr->lock);
+	atomic_set(&ctr->avail, 0);
+	ctr->limit = 0;
+	return 0;
+}
+
+void megasas_outstanding_free(struct megasas_outstanding *ctr)
+{
+	free_percpu(ctr->cache);
+	ctr->cache = NULL;
+}
+
+/*
+ * megasas_outstanding_reclaim -	Move every CPU's cached credits back
+ *					to the shared pool.
+ */
+static void megasas_outstanding_reclaim(struct megasas_outstanding *ctr)
+{
+	int cpu, credits;
+
+	for_each_possible_cpu(cpu) {
+		credits = atomic_xchg(per_cpu_ptr(ctr->cache, cpu), 0);
+		if (credits)
+			atomic_add(credits, &ctr->avail);
+	}
+}
+
+/*
+ * megasas_outstanding_borrow -	Take up to a batch of credits from the
+ *				shared pool. Returns the number taken.
+ */
+static int megasas_outstanding_borrow(struct megasas_outstanding *ctr)
+{
+	int avail, old, take;
+
+	avail = atomic_read(&ctr->avail);
+	while (avail > 0) {
+		take = min(avail, MEGASAS_OUTSTANDING_BATCH);
+		old = atomic_cmpxchg(&ctr->avail, avail, avail - take);
+		if (likely(old == avail))
+			return take;
+		avail = old;
+	}
+	return 0;
+}
+
+/**
+ * megasas_outstanding_get -	Account one more outstanding command
+ * @ctr:			Counter
+ *
+ * Returns true if the command fits under the limit. The common case only
+ * consumes a credit from this CPU's cache; an empty cache is refilled
+ * with a batch borrowed from the shared pool. Only when the pool is dry
+ * too are the credits parked on other CPUs reclaimed, which happens at
+ * the limit only. A batch another CPU is moving at that moment is missed,
+ * the command is then retried by the midlayer.
+ */
+bool megasas_outstanding_get(struct megasas_outstanding *ctr)
+{
+	atomic_t *cache;
+	int take;
+
+	cache = get_cpu_ptr(ctr->cache);
+	if (likely(megasas_atomic_dec_if_positive(cache) >= 0)) {
+		put_cpu_ptr(ctr->cache);
+		return true;
+	}
+
+	take = megasas_outstanding_borrow(ctr);
+	if (!take) {
+		megasas_outstanding_reclaim(ctr);
+		take = megasas_outstanding_borrow(ctr);
+	}
+	/* keep the rest of the batch for the next submissions */
+	if (take > 1)
+		atomic_add(take - 1, cache);
+	put_cpu_ptr(ctr->cache);
+
+	return take > 0;
+}
+
+/**
+ * megasas_outstanding_inc -	Account one more outstanding command
+ *				regardless of the limit (MFI adapters, where
+ *				the SCSI midlayer is the only throttle).
+ * @ctr:			Counter
+ */
+void megasas_outstanding_inc(struct megasas_outstanding *ctr)
+{
+	if (!megasas_outstanding_get(ctr))
+		atomic_dec(&ctr->avail);
+}
+
+/**
+ * megasas_outstanding_put -	Account one completed command
+ * @ctr:			Counter
+ *
+ * The credit goes back to this CPU's cache, and a batch is spilled to the
+ * shared pool once the cache holds two batches. Debt left by a lowered
+ * limit is paid back first.
+ */
+void megasas_outstanding_put(struct megasas_outstanding *ctr)
+{
+	atomic_t *cache;
+	int credits, old;
+
+	if (unlikely(atomic_read(&ctr->avail) < 0)) {
+		atomic_inc(&ctr->avail);
+		return;
+	}
+
+	cache = get_cpu_ptr(ctr->cache);
+	credits = atomic_inc_return(cache);
+	/* a reclaim may empty the cache meanwhile, only spill what is there */
+	while (credits >= 2 * MEGASAS_OUTSTANDING_BATCH) {
+		old = atomic_cmpxchg(cache, credits,
+				     credits - MEGASAS_OUTSTANDING_BATCH);
+		if (likely(old == credits)) {
+			atomic_add(MEGASAS_OUTSTANDING_BATCH, &ctr->avail);
+			break;
+		}
+		credits = old;
+	}
+	put_cpu_ptr(ctr->cache);
+}
+
+/**
+ * megasas_outstanding_read -	Number of outstanding commands
+ * @ctr:			Counter
+ *
+ * Sums the shared pool and every CPU cache. A batch moving between them
+ * at that moment reads as outstanding, so the result is only exact once
+ * submissions stop. This walks every possible CPU, keep it to reset,
+ * sysfs and other slow paths.
+ */
+int megasas_outstanding_read(struct megasas_outstanding *ctr)
+{
+	int cpu, free;
+
+	if (!ctr->cache)
+		return 0;
+
+	free = atomic_read(&ctr->avail);
+	for_each_possible_cpu(cpu)
+		free += atomic_read(per_cpu_ptr(ctr->cache, cpu));
+
+	return ctr->limit - free;
+}
+
+/**
+ * megasas_outstanding_reset -	Forget all outstanding commands (adapter reset)
+ * @ctr:			Counter
+ */
+void megasas_outstanding_reset(struct megasas_outstanding *ctr)
+{
+	unsigned long flags;
+	int cpu;
+
+	if (!ctr->cache)
+		return;
+
+	spin_lock_irqsave(&ctr->lock, flags);
+	for_each_possible_cpu(cpu)
+		atomic_set(per_cpu_ptr(ctr->cache, cpu), 0);
+	atomic_set(&ctr->avail, ctr->limit);
+	spin_unlock_irqrestore(&ctr->lock, flags);
+}
+
+/**
+ * megasas_outstanding_set_limit -	Change the number of commands allowed
+ * @ctr:				Counter
+ * @limit:				New limit
+ *
+ * Cached credits are reclaimed first so that a lower limit (FW busy
+ * throttling) takes effect on every CPU immediately. What the pool cannot
+ * cover becomes debt, paid back by completions before they refill any
+ * cache. The reclaim runs outside ctr->lock, which only orders limit
+ * updates against each other and reset.
+ */
+void megasas_outstanding_set_limit(struct megasas_outstanding *ctr, int limit)
+{
+	unsigned long flags;
+
+	if (limit < ctr->limit)
+		megasas_outstanding_reclaim(ctr);
 
+	spin_lock_irqsave(&ctr->lock, flags);
+	atomic_add(limit - ctr->limit, &ctr->avail);
+	ctr->limit = limit;
+	spin_unlock_irqrestore(&ctr->lock, flags);
 }
 
 static const char *
@@ -1464,6 +1748,60 @@ static inline u64 megasas_time_to_usecs(struct timeval *tv)
         return ((tv->tv_sec*1000000) + tv->tv_usec);
 }
 
+/**
+ * megasas_free_io_metric_shards -	Free per CPU IO metric counters
+ * @shards:				Shards to free, may be NULL
+ */
+static void megasas_free_io_metric_shards(struct megasas_io_metric_shards *shards)
+{
+	if (!shards)
+		return;
+	free_percpu(shards->ld);
+	kfree(shards);
+}
+
+/**
+ * megasas_alloc_io_metric_shards -	Size per CPU IO metric counters
+ * @instance:				Adapter soft state
+ *
+ * Done when FW starts a collection, so adapters that never collect IO
+ * metrics do not pay for the shards, and sized to the LDs configured at
+ * that point. Called from the AEN work under reset_mutex.
+ *
+ * Returns 1 if new shards were installed, 0 if the current ones fit.
+ */
+static int megasas_alloc_io_metric_shards(struct megasas_instance *instance)
+{
+	struct megasas_io_metric_shards *shards, *old;
+	u16 nr_ld;
+
+	old = rcu_dereference_protected(instance->PerformanceMetric.IoMetricsShard,
+					lockdep_is_held(&instance->reset_mutex));
+	nr_ld = clamp_t(u32, instance->CurLdCount, 1, MAX_PERF_COLLECTION_VD);
+	if (old && (old->nr_ld >= nr_ld))
+		return 0;
+
+	shards = kzalloc(sizeof(*shards) + nr_ld * sizeof(shards->fold[0]),
+			 GFP_KERNEL);
+	if (!shards)
+		return -ENOMEM;
+	shards->ld = __alloc_percpu(nr_ld * sizeof(MR_IO_METRICS_LD_OVERALL),
+				    sizeof(u64));
+	if (!shards->ld) {
+		kfree(shards);
+		return -ENOMEM;
+	}
+	shards->nr_ld = nr_ld;
+
+	rcu_assign_pointer(instance->PerformanceMetric.IoMetricsShard, shards);
+	if (old) {
+		/* UpdateIOMetric may still be counting into the old shards */
+		synchronize_rcu();
+		megasas_free_io_metric_shards(old);
+	}
+	return 1;
+}
+
 /**
  * UpdateIOMetric -	Update IO matrix for to use as stastics
  * @instance:		Adapter soft state
@@ -1477,39 +1815,54 @@ static inline u64 megasas_time_to_usecs(struct timeval *tv)
  * can be passed to application to display IO stats.
  * This function will convert any block size IO into 512 byte style IOs to provide correct 
  * stastics event if IOs are for difference sector size Drives.
+ *
+ * No lock is taken: counters go to the submitting CPU's shard and are
+ * folded by CopyPerfMetricData. LastBlock and LastIOTime stay shared per
+ * target, racing submitters may only blur the randomness buckets.
+ * Shards only ever count up, so an update racing with the fold lands in
+ * the next collection instead of being wiped. They are RCU protected, a
+ * collection start may replace them with larger ones.
  */
 inline void UpdateIOMetric(struct megasas_instance *instance, u16 TargetId, u8 isRead, u64 startBlock, u32 NumBlocks, 
 				u32 sector_size)
 {
+    struct megasas_io_metric_shards *shards;
+    MR_IO_METRICS_LD_OVERALL    *pShard;
     MR_IO_METRICS_SIZE          *pIOSizeMetric;
     MR_IO_METRICS_RANDOMNESS    *pIORandomMetric;
-    struct timeval              current_time;
+    u64                         LastBlock;
 
     if (!instance->PerformanceMetric.LogOn)
         return;
 
-    if (TargetId >= MAX_PERF_COLLECTION_VD)
-        return;
-
 	/* Convert NumBlocks and startBlock from any sector size to 512 byte */
 	NumBlocks = NumBlocks * (sector_size/512);
 	startBlock = startBlock * (sector_size/512);
-	
+
+    rcu_read_lock();
+    shards = rcu_dereference(instance->PerformanceMetric.IoMetricsShard);
+    if (!shards || (TargetId >= shards->nr_ld)) {
+        rcu_read_unlock();
+        return;
+    }
+    pShard = get_cpu_ptr(shards->ld) + TargetId;
+
     if (isRead)
     {
-        pIOSizeMetric = &instance->PerformanceMetric.IoMetricsLD[TargetId].readSize;
-        pIORandomMetric = &instance->PerformanceMetric.IoMetricsLD[TargetId].readRandomness;
-        instance->PerformanceMetric.IoMetricsLD[TargetId].readMB += NumBlocks; // lba to MB conversion happens later                                           
+        pIOSizeMetric = &pShard->readSize;
+        pIORandomMetric = &pShard->readRandomness;
+        pShard->readMB += NumBlocks; // lba to MB conversion happens later                                           
     }
     else
     {
-        pIOSizeMetric = &instance->PerformanceMetric.IoMetricsLD[TargetId].writeSize;
-        pIORandomMetric = &instance->PerformanceMetric.IoMetricsLD[TargetId].writeRandomness;
-        instance->PerformanceMetric.IoMetricsLD[TargetId].writeMB += NumBlocks; // lba to MB conversion happens later                                          
+        pIOSizeMetric = &pShard->writeSize;
+        pIORandomMetric = &pShard->writeRandomness;
+        pShard->writeMB += NumBlocks; // lba to MB conversion happens later                                          
     }
 
-    do_gettimeofday(&current_time);
-    instance->PerformanceMetric.LastIOTime[TargetId] = megasas_time_to_usecs(&current_time);
+    /* Avoid dirtying the shared line more than once per tick */
+    if (instance->PerformanceMetric.LastIOTime[TargetId] != jiffies)
+        instance->PerformanceMetric.LastIOTime[TargetId] = jiffies;
 
     if (NumBlocks  <= 1)
         pIOSizeMetric->lessThan512B++;
@@ -1525,55 +1878,162 @@ inline void UpdateIOMetric(struct megasas_instance *instance, u16 TargetId, u8 i
         pIOSizeMetric->between64K_256K++;
     else if (NumBlocks  >  256)
         pIOSizeMetric->moreThan256K++;                        // Number of IOs: 256K < size                                                                    
-    if (instance->PerformanceMetric.LastBlock[TargetId] == startBlock)
+
+    LastBlock = instance->PerformanceMetric.LastBlock[TargetId];
+    if (LastBlock == startBlock)
         pIORandomMetric->sequential++;                         // Number of IOs: sequential ( inter-LBA distance is 0)                                         
-    else if ((instance->PerformanceMetric.LastBlock[TargetId] + 128 ) <= startBlock)
+    else if ((LastBlock + 128 ) <= startBlock)
         pIORandomMetric->lessThan64K++;                        // Number of IOs: within 64KB of previous IO                                                    
-    else if ((instance->PerformanceMetric.LastBlock[TargetId] + 1024 ) <= startBlock)
+    else if ((LastBlock + 1024 ) <= startBlock)
         pIORandomMetric->between64K_512K++;                    // Number of IOs:  64K < LBA <=512K                                                             
-    else if ((instance->PerformanceMetric.LastBlock[TargetId] + 32768) <= startBlock)
+    else if ((LastBlock + 32768) <= startBlock)
         pIORandomMetric->between512K_16M++;                    // Number of IOs: 512K < LBA <=16M                                                              
-    else if ((instance->PerformanceMetric.LastBlock[TargetId] + 524288) <= startBlock)
+    else if ((LastBlock + 524288) <= startBlock)
         pIORandomMetric->between16M_256M++;                    // Number of IOs:  16M < LBA <=256M                                                             
-    else if ((instance->PerformanceMetric.LastBlock[TargetId] + 2097152) <= startBlock)
+    else if ((LastBlock + 2097152) <= startBlock)
         pIORandomMetric->between256M_1G++;                     // Number of IOs: 256M < LBA <=1G                                                               
-    else if ((instance->PerformanceMetric.LastBlock[TargetId] + 2097152) > startBlock)
+    else if ((LastBlock + 2097152) > startBlock)
         pIORandomMetric->moreThan1G++;                         // Number of IOs:   1G < LBA                                                                    
 
     instance->PerformanceMetric.LastBlock[TargetId] = startBlock + NumBlocks;
 
+    put_cpu_ptr(shards->ld);
+    rcu_read_unlock();
+}
+
+static void FoldIOSizeMetric(MR_IO_METRICS_SIZE *pSum, MR_IO_METRICS_SIZE *pShard)
+{
+	pSum->lessThan512B	+= pShard->lessThan512B;
+	pSum->between512B_4K	+= pShard->between512B_4K;
+	pSum->between4K_16K	+= pShard->between4K_16K;
+	pSum->between16K_64K	+= pShard->between16K_64K;
+	pSum->between64K_256K	+= pShard->between64K_256K;
+	pSum->moreThan256K	+= pShard->moreThan256K;
+}
+
+static void FoldIORandomMetric(MR_IO_METRICS_RANDOMNESS *pSum, MR_IO_METRICS_RANDOMNESS *pShard)
+{
+	pSum->sequential	+= pShard->sequential;
+	pSum->lessThan64K	+= pShard->lessThan64K;
+	pSum->between64K_512K	+= pShard->between64K_512K;
+	pSum->between512K_16M	+= pShard->between512K_16M;
+	pSum->between16M_256M	+= pShard->between16M_256M;
+	pSum->between256M_1G	+= pShard->between256M_1G;
+	pSum->moreThan1G	+= pShard->moreThan1G;
+}
+
+static void SubIOSizeMetric(MR_IO_METRICS_SIZE *pSum, MR_IO_METRICS_SIZE *pBase)
+{
+	pSum->lessThan512B	-= pBase->lessThan512B;
+	pSum->between512B_4K	-= pBase->between512B_4K;
+	pSum->between4K_16K	-= pBase->between4K_16K;
+	pSum->between16K_64K	-= pBase->between16K_64K;
+	pSum->between64K_256K	-= pBase->between64K_256K;
+	pSum->moreThan256K	-= pBase->moreThan256K;
+}
+
+static void SubIORandomMetric(MR_IO_METRICS_RANDOMNESS *pSum, MR_IO_METRICS_RANDOMNESS *pBase)
+{
+	pSum->sequential	-= pBase->sequential;
+	pSum->lessThan64K	-= pBase->lessThan64K;
+	pSum->between64K_512K	-= pBase->between64K_512K;
+	pSum->between512K_16M	-= pBase->between512K_16M;
+	pSum->between16M_256M	-= pBase->between16M_256M;
+	pSum->between256M_1G	-= pBase->between256M_1G;
+	pSum->moreThan1G	-= pBase->moreThan1G;
+}
+
+/*
+ * FoldPerfMetricShards -	Sum every CPU's shard per LD into pSum
+ *
+ * Submitters keep writing the shards, so the sum is a snapshot and the
+ * shards are left alone.
+ */
+static void FoldPerfMetricShards(struct megasas_io_metric_shards *shards, MR_IO_METRICS_LD_OVERALL *pSum)
+{
+	MR_IO_METRICS_LD_OVERALL *pLd, *pShard;
+	u16 i;
+	int cpu;
+
+	memset(pSum, 0, sizeof(MR_IO_METRICS_LD_OVERALL) * shards->nr_ld);
+
+	for_each_possible_cpu(cpu) {
+		pLd = per_cpu_ptr(shards->ld, cpu);
+		for (i=0; i <shards->nr_ld; i++ ) {
+			pShard = &pLd[i];
+
+			pSum[i].readMB	+= pShard->readMB;
+			pSum[i].writeMB	+= pShard->writeMB;
+			FoldIOSizeMetric(&pSum[i].readSize, &pShard->readSize);
+			FoldIOSizeMetric(&pSum[i].writeSize, &pShard->writeSize);
+			FoldIORandomMetric(&pSum[i].readRandomness, &pShard->readRandomness);
+			FoldIORandomMetric(&pSum[i].writeRandomness, &pShard->writeRandomness);
+		}
+	}
 }
 
-static void CopyPerfMetricData(struct megasas_instance *instance, u64 CurrentTime)
+/*
+ * CopyPerfMetricData -	Publish the collection to ioctl readers
+ *
+ * Called from the AEN work under reset_mutex, which also guards the
+ * fold scratch and BaseIoMetricsLD. hba_lock is only held to publish.
+ */
+static void CopyPerfMetricData(struct megasas_instance *instance,
+			       struct megasas_io_metric_shards *shards, u64 CurrentTime)
 {
+	MR_IO_METRICS_LD_OVERALL *pFold, *pSaved, *pBase, Total;
+	unsigned long flags;
 	u16 i;
 	u64 temp;
 
+	// Snapshot the shards, the collection is what was added since its start.
+	FoldPerfMetricShards(shards, shards->fold);
+
 	// Block to MB conversion & idle time calculation.                         
-	for (i=0; i <MAX_PERF_COLLECTION_VD; i++ ) {
-		instance->PerformanceMetric.IoMetricsLD[i].readMB  >>= BLOCKTOMB_BITSHIFT;
-		instance->PerformanceMetric.IoMetricsLD[i].writeMB >>= BLOCKTOMB_BITSHIFT;
-		instance->PerformanceMetric.IoMetricsLD[i].targetId = i;
-		temp = CurrentTime - instance->PerformanceMetric.LastIOTime[i];
-		do_div(temp, 1000000);
-		instance->PerformanceMetric.IoMetricsLD[i].idleTime += (u16)temp;
+	for (i=0; i <shards->nr_ld; i++ ) {
+		pFold = &shards->fold[i];
+		pBase = &instance->PerformanceMetric.BaseIoMetricsLD[i];
+		Total = *pFold;
+		pFold->readMB	-= pBase->readMB;
+		pFold->writeMB	-= pBase->writeMB;
+		SubIOSizeMetric(&pFold->readSize, &pBase->readSize);
+		SubIOSizeMetric(&pFold->writeSize, &pBase->writeSize);
+		SubIORandomMetric(&pFold->readRandomness, &pBase->readRandomness);
+		SubIORandomMetric(&pFold->writeRandomness, &pBase->writeRandomness);
+		*pBase = Total;
+
+		pFold->readMB  >>= BLOCKTOMB_BITSHIFT;
+		pFold->writeMB >>= BLOCKTOMB_BITSHIFT;
+		pFold->targetId = i;
+		pFold->idleTime = (u16)(jiffies_to_msecs(jiffies -
+			(unsigned long)instance->PerformanceMetric.LastIOTime[i]) / 1000);
 	}
 	temp = CurrentTime - instance->PerformanceMetric.CollectStartTime;
 	do_div(temp, 1000000);
-	instance->PerformanceMetric.SavedCollectTimeSecs = (u32)temp;
-
-	memcpy(instance->PerformanceMetric.SavedIoMetricsLD, instance->PerformanceMetric.IoMetricsLD, sizeof(MR_IO_METRICS_LD_OVERALL) * MAX_PERF_COLLECTION_VD);
 
-	// Zero out the original buffer for new collection.                        
-	memset(instance->PerformanceMetric.IoMetricsLD, 0, sizeof(MR_IO_METRICS_LD_OVERALL) * MAX_PERF_COLLECTION_VD);
+	spin_lock_irqsave(&instance->hba_lock, flags);
+	memcpy(instance->PerformanceMetric.SavedIoMetricsLD, shards->fold,
+	       sizeof(MR_IO_METRICS_LD_OVERALL) * shards->nr_ld);
+	// LDs added after the collection started have no shards yet.
+	for (i=shards->nr_ld; i <MAX_PERF_COLLECTION_VD; i++ ) {
+		pSaved = &instance->PerformanceMetric.SavedIoMetricsLD[i];
+		memset(pSaved, 0, sizeof(MR_IO_METRICS_LD_OVERALL));
+		pSaved->targetId = i;
+	}
+	instance->PerformanceMetric.SavedCollectTimeSecs = (u32)temp;
+	spin_unlock_irqrestore(&instance->hba_lock, flags);
 }
 
 static void ProcessPerfMetricAEN(struct megasas_instance *instance, MR_CTRL_IO_METRICS_CMD_TYPE MetricType)
 {
+    struct megasas_io_metric_shards *shards;
     struct timeval      current_time;
     u16 i;
+    int resized;
 
     do_gettimeofday(&current_time);
+    shards = rcu_dereference_protected(instance->PerformanceMetric.IoMetricsShard,
+                                       lockdep_is_held(&instance->reset_mutex));
 
     switch (MetricType) {
     case MR_CTRL_IO_METRICS_CMD_STOP:
@@ -1582,20 +2042,32 @@ static void ProcessPerfMetricAEN(struct megasas_instance *instance, MR_CTRL_IO_M
             // Set the flag to Stop collection.                                 
             instance->PerformanceMetric.LogOn = 0;
 
-            CopyPerfMetricData(instance, megasas_time_to_usecs(&current_time));
+            CopyPerfMetricData(instance, shards, megasas_time_to_usecs(&current_time));
         }
         break;
 
     case MR_CTRL_IO_METRICS_CMD_START:
 
-        // Save the previously collected data.
+        // Save the previously collected data before the shards get resized.
 	    if (instance->PerformanceMetric.LogOn)
-		    CopyPerfMetricData(instance, megasas_time_to_usecs(&current_time));
+		    CopyPerfMetricData(instance, shards, megasas_time_to_usecs(&current_time));
+
+	    resized = megasas_alloc_io_metric_shards(instance);
+	    shards = rcu_dereference_protected(instance->PerformanceMetric.IoMetricsShard,
+					       lockdep_is_held(&instance->reset_mutex));
+	    if (!shards) {
+		    dev_err(&instance->pdev->dev, "no memory for IO metric collection\n");
+		    break;
+	    }
+
+        // Drop what trickled in since the stop, new shards start from zero.
+	    if (!instance->PerformanceMetric.LogOn || (resized > 0))
+		    FoldPerfMetricShards(shards, instance->PerformanceMetric.BaseIoMetricsLD);
 
         //Initialize the timers.                                                
         instance->PerformanceMetric.CollectStartTime = megasas_time_to_usecs(&current_time);
         for (i=0;i <MAX_PERF_COLLECTION_VD ; i++ )
-            instance->PerformanceMetric.LastIOTime[i]  = megasas_time_to_usecs(&current_time);
+            instance->PerformanceMetric.LastIOTime[i]  = jiffies;
 
         // Set the flag to start collection.                                    
         instance->PerformanceMetric.LogOn = 1;
@@ -1611,13 +2083,16 @@ static void ProcessPerfMetricRequest(struct megasas_instance *instance, u8* ioct
 {
         MR_IO_METRICS *pIOMetric = (MR_IO_METRICS *)ioctlBuffer;
         MR_IO_METRICS_LD_OVERALL_LIST   *pldIoMetrics = (MR_IO_METRICS_LD_OVERALL_LIST *)(ioctlBuffer + pIOMetric->ctrlIoCache.size);
+	unsigned long flags;
 
+	spin_lock_irqsave(&instance->hba_lock, flags);
 	if (instance->CurLdCount) {
 		pldIoMetrics->size = (sizeof(MR_IO_METRICS_LD_OVERALL)*(min((u32)MAX_PERF_COLLECTION_VD, instance->CurLdCount) -1) + sizeof(MR_IO_METRICS_LD_OVERALL_LIST));
 		if ((pldIoMetrics->size + pIOMetric->ctrlIoCache.size) <= dataTransferlength)
 			memcpy(&pldIoMetrics->ldIOOverall[0], instance->PerformanceMetric.SavedIoMetricsLD, sizeof(MR_IO_METRICS_LD_OVERALL)*min((u32)MAX_PERF_COLLECTION_VD, instance->CurLdCount));
 	}
 	pldIoMetrics->collectionPeriod = instance->PerformanceMetric.SavedCollectTimeSecs;
+	spin_unlock_irqrestore(&instance->hba_lock, flags);
 }
 
 /**
@@ -1636,7 +2111,6 @@ megasas_build_ldio(struct megasas_instance *instance, struct scsi_cmnd *scp,
 	u8 sc = scp->cmnd[0];
 	u16 flags = 0;
 	struct megasas_io_frame *ldio;
-	unsigned long spinlock_flags;
 	u64 lba;
 
 	device_id = MEGASAS_DEV_INDEX(scp);
@@ -1756,11 +2230,11 @@ megasas_build_ldio(struct megasas_instance *instance, struct scsi_cmnd *scp,
 	cmd->frame_count = megasas_get_frame_count(instance,
 			ldio->sge_count, IO_FRAME);
 
-        lba     = (u64)ldio->start_lba_hi << 32 | ldio->start_lba_lo;
-        spin_lock_irqsave(&instance->hba_lock, spinlock_flags);
-        UpdateIOMetric(instance, device_id, ldio->cmd == MFI_CMD_LD_READ ? 1 : 0, lba, ldio->lba_count,
+	if (instance->PerformanceMetric.LogOn) {
+		lba = (u64)ldio->start_lba_hi << 32 | ldio->start_lba_lo;
+		UpdateIOMetric(instance, device_id, ldio->cmd == MFI_CMD_LD_READ ? 1 : 0, lba, ldio->lba_count,
 			scp->device->sector_size);
-        spin_unlock_irqrestore(&instance->hba_lock, spinlock_flags);
+	}
 
 	return cmd->frame_count;
 }
@@ -1812,7 +2286,7 @@ megasas_dump_pending_frames(struct megasas_instance *instance)
 	u32 max_cmd = instance->max_fw_cmds;
 
 	printk(KERN_ERR "\nmegasas[%d]: Dumping Frame Phys Address of all pending cmds in FW\n",instance->host->host_no);
-	printk(KERN_ERR "megasas[%d]: Total OS Pending cmds : %d\n",instance->host->host_no,atomic_read(&instance->fw_outstanding));
+	printk(KERN_ERR "megasas[%d]: Total OS Pending cmds : %d\n",instance->host->host_no,megasas_outstanding_read(&instance->fw_outstanding));
 	if (IS_DMA64)
 		printk(KERN_ERR "\nmegasas[%d]: 64 bit SGLs were sent to FW\n",instance->host->host_no);
 	else
@@ -1899,7 +2373,7 @@ megasas_build_and_issue_cmd(struct megasas_instance *instance, struct scsi_cmnd
 	/*
 	 * Issue the command to the FW
 	 */
-	atomic_inc(&instance->fw_outstanding);
+	megasas_outstanding_inc(&instance->fw_outstanding);
 
 	instance->instancet->fire_cmd(instance, cmd->frame_phys_addr,
 				cmd->frame_count-1, instance->reg_set);
@@ -2064,10 +2538,13 @@ void megasas_set_dynamic_target_properties(struct scsi_device *sdev, bool is_tar
 	if (MEGASAS_IS_LOGICAL(sdev)) {
 		device_id = ((sdev->channel % 2) * MEGASAS_MAX_DEV_PER_CHANNEL)
 					+ sdev->id;
-		local_map_ptr = fusion->ld_drv_map[(instance->map_id & 1)];
+		rcu_read_lock();
+		local_map_ptr = rcu_dereference(fusion->cur_drv_map);
 		ld = MR_TargetIdToLdGet(device_id, local_map_ptr);
-		if ((ld >= instance->fw_supported_vd_count))
+		if ((ld >= instance->fw_supported_vd_count)) {
+			rcu_read_unlock();
 			return;
+		}
 		raid = MR_LdRaidGet(ld, local_map_ptr);
 
 		if (raid->capability.ldPiMode == MR_PROT_INFO_TYPE_CONTROLLER)
@@ -2075,6 +2552,7 @@ void megasas_set_dynamic_target_properties(struct scsi_device *sdev, bool is_tar
 
 		mr_device_priv_data->is_tm_capable = 
 			raid->capability.tmCapable;
+		rcu_read_unlock();
 	} else if (instance->use_seqnum_jbod_fp) {
 				pd_index = (sdev->channel * MEGASAS_MAX_DEV_PER_CHANNEL) + 
 					sdev->id;
@@ -3306,71 +3784,291 @@ int megasas_handle_cpx_requests( struct megasas_instance *instance)
 	return 0;
 }
 
- /**
-  * megasas_check_and_restore_queue_depth - Check if queue depth needs to be 
-  *					restored to max value
-  * @instance:			Adapter soft state
-  *
-  */
-void
-megasas_check_and_restore_queue_depth(struct megasas_instance *instance)
+/**
+ * megasas_qd_signal -	Report congestion to the adaptive queue depth control
+ * @instance:		Adapter soft state
+ * @sdev:		Device the signal belongs to
+ * @reason:		MEGASAS_QD_TIMEOUT, MEGASAS_QD_BUSY or MEGASAS_QD_LATENCY
+ *
+ * Any context. Only counts the signal, megasas_qd_work() acts on it at
+ * the next tick.
+ */
+void megasas_qd_signal(struct megasas_instance *instance,
+		       struct scsi_device *sdev, u8 reason)
 {
-	unsigned long flags;
-	
-	if (instance->flag & MEGASAS_FW_BUSY
-	    && time_after(jiffies, instance->last_time + 5 * HZ)
-	    && atomic_read(&instance->fw_outstanding) <
-	    instance->throttlequeuedepth + 1) {
+	struct MR_PRIV_DEVICE *mr_device_priv_data = sdev->hostdata;
 
-		spin_lock_irqsave(instance->host->host_lock, flags);
-		instance->flag &= ~MEGASAS_FW_BUSY;
-		instance->host->can_queue = instance->cur_can_queue;
-		
-		spin_unlock_irqrestore(instance->host->host_lock, flags);
-	}
+	if (!instance->qd_ctrl.enabled || !mr_device_priv_data)
+		return;
+
+	atomic_inc(&mr_device_priv_data->qd_signals[reason]);
+	if (!delayed_work_pending(&instance->qd_ctrl.work))
+		schedule_delayed_work(&instance->qd_ctrl.work, MEGASAS_QD_TICK);
 }
 
 /**
- * megasas_complete_cmd_dpc	 -	Returns FW's controller structure
- * @instance_addr:			Address of adapter soft state
+ * megasas_qd_restart -	Pick up the adaptive queue depth ramp again
+ * @instance:		Adapter soft state
  *
- * Tasklet to complete cmds
+ * megasas_qd_work() stops while the adapter is not operational, call this
+ * once OCR or resume brought it back.
  */
-static void megasas_complete_cmd_dpc(unsigned long instance_addr)
+void megasas_qd_restart(struct megasas_instance *instance)
 {
-	u32 producer;
-	u32 consumer;
-	u32 context;
-	struct megasas_cmd *cmd;
-	struct megasas_instance *instance =
-				(struct megasas_instance *)instance_addr;
-	unsigned long flags;
+	if (instance->qd_ctrl.enabled && !instance->unload)
+		schedule_delayed_work(&instance->qd_ctrl.work, MEGASAS_QD_TICK);
+}
 
-	/* If we have already declared adapter dead, donot complete cmds */
-	if (atomic_read(&instance->adprecovery) == MEGASAS_HW_CRITICAL_ERROR )
-		return;
+static void megasas_qd_record(struct megasas_qd_ctrl *qd, u16 target,
+			      u32 old_depth, u32 new_depth, u8 reason)
+{
+	struct megasas_qd_event *ev;
 
-	spin_lock_irqsave(&instance->completion_lock, flags);
+	if (new_depth < old_depth)
+		qd->decreases++;
+	else
+		qd->increases++;
 
-	producer = le32_to_cpu(*instance->producer);
-	consumer = le32_to_cpu(*instance->consumer);
+	spin_lock_bh(&qd->lock);
+	ev = &qd->history[qd->history_next++ % MEGASAS_QD_HISTORY];
+	ev->time = jiffies;
+	ev->target = target;
+	ev->old_depth = old_depth;
+	ev->new_depth = new_depth;
+	ev->reason = reason;
+	spin_unlock_bh(&qd->lock);
+}
 
-	while (consumer != producer) {
-		context = le32_to_cpu(instance->reply_queue[consumer]);
-		if (context >= instance->max_fw_cmds) {
-			printk("ERROR ERROR: unexpected context value %x\n", context);
-			BUG();
-		}
+/*
+ * megasas_qd_next_depth -	One AIMD step
+ * @depth:			Current depth
+ * @max_depth:			Full depth
+ * @min_depth:			Floor of a decrease
+ * @reason:			Strongest signal of the tick, negative if none
+ * @hold:			No increase before this, pushed out on decrease
+ * @step_div:			Additive increase is max_depth / step_div
+ */
+static u32 megasas_qd_next_depth(u32 depth, u32 max_depth, u32 min_depth,
+				 int reason, unsigned long *hold, u32 step_div)
+{
+	if (reason >= 0) {
+		*hold = jiffies + MEGASAS_QD_HOLD;
+		depth = (reason == MEGASAS_QD_LATENCY) ?
+			depth * 3 / 4 : depth / 2;
+		return max(depth, min_depth);
+	}
 
-		cmd = instance->cmd_list[context];
+	if ((depth >= max_depth) || time_before(jiffies, *hold))
+		return depth;
 
-		megasas_complete_cmd(instance, cmd, DID_OK);
+	return min(max_depth, depth + max(1U, max_depth / step_div));
+}
 
-		consumer++;
-		if (consumer == (instance->max_fw_cmds + 1)) {
-			consumer = 0;
-		}
-	}
+/*
+ * megasas_qd_adjust_device -	Apply one tick to a device
+ *
+ * Returns the strongest congestion signal the device had, or -1.
+ */
+static int megasas_qd_adjust_device(struct megasas_instance *instance,
+				    struct scsi_device *sdev)
+{
+	struct MR_PRIV_DEVICE *mr_device_priv_data = sdev->hostdata;
+	struct megasas_qd_ctrl *qd = &instance->qd_ctrl;
+	int i, count, reason = -1;
+	u32 depth, new_depth;
+
+	for (i = 0; i < MEGASAS_QD_SIGNALS; i++) {
+		count = atomic_xchg(&mr_device_priv_data->qd_signals[i], 0);
+		if ((i == MEGASAS_QD_LATENCY) && (count < MEGASAS_QD_SLOW_MIN))
+			continue;
+		if (count && (reason < 0))
+			reason = i;
+	}
+
+	/* depth changed behind our back, start over from there */
+	if (mr_device_priv_data->qd_depth &&
+	    (sdev->queue_depth != mr_device_priv_data->qd_depth))
+		mr_device_priv_data->qd_depth = 0;
+
+	if (!mr_device_priv_data->qd_depth) {
+		if (reason < 0)
+			return reason;
+		mr_device_priv_data->qd_max = sdev->queue_depth;
+		mr_device_priv_data->qd_depth = sdev->queue_depth;
+	}
+
+	depth = mr_device_priv_data->qd_depth;
+	new_depth = megasas_qd_next_depth(depth, mr_device_priv_data->qd_max,
+					  1, reason,
+					  &mr_device_priv_data->qd_hold, 16);
+	if (new_depth != depth) {
+		megasas_update_device_queue_depth(sdev, new_depth);
+		megasas_qd_record(qd, (sdev->channel * MEGASAS_MAX_DEV_PER_CHANNEL) +
+				  sdev->id, depth, new_depth, (reason >= 0) ? reason :
+				  (new_depth == mr_device_priv_data->qd_max) ?
+				  MEGASAS_QD_RESTORED : MEGASAS_QD_INCREASE);
+	}
+	mr_device_priv_data->qd_depth =
+		(new_depth == mr_device_priv_data->qd_max) ? 0 : new_depth;
+
+	return reason;
+}
+
+/**
+ * megasas_qd_work -	Adaptive queue depth control tick
+ * @work:		qd_ctrl.work of the adapter
+ *
+ * Runs every MEGASAS_QD_TICK while any depth is below its maximum, and is
+ * kicked by megasas_qd_signal() otherwise. It stops while the adapter is
+ * in reset or dead, megasas_qd_restart() resumes it after OCR. A device that signalled is
+ * throttled on its own, so one slow drive no longer takes the adapter
+ * queue depth down. The adapter depth follows congestion seen on several
+ * devices at once and the mean latency against qd_latency_target.
+ */
+static void megasas_qd_work(struct work_struct *work)
+{
+	struct megasas_qd_ctrl *qd =
+		container_of(work, struct megasas_qd_ctrl, work.work);
+	struct megasas_instance *instance =
+		container_of(qd, struct megasas_instance, qd_ctrl);
+	struct megasas_qd_lat *lat;
+	struct scsi_device *sdev;
+	u32 max_depth, new_depth, spread = 0;
+	u64 sum = 0, count = 0;
+	unsigned long flags;
+	int cpu, reason, host_reason = -1;
+	bool throttled = false;
+
+	if (atomic_read(&instance->adprecovery) != MEGASAS_HBA_OPERATIONAL)
+		return;
+
+	shost_for_each_device(sdev, instance->host) {
+		if (!sdev->hostdata)
+			continue;
+		reason = megasas_qd_adjust_device(instance, sdev);
+		if ((reason >= 0) && (reason != MEGASAS_QD_LATENCY)) {
+			spread++;
+			if ((host_reason < 0) || (reason < host_reason))
+				host_reason = reason;
+		}
+		if (((struct MR_PRIV_DEVICE *)sdev->hostdata)->qd_depth)
+			throttled = true;
+	}
+	if (spread < MEGASAS_QD_HOST_SPREAD)
+		host_reason = -1;
+
+	if (qd->lat) {
+		for_each_possible_cpu(cpu) {
+			lat = per_cpu_ptr(qd->lat, cpu);
+			sum += lat->sum_ns;
+			count += lat->count;
+		}
+		if (count - qd->lat_count >= MEGASAS_QD_LAT_MIN_SAMPLES) {
+			qd->lat_mean_us = div64_u64(sum - qd->lat_sum_ns,
+				(count - qd->lat_count) * NSEC_PER_USEC);
+			if ((host_reason < 0) &&
+			    ((u64)qd->lat_mean_us * NSEC_PER_USEC > qd->lat_target_ns))
+				host_reason = MEGASAS_QD_LATENCY;
+			qd->lat_sum_ns = sum;
+			qd->lat_count = count;
+		}
+	}
+
+	/* OCR or the fixed throttle changed can_queue, continue from there */
+	max_depth = instance->cur_can_queue;
+	if (qd->depth != instance->host->can_queue)
+		qd->depth = min_t(u32, instance->host->can_queue, max_depth);
+
+	new_depth = megasas_qd_next_depth(qd->depth, max_depth,
+					  instance->throttlequeuedepth,
+					  host_reason, &qd->hold, 32);
+	if (new_depth != qd->depth) {
+		spin_lock_irqsave(instance->host->host_lock, flags);
+		instance->host->can_queue = new_depth;
+		megasas_outstanding_set_limit(&instance->fw_outstanding,
+			new_depth);
+		spin_unlock_irqrestore(instance->host->host_lock, flags);
+
+		megasas_qd_record(qd, MEGASAS_QD_HOST, qd->depth, new_depth,
+				  (host_reason >= 0) ? host_reason :
+				  (new_depth == max_depth) ?
+				  MEGASAS_QD_RESTORED : MEGASAS_QD_INCREASE);
+		qd->depth = new_depth;
+	}
+	if (qd->depth < max_depth)
+		throttled = true;
+
+	if (throttled && !instance->unload)
+		schedule_delayed_work(&qd->work, MEGASAS_QD_TICK);
+}
+
+ /**
+  * megasas_check_and_restore_queue_depth - Check if queue depth needs to be 
+  *					restored to max value
+  * @instance:			Adapter soft state
+  *
+  */
+void
+megasas_check_and_restore_queue_depth(struct megasas_instance *instance)
+{
+	unsigned long flags;
+	
+	if (instance->flag & MEGASAS_FW_BUSY
+	    && time_after(jiffies, instance->last_time + 5 * HZ)
+	    && megasas_outstanding_read(&instance->fw_outstanding) <
+	    instance->throttlequeuedepth + 1) {
+
+		spin_lock_irqsave(instance->host->host_lock, flags);
+		instance->flag &= ~MEGASAS_FW_BUSY;
+		instance->host->can_queue = instance->cur_can_queue;
+		megasas_outstanding_set_limit(&instance->fw_outstanding,
+			instance->cur_can_queue);
+		
+		spin_unlock_irqrestore(instance->host->host_lock, flags);
+	}
+}
+
+/**
+ * megasas_complete_cmd_dpc	 -	Returns FW's controller structure
+ * @instance_addr:			Address of adapter soft state
+ *
+ * Tasklet to complete cmds
+ */
+static void megasas_complete_cmd_dpc(unsigned long instance_addr)
+{
+	u32 producer;
+	u32 consumer;
+	u32 context;
+	struct megasas_cmd *cmd;
+	struct megasas_instance *instance =
+				(struct megasas_instance *)instance_addr;
+	unsigned long flags;
+
+	/* If we have already declared adapter dead, donot complete cmds */
+	if (atomic_read(&instance->adprecovery) == MEGASAS_HW_CRITICAL_ERROR )
+		return;
+
+	spin_lock_irqsave(&instance->completion_lock, flags);
+
+	producer = le32_to_cpu(*instance->producer);
+	consumer = le32_to_cpu(*instance->consumer);
+
+	while (consumer != producer) {
+		context = le32_to_cpu(instance->reply_queue[consumer]);
+		if (context >= instance->max_fw_cmds) {
+			printk("ERROR ERROR: unexpected context value %x\n", context);
+			BUG();
+		}
+
+		cmd = instance->cmd_list[context];
+
+		megasas_complete_cmd(instance, cmd, DID_OK);
+
+		consumer++;
+		if (consumer == (instance->max_fw_cmds + 1)) {
+			consumer = 0;
+		}
+	}
 
 	*instance->consumer = cpu_to_le32(producer);
 
@@ -3420,7 +4118,7 @@ void megasas_do_ocr(struct megasas_instance *instance)
 		atomic_set(&instance->adprecovery, MEGASAS_ADPRESET_SM_INFAULT);
        instance->issuepend_done = 0;
 
-       atomic_set(&instance->fw_outstanding, 0);
+       megasas_outstanding_reset(&instance->fw_outstanding);
        megasas_internal_reset_defer_cmds(instance);
        process_fw_state_change_wq(&instance->work_init);
 }
@@ -3835,7 +4533,7 @@ static int megasas_wait_for_outstanding(struct megasas_instance *instance)
 		__func__, __LINE__);
 
 	for (i = 0; i < resetwaittime; i++) {
-		outstanding = atomic_read(&instance->fw_outstanding);
+		outstanding = megasas_outstanding_read(&instance->fw_outstanding);
 
 		if (!outstanding)
 			break;
@@ -3855,7 +4553,7 @@ static int megasas_wait_for_outstanding(struct megasas_instance *instance)
 	}
 
 	i = 0;
-	outstanding = atomic_read(&instance->fw_outstanding);
+	outstanding = megasas_outstanding_read(&instance->fw_outstanding);
 	fw_state = instance->instancet->read_fw_status_reg(instance->reg_set) & MFI_STATE_MASK;
 
 	if((!outstanding && (fw_state == MFI_STATE_OPERATIONAL)))
@@ -3865,10 +4563,10 @@ static int megasas_wait_for_outstanding(struct megasas_instance *instance)
 		goto kill_hba_and_failed;
 		
 	do {
-                if ((fw_state == MFI_STATE_FAULT) || atomic_read(&instance->fw_outstanding) ) {
+                if ((fw_state == MFI_STATE_FAULT) || megasas_outstanding_read(&instance->fw_outstanding) ) {
 			dev_info(&instance->pdev->dev,
 				"%s:%d waiting_for_outstanding: before issue OCR. FW state = 0x%x, oustanding 0x%x\n",
-				__func__, __LINE__, fw_state, atomic_read(&instance->fw_outstanding));
+				__func__, __LINE__, fw_state, megasas_outstanding_read(&instance->fw_outstanding));
 			if (i == 3)
 				goto kill_hba_and_failed;
                         megasas_do_ocr(instance);
@@ -3885,7 +4583,7 @@ static int megasas_wait_for_outstanding(struct megasas_instance *instance)
                         for (sl=0; sl<10; sl++)
                                 msleep(500);
 
-			outstanding = atomic_read(&instance->fw_outstanding);
+			outstanding = megasas_outstanding_read(&instance->fw_outstanding);
 
                 	fw_state = instance->instancet->read_fw_status_reg(instance->reg_set) & MFI_STATE_MASK;
 			if((!outstanding && (fw_state == MFI_STATE_OPERATIONAL)))
@@ -3906,7 +4604,7 @@ kill_hba_and_failed:
 	dev_info(&instance->pdev->dev, "%s:%d killing adapter scsi%d"
 	 " disableOnlineCtrlReset %d fw_outstanding %d \n",
 		__func__, __LINE__, instance->host->host_no, instance->disableOnlineCtrlReset,
-		atomic_read(&instance->fw_outstanding));
+		megasas_outstanding_read(&instance->fw_outstanding));
 	megasas_dump_pending_frames(instance);
 	megaraid_sas_kill_hba(instance);
 
@@ -3953,8 +4651,9 @@ static int megasas_generic_reset(struct scsi_cmnd *scmd)
  * megasas_reset_timer - quiesce the adapter if required
  * @scmd:		scsi cmnd
  *
- * Sets the FW busy flag and reduces the host->can_queue if the
- * cmd has not been completed within the timeout period.
+ * Reports the timeout to the adaptive queue depth control, or with
+ * adaptive_qd=0 sets the FW busy flag and reduces the host->can_queue if
+ * the cmd has not been completed within the timeout period.
  */
 static enum
 blk_eh_timer_return megasas_reset_timer(struct scsi_cmnd *scmd)
@@ -3968,11 +4667,18 @@ blk_eh_timer_return megasas_reset_timer(struct scsi_cmnd *scmd)
 	}
 
 	instance = (struct megasas_instance *)scmd->device->host->hostdata;
+	if (instance->qd_ctrl.enabled) {
+		megasas_qd_signal(instance, scmd->device, MEGASAS_QD_TIMEOUT);
+		return BLK_EH_RESET_TIMER;
+	}
+
 	if (!(instance->flag & MEGASAS_FW_BUSY)) {
 		/* FW is busy, throttle IO */
 		spin_lock_irqsave(instance->host->host_lock, flags);
 
 		instance->host->can_queue = instance->throttlequeuedepth;
+		megasas_outstanding_set_limit(&instance->fw_outstanding,
+			instance->throttlequeuedepth);
 		instance->last_time = jiffies;
 		instance->flag |= MEGASAS_FW_BUSY;
 
@@ -4011,7 +4717,7 @@ static int megasas_reset_bus_host(struct scsi_cmnd *scmd)
 	scmd_printk(KERN_INFO, scmd, "Controller reset is requested due to IO timeout\n"
 		"SCSI command pointer: (%p)\t SCSI host state: %d\t SCSI host busy: %d\t FW outstanding: %d\n",
 		scmd, scmd->device->host->shost_state, atomic_read((atomic_t *)&scmd->device->host->host_busy),
-		atomic_read(&instance->fw_outstanding));
+		megasas_outstanding_read(&instance->fw_outstanding));
 
 	if (instance->adapter_type == MFI_SERIES)
 		ret = megasas_generic_reset(scmd);
@@ -4186,6 +4892,9 @@ scan_target:
 
 	atomic_set(&mr_device_priv_data->r1_ldio_hint,
 			instance->r1_ldio_hint_default);
+	/* INQUIRY is issued before slave_configure, set the template up here */
+	if (instance->adapter_type != MFI_SERIES)
+		megasas_init_io_frame_template(instance, sdev);
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0))
 	sdev->tagged_supported = 1;
 	scsi_activate_tcq(sdev, sdev->queue_depth);
@@ -4379,7 +5088,7 @@ megasas_ldio_outstanding_show (struct device *cdev, struct device_attribute *att
         struct Scsi_Host *shost = class_to_shost(cdev);
         struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
 
-        return snprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&instance->ldio_outstanding));
+        return snprintf(buf, PAGE_SIZE, "%d\n", megasas_outstanding_read(&instance->ldio_outstanding));
 }
 
 static ssize_t
@@ -4389,7 +5098,7 @@ megasas_fw_cmds_outstanding_show(struct device *cdev, struct device_attribute *a
         struct Scsi_Host *shost = class_to_shost(cdev);
         struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
 
-        return snprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&instance->fw_outstanding));
+        return snprintf(buf, PAGE_SIZE, "%d\n", megasas_outstanding_read(&instance->fw_outstanding));
 }
 
 static ssize_t
@@ -4398,11 +5107,285 @@ megasas_sgl_type_io_stats_show(struct device *cdev, struct device_attribute *att
 {
 	struct Scsi_Host *shost = class_to_shost(cdev);
 	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+	u64 ieee_ns, prp_ns;
+	u32 timed;
+
+	/* average build time of the SGL_BUILD_STATS timed builds */
+	ieee_ns = atomic64_read(&instance->ieee_sgl_build_ns);
+	timed = atomic_read(&instance->ieee_sgl_timed);
+	if (timed)
+		do_div(ieee_ns, timed);
+	prp_ns = atomic64_read(&instance->prp_sgl_build_ns);
+	timed = atomic_read(&instance->prp_sgl_timed);
+	if (timed)
+		do_div(prp_ns, timed);
 
 	return snprintf(buf, PAGE_SIZE, "IEEE SGL IOs: %d\t PRP SGL IOs: %d\t R1 FP writes count: %d\t"
-		" SGE holes: %d/%d/%d\n", atomic_read(&instance->ieee_sgl), atomic_read(&instance->prp_sgl),
+		" SGE holes: %d/%d/%d\t SGL build ns (IEEE/PRP): %llu/%llu\n",
+		atomic_read(&instance->ieee_sgl), atomic_read(&instance->prp_sgl),
 		atomic_read(&instance->r1_fp_writes_count), atomic_read(&instance->sge_holes_type1),
-		atomic_read(&instance->sge_holes_type2), atomic_read(&instance->sge_holes_type3));
+		atomic_read(&instance->sge_holes_type2), atomic_read(&instance->sge_holes_type3),
+		(unsigned long long)ieee_ns, (unsigned long long)prp_ns);
+}
+
+static ssize_t
+megasas_reply_queue_map_show(struct device *cdev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+	unsigned int cpu;
+	ssize_t len = 0;
+
+	if (!instance->reply_map)
+		return 0;
+
+	for_each_online_cpu(cpu)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+			"cpu %u node %d reply queue %u\n", cpu,
+			cpu_to_node(cpu), instance->reply_map[cpu]);
+
+	return len;
+}
+
+static ssize_t
+megasas_irq_poll_enable_store(struct device *cdev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+	u32 val = 0;
+
+	if (sscanf(buf, "%u", &val) != 1)
+		return -EINVAL;
+
+	if (instance->adapter_type == MFI_SERIES)
+		return -EINVAL;
+
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+	instance->irq_poll_enable = val ? 1 : 0;
+	return strlen(buf);
+#else
+	return -EINVAL;
+#endif
+}
+
+static ssize_t
+megasas_irq_poll_enable_show(struct device *cdev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+
+	return snprintf(buf, PAGE_SIZE, "%d (budget %u)\n",
+		(instance->irq_poll_enable && instance->msix_vectors) ? 1 : 0,
+		instance->irq_poll_budget);
+}
+
+static ssize_t
+megasas_hybrid_poll_us_store(struct device *cdev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+	u32 val = 0;
+
+	if (sscanf(buf, "%u", &val) != 1)
+		return -EINVAL;
+
+	if ((instance->adapter_type == MFI_SERIES) ||
+	    (val > MEGASAS_HYBRID_POLL_MAX_US))
+		return -EINVAL;
+
+	/* the gate count went stale while polling was off */
+	if (!instance->hybrid_poll_us)
+		atomic_set(&instance->hybrid_poll_qd, 0);
+	instance->hybrid_poll_us = val;
+	return strlen(buf);
+}
+
+static ssize_t
+megasas_hybrid_poll_us_show(struct device *cdev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", instance->hybrid_poll_us);
+}
+
+static ssize_t
+megasas_reply_queue_stats_show(struct device *cdev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+	struct megasas_irq_context *irq_context;
+	ssize_t len = 0;
+	u32 i;
+
+	for (i = 0; i < instance->msix_vectors; i++) {
+		irq_context = &instance->irq_context[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+			"queue %u irq %llu polled %llu poll_miss %llu window_ns %llu\n",
+			i, (unsigned long long)atomic64_read(&irq_context->irq_completions),
+			(unsigned long long)atomic64_read(&irq_context->polled_completions),
+			(unsigned long long)atomic64_read(&irq_context->poll_misses),
+			(unsigned long long)min_t(u64, irq_context->poll_window_ns,
+				(u64)instance->hybrid_poll_us * NSEC_PER_USEC));
+	}
+
+	return len;
+}
+
+static ssize_t
+megasas_stream_stats_show(struct device *cdev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+	struct fusion_context *fusion = instance->ctrl_context;
+	LD_STREAM_DETECT *current_ld_SD;
+	ssize_t len = 0;
+	u32 i;
+
+	if (!fusion || !fusion->streamDetectByLD)
+		return 0;
+
+	/* only LDs that saw read/write IO */
+	for (i = 0; i < MAX_LOGICAL_DRIVES_EXT; i++) {
+		current_ld_SD = fusion->streamDetectByLD[i];
+		if (!current_ld_SD->streamHits && !current_ld_SD->streamMisses)
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+			"ld %u hits %llu misses %llu\n", i,
+			(unsigned long long)current_ld_SD->streamHits,
+			(unsigned long long)current_ld_SD->streamMisses);
+	}
+
+	return len;
+}
+
+static ssize_t
+megasas_lb_stats_show(struct device *cdev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+	struct fusion_context *fusion = instance->ctrl_context;
+	PLD_LOAD_BALANCE_INFO lbInfo;
+	ssize_t len = 0;
+	u32 i, slot, reads;
+	bool ld_shown;
+
+	if (!fusion || !fusion->load_balance_info)
+		return 0;
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "policy %u\n",
+			 instance->lb_policy);
+
+	/* reads per span:arm of load balanced LDs that saw reads */
+	for (i = 0; i < MAX_LOGICAL_DRIVES_EXT; i++) {
+		lbInfo = &fusion->load_balance_info[i];
+		if (!lbInfo->loadBalanceFlag || !lbInfo->slots)
+			continue;
+		ld_shown = false;
+		for (slot = 0; slot < MR_LB_SLOTS; slot++) {
+			reads = atomic_read(&lbInfo->slots[slot].arm_reads);
+			if (!reads)
+				continue;
+			if (!ld_shown) {
+				len += scnprintf(buf + len, PAGE_SIZE - len,
+						 "ld %u", i);
+				ld_shown = true;
+			}
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+				" %u:%u %u",
+				slot >> RAID_CTX_SPANARM_SPAN_SHIFT,
+				slot & RAID_CTX_SPANARM_ARM_MASK, reads);
+		}
+		if (ld_shown)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+
+	return len;
+}
+
+static ssize_t
+megasas_chain_stats_show(struct device *cdev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+	struct fusion_context *fusion = instance->ctrl_context;
+
+	if (!fusion || !fusion->chain_on_demand)
+		return 0;
+
+	return snprintf(buf, PAGE_SIZE, "in_use %d hwm %u reserve %u/%u"
+		" reserve_low %u fails %d\n",
+		atomic_read(&fusion->chain_frames_in_use),
+		fusion->chain_frames_hwm, fusion->chain_reserve_free,
+		MEGASAS_CHAIN_FRAME_RESERVE, fusion->chain_reserve_low,
+		atomic_read(&fusion->chain_frame_fails));
+}
+
+static ssize_t
+megasas_ocr_stats_show(struct device *cdev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+	struct fusion_context *fusion = instance->ctrl_context;
+
+	if (!fusion)
+		return 0;
+
+	/* stage times are in ms and belong to the last finished OCR */
+	return snprintf(buf, PAGE_SIZE, "count %u last %s quiesce %u flush %u"
+		" chip_reset %u ready %u ioc_init %u restore %u\n",
+		fusion->ocr_count,
+		!fusion->ocr_count ? "none" :
+		fusion->ocr_last_failed ? "failed" : "ok",
+		fusion->ocr_last_phase_ms[MEGASAS_OCR_PHASE_QUIESCE],
+		fusion->ocr_last_phase_ms[MEGASAS_OCR_PHASE_FLUSH],
+		fusion->ocr_last_phase_ms[MEGASAS_OCR_PHASE_CHIP_RESET],
+		fusion->ocr_last_phase_ms[MEGASAS_OCR_PHASE_READY],
+		fusion->ocr_last_phase_ms[MEGASAS_OCR_PHASE_IOC_INIT],
+		fusion->ocr_last_phase_ms[MEGASAS_OCR_PHASE_RESTORE]);
+}
+
+static ssize_t
+megasas_qd_state_show(struct device *cdev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(cdev);
+	struct megasas_instance *instance = (struct megasas_instance *)shost->hostdata;
+	struct megasas_qd_ctrl *qd = &instance->qd_ctrl;
+	struct MR_PRIV_DEVICE *mr_device_priv_data;
+	struct scsi_device *sdev;
+	ssize_t len;
+
+	len = scnprintf(buf, PAGE_SIZE, "adaptive %u depth %d/%u min %u"
+		" latency_us %u target_us %llu decreases %u increases %u\n",
+		qd->enabled, shost->can_queue, instance->cur_can_queue,
+		instance->throttlequeuedepth, qd->lat_mean_us,
+		div_u64(qd->lat_target_ns, NSEC_PER_USEC),
+		qd->decreases, qd->increases);
+
+	/* throttled devices */
+	shost_for_each_device(sdev, shost) {
+		mr_device_priv_data = sdev->hostdata;
+		if (!mr_device_priv_data || !mr_device_priv_data->qd_depth)
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%d:%d:%llu depth %u/%u\n", sdev->channel,
+				 sdev->id, (unsigned long long)sdev->lun,
+				 mr_device_priv_data->qd_depth,
+				 mr_device_priv_data->qd_max);
+	}
+
+	return len;
 }
 
 static DEVICE_ATTR(fw_crash_buffer, S_IRUGO | S_IWUSR,
@@ -4421,6 +5404,24 @@ static DEVICE_ATTR(io_stats, S_IRUGO,
 		megasas_sgl_type_io_stats_show, NULL);
 static DEVICE_ATTR(ldio_hint_count, S_IRUGO | S_IWUSR,
 	megasas_ldio_hint_count_show, megasas_ldio_hint_count_store);
+static DEVICE_ATTR(reply_queue_map, S_IRUGO,
+	megasas_reply_queue_map_show, NULL);
+static DEVICE_ATTR(irq_poll_enable, S_IRUGO | S_IWUSR,
+	megasas_irq_poll_enable_show, megasas_irq_poll_enable_store);
+static DEVICE_ATTR(hybrid_poll_us, S_IRUGO | S_IWUSR,
+	megasas_hybrid_poll_us_show, megasas_hybrid_poll_us_store);
+static DEVICE_ATTR(reply_queue_stats, S_IRUGO,
+	megasas_reply_queue_stats_show, NULL);
+static DEVICE_ATTR(stream_stats, S_IRUGO,
+	megasas_stream_stats_show, NULL);
+static DEVICE_ATTR(lb_stats, S_IRUGO,
+	megasas_lb_stats_show, NULL);
+static DEVICE_ATTR(chain_stats, S_IRUGO,
+	megasas_chain_stats_show, NULL);
+static DEVICE_ATTR(ocr_stats, S_IRUGO,
+	megasas_ocr_stats_show, NULL);
+static DEVICE_ATTR(qd_state, S_IRUGO,
+	megasas_qd_state_show, NULL);
 
 struct device_attribute *megaraid_host_attrs[] = {
         &dev_attr_fw_crash_buffer_size,
@@ -4431,22 +5432,443 @@ struct device_attribute *megaraid_host_attrs[] = {
         &dev_attr_fw_cmds_outstanding,
 		&dev_attr_io_stats,
 		&dev_attr_ldio_hint_count,
+		&dev_attr_reply_queue_map,
+		&dev_attr_irq_poll_enable,
+		&dev_attr_hybrid_poll_us,
+		&dev_attr_reply_queue_stats,
+		&dev_attr_stream_stats,
+		&dev_attr_lb_stats,
+		&dev_attr_chain_stats,
+		&dev_attr_ocr_stats,
+		&dev_attr_qd_state,
         NULL,
 };
 
-/*
- * Scsi host template for megaraid_sas driver
- */
-static struct scsi_host_template megasas_template = {
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *megasas_debugfs_root;
 
-	.module = THIS_MODULE,
-	.name = "Avago SAS based MegaRAID driver",
-	.proc_name = "megaraid_sas",
-	.slave_configure = megasas_slave_configure,
-	.slave_alloc = megasas_slave_alloc,
-	.slave_destroy = megasas_slave_destroy,
-	.queuecommand = megasas_queue_command,
-	.eh_target_reset_handler = megasas_reset_target,
+/* indexed by MEGASAS_LAT_* */
+static const char *megasas_lat_hist_names[MEGASAS_LAT_HIST_MAX] = {
+	"vd_fw_read", "vd_fw_write", "vd_fp_read", "vd_fp_write",
+	"pd_fw_read", "pd_fw_write", "pd_fp_read", "pd_fp_write",
+	"r1_fp_write", "r1_peer_skew",
+};
+
+/* Lowest latency in usecs accounted to histogram bucket @idx */
+static u64 megasas_lat_bucket_lo(u32 idx)
+{
+	if (idx < (1 << MEGASAS_LAT_SUB_BITS))
+		return idx;
+
+	return (u64)((1 << MEGASAS_LAT_SUB_BITS) |
+		(idx & ((1 << MEGASAS_LAT_SUB_BITS) - 1))) <<
+		((idx >> MEGASAS_LAT_SUB_BITS) - 1);
+}
+
+/* Fold the per CPU latency histograms, caller vfree()s the result */
+static struct megasas_lat_hist *
+megasas_lat_hist_sum(struct fusion_context *fusion)
+{
+	struct megasas_lat_hist *sum, *hist;
+	int cpu, i, j;
+
+	sum = vzalloc(sizeof(*sum));
+	if (!sum)
+		return NULL;
+
+	for_each_possible_cpu(cpu) {
+		hist = per_cpu_ptr(fusion->lat_hist, cpu);
+		for (i = 0; i < MEGASAS_LAT_HIST_MAX; i++)
+			for (j = 0; j < MEGASAS_LAT_BUCKETS; j++)
+				sum->bucket[i][j] += hist->bucket[i][j];
+	}
+
+	return sum;
+}
+
+/*
+ * Upper bound in usecs of the bucket holding the @permyriad percentile,
+ * the last bucket is open ended and reports its lower bound.
+ */
+static u64 megasas_lat_percentile(u64 *bucket, u64 count, u32 permyriad)
+{
+	u64 target, seen = 0;
+	u32 i;
+
+	target = div_u64(count * permyriad + 9999, 10000);
+	for (i = 0; i < MEGASAS_LAT_BUCKETS - 1; i++) {
+		seen += bucket[i];
+		if (seen >= target)
+			return megasas_lat_bucket_lo(i + 1);
+	}
+
+	return megasas_lat_bucket_lo(MEGASAS_LAT_BUCKETS - 1);
+}
+
+static int megasas_debugfs_latency_show(struct seq_file *m, void *v)
+{
+	struct megasas_instance *instance = m->private;
+	struct megasas_lat_hist *sum;
+	u64 count;
+	int i, j;
+
+	sum = megasas_lat_hist_sum(instance->ctrl_context);
+	if (!sum)
+		return -ENOMEM;
+
+	seq_printf(m, "%-14s %14s %10s %10s %10s\n",
+		   "histogram", "count", "p50_us", "p99_us", "p999_us");
+	for (i = 0; i < MEGASAS_LAT_HIST_MAX; i++) {
+		count = 0;
+		for (j = 0; j < MEGASAS_LAT_BUCKETS; j++)
+			count += sum->bucket[i][j];
+		if (!count) {
+			seq_printf(m, "%-14s %14d %10s %10s %10s\n",
+				   megasas_lat_hist_names[i], 0, "-", "-", "-");
+			continue;
+		}
+		seq_printf(m, "%-14s %14llu %10llu %10llu %10llu\n",
+			   megasas_lat_hist_names[i], count,
+			   megasas_lat_percentile(sum->bucket[i], count, 5000),
+			   megasas_lat_percentile(sum->bucket[i], count, 9900),
+			   megasas_lat_percentile(sum->bucket[i], count, 9990));
+	}
+
+	vfree(sum);
+	return 0;
+}
+
+static int megasas_debugfs_latency_hist_show(struct seq_file *m, void *v)
+{
+	struct megasas_instance *instance = m->private;
+	struct megasas_lat_hist *sum;
+	int i, j;
+
+	sum = megasas_lat_hist_sum(instance->ctrl_context);
+	if (!sum)
+		return -ENOMEM;
+
+	for (i = 0; i < MEGASAS_LAT_HIST_MAX; i++)
+		for (j = 0; j < MEGASAS_LAT_BUCKETS; j++)
+			if (sum->bucket[i][j])
+				seq_printf(m, "%s %llu %llu\n",
+					   megasas_lat_hist_names[i],
+					   megasas_lat_bucket_lo(j),
+					   sum->bucket[i][j]);
+
+	vfree(sum);
+	return 0;
+}
+
+/* Any write clears the histograms */
+static ssize_t megasas_debugfs_latency_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct megasas_instance *instance = m->private;
+	struct fusion_context *fusion = instance->ctrl_context;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(fusion->lat_hist, cpu), 0,
+		       sizeof(struct megasas_lat_hist));
+
+	return count;
+}
+
+/* indexed by MEGASAS_FP_MISS_*, NONE is not a miss */
+static const char *megasas_fp_miss_names[MEGASAS_FP_MISS_MAX] = {
+	NULL, "no_map", "not_capable", "cross_stripe", "span",
+	"pd_invalid", "r1_large", "r1_credit", "stream",
+};
+
+static int megasas_debugfs_fast_path_show(struct seq_file *m, void *v)
+{
+	struct megasas_instance *instance = m->private;
+	struct fusion_context *fusion = instance->ctrl_context;
+	struct megasas_fp_stats sum, *stats;
+	u64 ops;
+	u32 ld;
+	int cpu, i;
+
+	seq_printf(m, "%-4s %12s %14s %12s %14s %6s %12s %12s",
+		   "tgt", "fp_ops", "fp_bytes", "fw_ops", "fw_bytes", "fp_%",
+		   "region_lock", "ldio_busy");
+	for (i = MEGASAS_FP_MISS_NONE + 1; i < MEGASAS_FP_MISS_MAX; i++)
+		seq_printf(m, " %12s", megasas_fp_miss_names[i]);
+	seq_putc(m, '\n');
+
+	for (ld = 0; ld < MAX_LOGICAL_DRIVES_EXT; ld++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			stats = megasas_fp_stats_get(fusion, cpu, ld);
+			sum.fp_ops += stats->fp_ops;
+			sum.fp_bytes += stats->fp_bytes;
+			sum.fw_ops += stats->fw_ops;
+			sum.fw_bytes += stats->fw_bytes;
+			sum.region_lock += stats->region_lock;
+			sum.ldio_busy += stats->ldio_busy;
+			for (i = 0; i < MEGASAS_FP_MISS_MAX; i++)
+				sum.miss[i] += stats->miss[i];
+		}
+
+		ops = sum.fp_ops + sum.fw_ops;
+		if (!ops && !sum.ldio_busy)
+			continue;
+
+		seq_printf(m, "%-4u %12llu %14llu %12llu %14llu %6llu %12llu %12llu",
+			   ld, sum.fp_ops, sum.fp_bytes, sum.fw_ops, sum.fw_bytes,
+			   ops ? div64_u64(sum.fp_ops * 100, ops) : 0,
+			   sum.region_lock, sum.ldio_busy);
+		for (i = MEGASAS_FP_MISS_NONE + 1; i < MEGASAS_FP_MISS_MAX; i++)
+			seq_printf(m, " %12llu", sum.miss[i]);
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+/* Any write clears the counters */
+static ssize_t megasas_debugfs_fast_path_write(struct file *file,
+		const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct megasas_instance *instance = m->private;
+	struct fusion_context *fusion = instance->ctrl_context;
+
+	memset(fusion->fp_stats, 0, nr_cpu_ids * MAX_LOGICAL_DRIVES_EXT *
+	       sizeof(struct megasas_fp_stats));
+
+	return count;
+}
+
+/*
+ * The counters are nr_cpu_ids x MAX_LOGICAL_DRIVES_EXT entries, so they are
+ * only allocated, and counting only starts, once fast_path is first opened.
+ */
+static int megasas_debugfs_fast_path_open(struct inode *inode,
+					  struct file *file)
+{
+	struct megasas_instance *instance = inode->i_private;
+	struct fusion_context *fusion = instance->ctrl_context;
+	struct megasas_fp_stats *stats;
+
+	if (!fusion->fp_stats) {
+		stats = vzalloc(nr_cpu_ids * MAX_LOGICAL_DRIVES_EXT *
+				sizeof(struct megasas_fp_stats));
+		if (!stats)
+			return -ENOMEM;
+		/* cmpxchg orders the zeroing before the pointer, first open wins */
+		if (cmpxchg(&fusion->fp_stats, NULL, stats))
+			vfree(stats);
+	}
+
+	return single_open(file, megasas_debugfs_fast_path_show,
+			   inode->i_private);
+}
+
+/* indexed by MEGASAS_QD_* */
+static const char *megasas_qd_reason_names[] = {
+	"timeout", "busy", "latency", "increase", "restored",
+};
+
+static int megasas_debugfs_qd_history_show(struct seq_file *m, void *v)
+{
+	struct megasas_instance *instance = m->private;
+	struct megasas_qd_ctrl *qd = &instance->qd_ctrl;
+	struct megasas_qd_event ev;
+	u32 i, next;
+
+	seq_printf(m, "%10s %-8s %-8s %6s %6s\n",
+		   "ms_ago", "target", "reason", "old", "new");
+
+	/* newest first */
+	spin_lock_bh(&qd->lock);
+	next = qd->history_next;
+	for (i = 1; i <= min_t(u32, next, MEGASAS_QD_HISTORY); i++) {
+		ev = qd->history[(next - i) % MEGASAS_QD_HISTORY];
+		if (ev.target == MEGASAS_QD_HOST)
+			seq_printf(m, "%10u %-8s", jiffies_to_msecs(jiffies - ev.time),
+				   "host");
+		else
+			seq_printf(m, "%10u %-8u", jiffies_to_msecs(jiffies - ev.time),
+				   ev.target);
+		seq_printf(m, " %-8s %6u %6u\n", megasas_qd_reason_names[ev.reason],
+			   ev.old_depth, ev.new_depth);
+	}
+	spin_unlock_bh(&qd->lock);
+
+	return 0;
+}
+
+static int megasas_debugfs_qd_history_open(struct inode *inode,
+					   struct file *file)
+{
+	return single_open(file, megasas_debugfs_qd_history_show,
+			   inode->i_private);
+}
+
+static int megasas_debugfs_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, megasas_debugfs_latency_show, inode->i_private);
+}
+
+static int megasas_debugfs_latency_hist_open(struct inode *inode,
+					     struct file *file)
+{
+	return single_open(file, megasas_debugfs_latency_hist_show,
+			   inode->i_private);
+}
+
+static const struct file_operations megasas_debugfs_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = megasas_debugfs_latency_open,
+	.read = seq_read,
+	.write = megasas_debugfs_latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations megasas_debugfs_latency_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = megasas_debugfs_latency_hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations megasas_debugfs_qd_history_fops = {
+	.owner = THIS_MODULE,
+	.open = megasas_debugfs_qd_history_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations megasas_debugfs_fast_path_fops = {
+	.owner = THIS_MODULE,
+	.open = megasas_debugfs_fast_path_open,
+	.read = seq_read,
+	.write = megasas_debugfs_fast_path_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * megasas_setup_debugfs -	Create the per host debugfs directory
+ * @instance:			Adapter soft state
+ *
+ * latency		p50/p99/p999 per histogram in usecs, write to clear
+ * latency_hist		raw non empty buckets: histogram, lower bound us, count
+ * fast_path		per LD FP/FW split and FW path reasons since first open,
+ *			write to clear
+ * qd_history		last adaptive queue depth changes, newest first
+ *
+ * The histograms only fill while the LATENCY_HIST debug level is set.
+ */
+static void megasas_setup_debugfs(struct megasas_instance *instance)
+{
+	struct fusion_context *fusion = instance->ctrl_context;
+	struct dentry *dir;
+	char name[32];
+
+	if (!megasas_debugfs_root)
+		return;
+
+	snprintf(name, sizeof(name), "scsi_host%d", instance->host->host_no);
+	dir = debugfs_create_dir(name, megasas_debugfs_root);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+	instance->debugfs_root = dir;
+
+	debugfs_create_file("qd_history", S_IRUGO, dir, instance,
+			    &megasas_debugfs_qd_history_fops);
+
+	if (instance->adapter_type == MFI_SERIES)
+		return;
+
+	if (fusion->lat_hist) {
+		debugfs_create_file("latency", S_IRUGO | S_IWUSR, dir, instance,
+				    &megasas_debugfs_latency_fops);
+		debugfs_create_file("latency_hist", S_IRUGO, dir, instance,
+				    &megasas_debugfs_latency_hist_fops);
+	}
+	debugfs_create_file("fast_path", S_IRUGO | S_IWUSR, dir,
+			    instance, &megasas_debugfs_fast_path_fops);
+}
+
+static void megasas_destroy_debugfs(struct megasas_instance *instance)
+{
+	debugfs_remove_recursive(instance->debugfs_root);
+	instance->debugfs_root = NULL;
+}
+
+static void megasas_init_debugfs(void)
+{
+	megasas_debugfs_root = debugfs_create_dir("megaraid_sas", NULL);
+	if (IS_ERR(megasas_debugfs_root))
+		megasas_debugfs_root = NULL;
+}
+
+static void megasas_exit_debugfs(void)
+{
+	debugfs_remove_recursive(megasas_debugfs_root);
+	megasas_debugfs_root = NULL;
+}
+#else
+static inline void megasas_setup_debugfs(struct megasas_instance *instance) {}
+static inline void megasas_destroy_debugfs(struct megasas_instance *instance) {}
+static inline void megasas_init_debugfs(void) {}
+static inline void megasas_exit_debugfs(void) {}
+#endif
+
+#ifdef KERNEL_SUPPORT_BLK_MQ_MULTI_HWQ
+/**
+ * megasas_map_queues -	Map blk-mq hardware queues to CPUs
+ * @shost:		SCSI host
+ *
+ * With multiq_enable, hctx N is serviced by reply queue N, so use the
+ * managed affinity of the MSI-x vectors to build the CPU to hctx map.
+ */
+static int megasas_map_queues(struct Scsi_Host *shost)
+{
+	struct megasas_instance *instance;
+
+	instance = (struct megasas_instance *)shost->hostdata;
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0))
+	if (shost->nr_hw_queues == 1)
+		return blk_mq_map_queues(&shost->tag_set);
+#else
+	if (shost->nr_hw_queues == 1)
+		return blk_mq_map_queues(&shost->tag_set.map[HCTX_TYPE_DEFAULT]);
+#endif
+
+	/* the vector offset argument appeared in 4.17, queue maps in 5.0 */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0))
+	return blk_mq_pci_map_queues(&shost->tag_set, instance->pdev);
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0))
+	return blk_mq_pci_map_queues(&shost->tag_set, instance->pdev, 0);
+#else
+	return blk_mq_pci_map_queues(&shost->tag_set.map[HCTX_TYPE_DEFAULT],
+				     instance->pdev, 0);
+#endif
+}
+#endif
+
+/*
+ * Scsi host template for megaraid_sas driver
+ */
+static struct scsi_host_template megasas_template = {
+
+	.module = THIS_MODULE,
+	.name = "Avago SAS based MegaRAID driver",
+	.proc_name = "megaraid_sas",
+	.slave_configure = megasas_slave_configure,
+	.slave_alloc = megasas_slave_alloc,
+	.slave_destroy = megasas_slave_destroy,
+	.queuecommand = megasas_queue_command,
+	.eh_target_reset_handler = megasas_reset_target,
 	.eh_abort_handler = megasas_task_abort,
 	.eh_host_reset_handler = megasas_reset_bus_host,
 	.eh_timed_out = megasas_reset_timer,
@@ -4458,6 +5880,9 @@ static struct scsi_host_template megasas_template = {
 #else
 	.change_queue_depth = scsi_change_queue_depth,
 #endif
+#ifdef KERNEL_SUPPORT_BLK_MQ_MULTI_HWQ
+	.map_queues = megasas_map_queues,
+#endif
 };
 
 /**
@@ -4562,7 +5987,7 @@ megasas_complete_cmd(struct megasas_instance *instance, struct megasas_cmd *cmd,
 
 		if (exception) {
 
-			atomic_dec(&instance->fw_outstanding);
+			megasas_outstanding_put(&instance->fw_outstanding);
 
 			scsi_dma_unmap(cmd->scmd);
 			cmd->scmd->scsi_done(cmd->scmd);
@@ -4587,6 +6012,11 @@ megasas_complete_cmd(struct megasas_instance *instance, struct megasas_cmd *cmd,
 
 			cmd->scmd->result = (DID_OK << 16) | hdr->scsi_status;
 
+			if ((hdr->scsi_status == SAM_STAT_BUSY) ||
+			    (hdr->scsi_status == SAM_STAT_TASK_SET_FULL))
+				megasas_qd_signal(instance, cmd->scmd->device,
+						  MEGASAS_QD_BUSY);
+
 			if (hdr->scsi_status == SAM_STAT_CHECK_CONDITION) {
 				memset(cmd->scmd->sense_buffer, 0,
 				       SCSI_SENSE_BUFFERSIZE);
@@ -4610,7 +6040,7 @@ megasas_complete_cmd(struct megasas_instance *instance, struct megasas_cmd *cmd,
 			break;
 		}
 
-		atomic_dec(&instance->fw_outstanding);
+		megasas_outstanding_put(&instance->fw_outstanding);
 
 		scsi_dma_unmap(cmd->scmd);
 		cmd->scmd->scsi_done(cmd->scmd);
@@ -4630,7 +6060,6 @@ megasas_complete_cmd(struct megasas_instance *instance, struct megasas_cmd *cmd,
 		if ((opcode == MR_DCMD_LD_MAP_GET_INFO)
 			&& (cmd->frame->dcmd.mbox.b[1] == 1)) {
 	
-			fusion->fast_path_io = 0;
 			spin_lock_irqsave(instance->host->host_lock, flags);
 			status = cmd->frame->hdr.cmd_status;
 			instance->map_update_cmd = NULL;
@@ -4649,15 +6078,18 @@ megasas_complete_cmd(struct megasas_instance *instance, struct megasas_cmd *cmd,
 			
 			megasas_return_cmd(instance, cmd);
 
-			// Set fast path io to ZERO. Validate Map will set proper value. Meanwhile all IOs will go 
-			// as LD IO.
-			if ((status == MFI_STAT_OK) &&
-				(MR_ValidateMapInfo(instance, (instance->map_id + 1)))) {
-				instance->map_id++;
-				fusion->fast_path_io = 1;
-			} else
-				fusion->fast_path_io = 0;
-			
+			/*
+			 * The new map is converted and published from process
+			 * context; IOs keep using the current map, fast path
+			 * included, until it is swapped in.
+			 */
+			if (status == MFI_STAT_OK) {
+				spin_unlock_irqrestore(instance->host->host_lock, flags);
+				schedule_work(&instance->map_update_work);
+				break;
+			}
+
+			fusion->fast_path_io = 0;
 			megasas_sync_map_info(instance);
 			spin_unlock_irqrestore(instance->host->host_lock, flags);
 			break;
@@ -4758,7 +6190,7 @@ megasas_issue_pending_cmds_again(struct megasas_instance *instance)
 			instance->instancet->fire_cmd(instance,cmd->frame_phys_addr ,0,instance->reg_set);
 		} else if (cmd->scmd) {
 			printk("megasas: %p scsi command [%02x], %#lx detected on the internal reset queue, issue it again.\n", cmd, cmd->scmd->cmnd[0], cmd->scmd->serial_number);
-			atomic_inc(&instance->fw_outstanding);
+			megasas_outstanding_inc(&instance->fw_outstanding);
 			instance->instancet->fire_cmd(instance, cmd->frame_phys_addr ,cmd->frame_count-1,instance->reg_set);
 		}
 		else {
@@ -4841,7 +6273,7 @@ process_fw_state_change_wq(struct work_struct *work)
 			__func__, __LINE__);
 
 		instance->instancet->disable_intr(instance);
-                atomic_set(&instance->fw_outstanding, 0);
+                megasas_outstanding_reset(&instance->fw_outstanding);
 
                 atomic_set(&instance->fw_reset_no_pci_access, 1);
                 instance->instancet->adp_reset(instance, instance->reg_set);
@@ -4909,6 +6341,7 @@ process_fw_state_change_wq(struct work_struct *work)
 			__func__, __LINE__);
 		megasas_issue_pending_cmds_again(instance);
 		instance->issuepend_done = 1;
+		megasas_qd_restart(instance);
 	}
 	return ;
 }
@@ -4975,7 +6408,7 @@ megasas_deplete_reply_queue(struct megasas_instance *instance, u8 alt_status)
 
 			// The pending commands are moved to a deferred list. We would pick commands up and
 			// re-issue once the reset processing is over.
-			atomic_set(&instance->fw_outstanding, 0);
+			megasas_outstanding_reset(&instance->fw_outstanding);
 			megasas_internal_reset_defer_cmds(instance);
 
 			// Schedule a low-priorty thread to perform the function for current stage of
@@ -5355,7 +6788,8 @@ void megasas_free_cmds(struct megasas_instance *instance)
 	kfree(instance->cmd_list);
 	instance->cmd_list = NULL;
 
-	INIT_LIST_HEAD(&instance->cmd_pool);
+	kfree(instance->cmd_pool_bitmap);
+	instance->cmd_pool_bitmap = NULL;
 }
 
 /**
@@ -5374,7 +6808,8 @@ void megasas_free_cmds(struct megasas_instance *instance)
  * systems to the mininum. We always use 32 bit integers for the context. In
  * this driver, the 32 bit values are the indices into an array cmd_list.
  * This array is used only to look up the megasas_cmd given the context. The
- * free commands themselves are maintained in a linked list called cmd_pool.
+ * free commands themselves are tracked in cmd_pool_bitmap, a set bit means
+ * the command with that index is in use.
  */
 int megasas_alloc_cmds(struct megasas_instance *instance)
 {
@@ -5401,6 +6836,14 @@ int megasas_alloc_cmds(struct megasas_instance *instance)
 
 	memset(instance->cmd_list, 0, sizeof(struct megasas_cmd *) * max_cmd);
 
+	instance->cmd_pool_bitmap = kcalloc(BITS_TO_LONGS(max_cmd),
+					    sizeof(unsigned long), GFP_KERNEL);
+	if (!instance->cmd_pool_bitmap) {
+		kfree(instance->cmd_list);
+		instance->cmd_list = NULL;
+		return -ENOMEM;
+	}
+
 	for (i = 0; i < max_cmd; i++) {
 		instance->cmd_list[i] = kmalloc(sizeof(struct megasas_cmd),
 						GFP_KERNEL);
@@ -5412,6 +6855,8 @@ int megasas_alloc_cmds(struct megasas_instance *instance)
 
 			kfree(instance->cmd_list);
 			instance->cmd_list = NULL;
+			kfree(instance->cmd_pool_bitmap);
+			instance->cmd_pool_bitmap = NULL;
 
 			return -ENOMEM;
 		}
@@ -5423,8 +6868,7 @@ int megasas_alloc_cmds(struct megasas_instance *instance)
 		cmd->index = i;
 		cmd->scmd = NULL;
 		cmd->instance = instance;
-
-		list_add_tail(&cmd->list, &instance->cmd_pool);
+		INIT_LIST_HEAD(&cmd->list);
 	}
 
 	/*
@@ -6984,7 +8428,8 @@ static int megasas_init_fw(struct megasas_instance *instance)
 			goto fail_get_ld_pd_list;
 		}
 		for(i = 0; i < MAX_LOGICAL_DRIVES_EXT; ++i) {
-		 	fusion->streamDetectByLD[i] = kmalloc(sizeof(LD_STREAM_DETECT), GFP_KERNEL);
+		 	fusion->streamDetectByLD[i] = kzalloc(sizeof(LD_STREAM_DETECT) +
+				instance->stream_count * sizeof(STREAM_DETECT), GFP_KERNEL);
 			if(!fusion->streamDetectByLD[i]) {
 				dev_err(&instance->pdev->dev,
 					"unable to allocate stream detect by LD\n ");
@@ -6994,8 +8439,7 @@ static int megasas_init_fw(struct megasas_instance *instance)
 				fusion->streamDetectByLD = NULL;
 				goto fail_get_ld_pd_list;
 			}
-			memset(fusion->streamDetectByLD[i], 0, sizeof(LD_STREAM_DETECT));
-			fusion->streamDetectByLD[i]->mruBitMap = MR_STREAM_BITMAP;
+			megasas_init_stream_detect(instance, fusion->streamDetectByLD[i]);
 		}
 	}
  	
@@ -7561,6 +9005,24 @@ static int megasas_io_attach(struct megasas_instance *instance)
 		host->cmd_per_lun = host->can_queue;
 #endif
 
+#ifdef KERNEL_SUPPORT_BLK_MQ_MULTI_HWQ
+	/*
+	 * One hardware queue per reply queue. Each hctx gets its own slice of
+	 * the SCSI command space (see megasas_get_blk_tag), so the tag set is
+	 * sized per hctx and can_queue is raised back once the tag set exists.
+	 */
+	if (multiq_enable && shost_use_blk_mq(host) &&
+	    (instance->adapter_type != MFI_SERIES) &&
+	    smp_affinity_enable && (instance->msix_vectors > 1)) {
+		host->nr_hw_queues = instance->msix_vectors;
+		instance->hwq_depth = instance->max_scsi_cmds / host->nr_hw_queues;
+		host->can_queue = instance->hwq_depth;
+		dev_info(&instance->pdev->dev,
+			"blk-mq hw queues\t: (%d) depth per queue: (%d)\n",
+			host->nr_hw_queues, instance->hwq_depth);
+	}
+#endif
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,4,0))
 	error = scsi_init_shared_tag_map(host, host->can_queue);
 	if (error) {
@@ -7580,6 +9042,11 @@ static int megasas_io_attach(struct megasas_instance *instance)
 		return -ENODEV;
 	}
 
+	/* Tag set is allocated, host wide limit is back to max_scsi_cmds */
+	host->can_queue = instance->cur_can_queue;
+	megasas_outstanding_set_limit(&instance->fw_outstanding,
+		instance->cur_can_queue);
+
         /*                                                                      
         * Create sysfs entries for module paramaters                            
         */
@@ -7730,6 +9197,101 @@ megasas_irq_set_affinity_hint(unsigned int msix_vector,
 	return true;
 }
 
+/**
+ * megasas_get_irq_affinity -	Return CPU affinity of an MSI-x vector
+ * @instance:			Adapter soft state
+ * @msix_index:			MSI-x index
+ *
+ * Managed affinity (pci_alloc_irq_vectors) is preferred, otherwise the
+ * affinity currently programmed for the IRQ is used.
+ */
+static inline const struct cpumask *
+megasas_get_irq_affinity(struct megasas_instance *instance, int msix_index)
+{
+	const struct cpumask *mask;
+	struct irq_data *irq_data;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0))
+	mask = pci_irq_get_affinity(instance->pdev, msix_index);
+	if (mask)
+		return mask;
+#endif
+	irq_data = irq_get_irq_data(megasas_get_irq(instance, msix_index));
+	if (!irq_data)
+		return NULL;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0))
+	mask = irq_data_get_affinity_mask(irq_data);
+#else
+	mask = irq_data->affinity;
+#endif
+	return mask;
+}
+
+/**
+ * megasas_setup_reply_map -	Build per CPU reply queue map
+ * @instance:			Adapter soft state
+ *
+ * A CPU covered by the affinity of a vector completes on that vector.
+ * Remaining CPUs share the vectors of mapped CPUs on their own NUMA node,
+ * so replies are not steered to a vector serviced by the other socket.
+ * Without any usable affinity the map falls back to cpu % msix_vectors.
+ */
+static void
+megasas_setup_reply_map(struct megasas_instance *instance)
+{
+	const struct cpumask *mask;
+	cpumask_var_t mapped;
+	unsigned int queue, cpu, sibling, node_cpus, rank;
+
+	if (!instance->msix_vectors) {
+		memset(instance->reply_map, 0, nr_cpu_ids);
+		return;
+	}
+
+	if (!zalloc_cpumask_var(&mapped, GFP_KERNEL))
+		goto fallback;
+
+	for (queue = 0; queue < instance->msix_vectors; queue++) {
+		mask = megasas_get_irq_affinity(instance, queue);
+		/* Vector not bound to a CPU subset, nothing to learn */
+		if (!mask || (cpumask_weight(mask) >= num_online_cpus()))
+			continue;
+		for_each_cpu(cpu, mask) {
+			instance->reply_map[cpu] = queue;
+			cpumask_set_cpu(cpu, mapped);
+		}
+	}
+
+	for_each_possible_cpu(cpu) {
+		if (cpumask_test_cpu(cpu, mapped))
+			continue;
+
+		node_cpus = 0;
+		for_each_cpu_and(sibling, cpumask_of_node(cpu_to_node(cpu)), mapped)
+			node_cpus++;
+
+		if (!node_cpus) {
+			instance->reply_map[cpu] = cpu % instance->msix_vectors;
+			continue;
+		}
+
+		rank = cpu % node_cpus;
+		for_each_cpu_and(sibling, cpumask_of_node(cpu_to_node(cpu)), mapped) {
+			if (!rank--) {
+				instance->reply_map[cpu] = instance->reply_map[sibling];
+				break;
+			}
+		}
+	}
+
+	free_cpumask_var(mapped);
+	return;
+
+fallback:
+	for_each_possible_cpu(cpu)
+		instance->reply_map[cpu] = cpu % instance->msix_vectors;
+}
+
 /**
  * megasas_setup_irqs -		register interrupt with IRQ sub system.
  * @instance:				Adapter soft state
@@ -7751,6 +9313,7 @@ try_io_apic:
 	if (!instance->msix_vectors) {
 		instance->irq_context[0].instance = instance;
 		instance->irq_context[0].MSIxIndex = 0;
+		instance->irq_context[0].os_irq = megasas_get_irq(instance, 0);
 		if (request_irq(megasas_get_irq(instance, 0),
 			instance->instancet->service_isr, IRQF_SHARED,
 			"megasas", &instance->irq_context[0])) {
@@ -7759,6 +9322,7 @@ try_io_apic:
 					__func__, __LINE__);
 			return -1;
 		}
+		megasas_setup_reply_map(instance);
 		return 0;
 	}
 
@@ -7767,6 +9331,9 @@ try_io_apic:
 	for (i = 0; i < instance->msix_vectors; i++) {
 		instance->irq_context[i].instance = instance;
 		instance->irq_context[i].MSIxIndex = i;
+		instance->irq_context[i].os_irq = megasas_get_irq(instance, i);
+		atomic_set(&instance->irq_context[i].in_use, 0);
+		instance->irq_context[i].poll_window_ns = ULLONG_MAX;
 		if (request_irq(megasas_get_irq(instance, i),
 			instance->instancet->service_isr, 0, "megasas",
 			&instance->irq_context[i])) {
@@ -7796,6 +9363,16 @@ try_io_apic:
 		cpu = cpumask_next(cpu, cpu_online_mask);
 	}
 
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+	for (i = 0; i < instance->msix_vectors; i++) {
+		instance->irq_context[i].irq_poll_scheduled = false;
+		irq_poll_init(&instance->irq_context[i].irqpoll,
+			      instance->irq_poll_budget, megasas_irqpoll);
+	}
+#endif
+
+	megasas_setup_reply_map(instance);
+
 	return 0;
 }
 
@@ -7810,6 +9387,9 @@ megasas_destroy_irqs(struct megasas_instance *instance)
 	int i;
 	if (instance->msix_vectors) {
 		for (i = 0; i < instance->msix_vectors; i++) {
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+			irq_poll_disable(&instance->irq_context[i].irqpoll);
+#endif
 			megasas_irq_set_affinity_hint(megasas_get_irq(instance, i),
 				NULL);
 			free_irq(megasas_get_irq(instance, i),
@@ -8080,6 +9660,23 @@ static inline void megasas_set_adapter_type(struct megasas_instance *instance)
  */ 
 static int megasas_alloc_ctrl_mem(struct megasas_instance *instance)
 {
+	instance->reply_map = kcalloc(nr_cpu_ids, sizeof(u8), GFP_KERNEL);
+	if (!instance->reply_map)
+		return -ENOMEM;
+
+	if (megasas_outstanding_alloc(&instance->fw_outstanding) ||
+	    megasas_outstanding_alloc(&instance->ldio_outstanding))
+		return -ENOMEM;
+
+	if (instance->qd_ctrl.enabled && instance->qd_ctrl.lat_target_ns) {
+		instance->qd_ctrl.lat = alloc_percpu(struct megasas_qd_lat);
+		if (!instance->qd_ctrl.lat) {
+			dev_err(&instance->pdev->dev, "Failed to allocate queue depth "
+				"latency counters, continuing without latency target\n");
+			instance->qd_ctrl.lat_target_ns = 0;
+		}
+	}
+
 	switch(instance->adapter_type) {
 		case MFI_SERIES:
 			if (megasas_alloc_mfi_ctrl_mem(instance))
@@ -8105,6 +9702,16 @@ static int megasas_alloc_ctrl_mem(struct megasas_instance *instance)
  */
 static inline void megasas_free_ctrl_mem(struct megasas_instance *instance)
 {
+	kfree(instance->reply_map);
+	instance->reply_map = NULL;
+	megasas_outstanding_free(&instance->fw_outstanding);
+	megasas_outstanding_free(&instance->ldio_outstanding);
+	megasas_free_io_metric_shards(rcu_dereference_protected(
+		instance->PerformanceMetric.IoMetricsShard, 1));
+	RCU_INIT_POINTER(instance->PerformanceMetric.IoMetricsShard, NULL);
+	free_percpu(instance->qd_ctrl.lat);
+	instance->qd_ctrl.lat = NULL;
+
 	if (instance->adapter_type == MFI_SERIES) {
 		if (instance->producer)
 			pci_free_consistent(instance->pdev, sizeof(u32), instance->producer,
@@ -8126,6 +9733,7 @@ static inline int megasas_alloc_ctrl_dma_buffers(struct megasas_instance *instan
 {
 	struct pci_dev *pdev = instance->pdev;
 	struct fusion_context *fusion = instance->ctrl_context;
+	int i;
 
 	instance->evt_detail = pci_alloc_consistent(pdev,
 				sizeof(struct megasas_evt_detail),
@@ -8222,6 +9830,15 @@ static inline int megasas_alloc_ctrl_dma_buffers(struct megasas_instance *instan
 				"Failed to allocate crash dump buffer\n");
 	}
 
+	/* ioctls fall back to per call allocations without a pool */
+	for (i = 0; i < MEGASAS_IOCTL_POOL_CLASSES; i++) {
+		instance->ioctl_pool[i] = pci_pool_create("mr_ioctl", pdev,
+						MEGASAS_IOCTL_POOL_SZ(i), 64, 0);
+		if (!instance->ioctl_pool[i])
+			dev_err(&instance->pdev->dev,
+				"Failed to create ioctl buffer pool %d\n", i);
+	}
+
 	return 0;
 }
 
@@ -8235,6 +9852,7 @@ static inline void megasas_free_ctrl_dma_buffers(struct megasas_instance *instan
 {
 	struct pci_dev *pdev = instance->pdev;
 	struct fusion_context *fusion = instance->ctrl_context;
+	int i;
 
 	if (instance->evt_detail)
 		pci_free_consistent(pdev, sizeof(struct megasas_evt_detail),
@@ -8280,6 +9898,12 @@ static inline void megasas_free_ctrl_dma_buffers(struct megasas_instance *instan
 		pci_free_consistent(pdev, CRASH_DMA_BUF_SIZE,
 			instance->crash_dump_buf, instance->crash_dump_h);
 
+	for (i = 0; i < MEGASAS_IOCTL_POOL_CLASSES; i++) {
+		if (instance->ioctl_pool[i]) {
+			pci_pool_destroy(instance->ioctl_pool[i]);
+			instance->ioctl_pool[i] = NULL;
+		}
+	}
 }
 
 /*
@@ -8299,12 +9923,14 @@ static inline void megasas_init_ctrl_params(struct megasas_instance *instance)
 	/*
 	 * Initialize locks and queues
 	 */
-	INIT_LIST_HEAD(&instance->cmd_pool);
 	INIT_LIST_HEAD(&instance->internal_reset_pending_q);
 
-	atomic_set(&instance->fw_outstanding, 0);
 	atomic_set(&instance->ieee_sgl, 0);
 	atomic_set(&instance->prp_sgl, 0);
+	atomic64_set(&instance->ieee_sgl_build_ns, 0);
+	atomic64_set(&instance->prp_sgl_build_ns, 0);
+	atomic_set(&instance->ieee_sgl_timed, 0);
+	atomic_set(&instance->prp_sgl_timed, 0);
 
 	init_waitqueue_head(&instance->int_cmd_wait_q);
 	init_waitqueue_head(&instance->abort_cmd_wait_q);
@@ -8329,9 +9955,33 @@ static inline void megasas_init_ctrl_params(struct megasas_instance *instance)
 	instance->disableOnlineCtrlReset = 1;
 	instance->UnevenSpanSupport = 0;
 
+	if ((irq_poll_budget < 16) || (irq_poll_budget > 1024))
+		irq_poll_budget = MEGASAS_IRQ_POLL_BUDGET;
+	instance->irq_poll_budget = irq_poll_budget;
+
+	instance->qd_ctrl.enabled = adaptive_qd ? 1 : 0;
+	instance->qd_ctrl.lat_target_ns =
+		(u64)qd_latency_target * NSEC_PER_MSEC;
+	spin_lock_init(&instance->qd_ctrl.lock);
+	INIT_DELAYED_WORK(&instance->qd_ctrl.work, megasas_qd_work);
+
 	if (instance->adapter_type != MFI_SERIES) {
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+		instance->irq_poll_enable = irq_poll_enable ? 1 : 0;
+#endif
+		instance->hybrid_poll_us = min_t(u32, hybrid_poll_us,
+						 MEGASAS_HYBRID_POLL_MAX_US);
+		if (!stream_count || (stream_count > MEGASAS_MAX_STREAMS_TRACKED))
+			stream_count = MAX_STREAMS_TRACKED;
+		instance->stream_count = stream_count;
+		instance->stream_gap = min_t(u32, stream_gap,
+					     MEGASAS_STREAM_MAX_GAP);
+		instance->lb_policy = (lb_policy > MR_LB_POLICY_MAX) ?
+					MR_LB_POLICY_SEEK : lb_policy;
 		INIT_WORK(&instance->work_init, megasas_fusion_ocr_wq);
 		INIT_WORK(&instance->crash_init, megasas_fusion_crash_dump_wq);
+		INIT_WORK(&instance->map_update_work,
+			  megasas_fusion_map_update_wq);
 	} else
 		INIT_WORK(&instance->work_init, process_fw_state_change_wq);
 
@@ -8469,6 +10119,8 @@ megasas_probe_one(struct pci_dev *pdev, const struct pci_device_id *id)
 	/* Get current SR-IOV LD/VF affiliation */
 	if (instance->requestorId)
 		megasas_get_ld_vf_affiliation(instance, 1);
+
+	megasas_setup_debugfs(instance);
 	
 	return 0;
 
@@ -8550,6 +10202,10 @@ static void megasas_shutdown_controller(struct megasas_instance *instance,
 	struct megasas_cmd *cmd;
 	struct megasas_dcmd_frame *dcmd;
 
+	/* unload is set, a map update queued from here on is a no-op */
+	if (instance->adapter_type != MFI_SERIES)
+		cancel_work_sync(&instance->map_update_work);
+
 	if (atomic_read(&instance->adprecovery) == MEGASAS_HW_CRITICAL_ERROR)
 		return;
 
@@ -8621,6 +10277,7 @@ megasas_suspend(struct pci_dev *pdev, pm_message_t state)
 		cancel_delayed_work_sync(&ev->hotplug_work);
 		instance->ev = NULL;
 	}
+	cancel_delayed_work_sync(&instance->qd_ctrl.work);
 
 	tasklet_kill(&instance->isr_tasklet);
 
@@ -8696,8 +10353,8 @@ megasas_resume(struct pci_dev *pdev)
 	 * Initialize Firmware
 	 */
 
-	atomic_set(&instance->fw_outstanding,0);
-	atomic_set(&instance->ldio_outstanding, 0);
+	megasas_outstanding_reset(&instance->fw_outstanding);
+	megasas_outstanding_reset(&instance->ldio_outstanding);
 
 	if (instance->ctrl_context) {
 			megasas_reset_reply_desc(instance);
@@ -8736,6 +10393,9 @@ megasas_resume(struct pci_dev *pdev)
 	megasas_setup_jbod_map(instance);
 	instance->unload = 0;
 
+	/* pick up the adaptive queue depth ramp where suspend stopped it */
+	megasas_qd_restart(instance);
+
 	/* Re-launch SR-IOV heartbeat timer */
 	if (instance->requestorId) {
 		if (!megasas_sriov_start_heartbeat(instance, 0))
@@ -8851,8 +10511,10 @@ static void megasas_detach_one(struct pci_dev *pdev)
 	if (instance->fw_crash_state != UNAVAILABLE)
                	megasas_free_host_crash_buffer(instance); 
 
+	megasas_destroy_debugfs(instance);
 	scsi_remove_host(instance->host);
 	instance->unload = 1;
+	cancel_delayed_work_sync(&instance->qd_ctrl.work);
 
 	msleep(1000);
 
@@ -8872,6 +10534,8 @@ skip_firing_dcmds:
 		cancel_delayed_work_sync(&ev->hotplug_work);
 		instance->ev = NULL;
 	}
+	if (instance->adapter_type != MFI_SERIES)
+		cancel_work_sync(&instance->map_update_work);
 	/* cancel all wait event */
 	wake_up_all(&instance->int_cmd_wait_q);
 
@@ -8970,6 +10634,7 @@ static void megasas_shutdown(struct pci_dev *pdev)
 	struct megasas_instance *instance = pci_get_drvdata(pdev);
 
 	instance->unload = 1;
+	cancel_delayed_work_sync(&instance->qd_ctrl.work);
 	
 	msleep(1000);
 	if (megasas_wait_for_adapter_operational(instance))
@@ -9060,28 +10725,68 @@ static unsigned int megasas_mgmt_poll(struct file *file, poll_table *wait)
 }
 
 /**
- * megasas_mgmt_fw_ioctl -	Issues management ioctls to FW
+ * megasas_alloc_ioctl_buf -	Get a DMA buffer for a management ioctl
+ * @instance:			Adapter soft state
+ * @len:			Buffer length
+ * @handle:			DMA address of the buffer
+ *
+ * Buffers come from the smallest ioctl pool they fit in, so repeated
+ * management queries do not allocate coherent memory every time.
+ * Pool buffers are not cleared, callers must initialize what FW reads.
+ */
+static void *
+megasas_alloc_ioctl_buf(struct megasas_instance *instance, u32 len,
+			dma_addr_t *handle)
+{
+	int i;
+
+	for (i = 0; i < MEGASAS_IOCTL_POOL_CLASSES; i++) {
+		if (instance->ioctl_pool[i] && (len <= MEGASAS_IOCTL_POOL_SZ(i)))
+			return pci_pool_alloc(instance->ioctl_pool[i],
+					      GFP_KERNEL, handle);
+	}
+
+	return dma_alloc_coherent(&instance->pdev->dev, len, handle,
+				  GFP_KERNEL);
+}
+
+/**
+ * megasas_free_ioctl_buf -	Release a buffer from megasas_alloc_ioctl_buf
  * @instance:			Adapter soft state
- * @argp:			User's ioctl packet
+ * @len:			Length the buffer was allocated with
+ * @buf:			Buffer
+ * @handle:			DMA address of the buffer
+ */
+static void
+megasas_free_ioctl_buf(struct megasas_instance *instance, u32 len,
+		       void *buf, dma_addr_t handle)
+{
+	int i;
+
+	for (i = 0; i < MEGASAS_IOCTL_POOL_CLASSES; i++) {
+		if (instance->ioctl_pool[i] && (len <= MEGASAS_IOCTL_POOL_SZ(i))) {
+			pci_pool_free(instance->ioctl_pool[i], buf, handle);
+			return;
+		}
+	}
+
+	dma_free_coherent(&instance->pdev->dev, len, buf, handle);
+}
+
+/**
+ * megasas_mgmt_ioc_setup -	Claim an MFI cmd and load the user's frames
+ * @instance:			Adapter soft state
+ * @ioc:			Kernel copy of the user's ioctl packet
+ * @ctx:			Per packet state, filled in here
  */
 static int
-megasas_mgmt_fw_ioctl(struct megasas_instance *instance,
-		      struct megasas_iocpacket __user * user_ioc,
-		      struct megasas_iocpacket *ioc)
+megasas_mgmt_ioc_setup(struct megasas_instance *instance,
+		       struct megasas_iocpacket *ioc,
+		       struct megasas_ioc_ctx *ctx)
 {
-	struct megasas_sge64 *kern_sge64 = NULL;
-	struct megasas_sge32 *kern_sge32 = NULL;
 	struct megasas_cmd *cmd;
-	void *kbuff_arr[MAX_IOCTL_SGE];
-	dma_addr_t buf_handle = 0;
-	int error = 0, i;
-	void *sense = NULL;
-	dma_addr_t sense_handle;
-	unsigned long *sense_ptr;
-	struct megasas_instance *local_instance;
-	u32 opcode = 0;
 
-	memset(kbuff_arr, 0, sizeof(kbuff_arr));
+	memset(ctx, 0, sizeof(*ctx));
 
 	if (ioc->sge_count > MAX_IOCTL_SGE) {
 		printk(KERN_DEBUG "megasas: SGE count [%d] >  max limit [%d]\n",
@@ -9102,6 +10807,7 @@ megasas_mgmt_fw_ioctl(struct megasas_instance *instance,
 		printk(KERN_DEBUG "megasas: Failed to get a cmd packet\n");
 		return -ENOMEM;
 	}
+	ctx->cmd = cmd;
 
 	/*
 	 * User's IOCTL packet has 2 frames (maximum). Copy those two
@@ -9123,40 +10829,32 @@ megasas_mgmt_fw_ioctl(struct megasas_instance *instance,
 					       MFI_FRAME_SENSE64));
 
 	if (cmd->frame->hdr.cmd == MFI_CMD_DCMD)
-		opcode = le32_to_cpu(cmd->frame->dcmd.opcode);
-
-	if (opcode == MR_DCMD_CTRL_SHUTDOWN) {
-		if (megasas_get_ctrl_info(instance) != DCMD_SUCCESS) {
-			megasas_return_cmd(instance, cmd);
-			return -1;
-		}
-	}
+		ctx->opcode = le32_to_cpu(cmd->frame->dcmd.opcode);
 
-	/* Check whether the DCMD sent is from crash dump utility*/
-	if (opcode == MR_DRIVER_SET_APP_CRASHDUMP_MODE) {
+	ctx->data_dir = le16_to_cpu(cmd->frame->hdr.flags) & MFI_FRAME_DIR_BOTH;
 
-		for (i = 0; i < megasas_mgmt_info.max_index; i++) {
+	return 0;
+}
 
-			if (megasas_mgmt_info.instance[i]) {
-				local_instance = megasas_mgmt_info.instance[i];
-				if (local_instance->crash_dump_drv_support && 
-					(atomic_read(&local_instance->adprecovery)
-						== MEGASAS_HBA_OPERATIONAL) &&
-					!megasas_set_crash_dump_params(local_instance,
-						cmd->frame->dcmd.mbox.w[0])) {
-					local_instance->crash_dump_app_support =
-						cmd->frame->dcmd.mbox.w[0];
-					dev_info(&local_instance->pdev->dev, "megasas: application crash dump mode set success\n");
-					error = 0; /*SUCCESS*/
-				} else {
-					dev_info(&local_instance->pdev->dev,"megasas: application crash dump mode set failed\n");
-					error = -1; /* FAILURE*/
-				}
-			}
-        	}
-		megasas_return_cmd(instance, cmd);
-		return error;
-	}	
+/**
+ * megasas_mgmt_ioc_map -	Mirror the user's buffers into DMA buffers
+ * @instance:			Adapter soft state
+ * @ioc:			Kernel copy of the user's ioctl packet
+ * @ctx:			Per packet state from megasas_mgmt_ioc_setup
+ *
+ * On failure the caller still owns @ctx and must release it.
+ */
+static int
+megasas_mgmt_ioc_map(struct megasas_instance *instance,
+		     struct megasas_iocpacket *ioc,
+		     struct megasas_ioc_ctx *ctx)
+{
+	struct megasas_sge64 *kern_sge64 = NULL;
+	struct megasas_sge32 *kern_sge32 = NULL;
+	struct megasas_cmd *cmd = ctx->cmd;
+	dma_addr_t buf_handle = 0;
+	unsigned long *sense_ptr;
+	int i;
 
 	/*
 	 * The management interface between applications and the fw uses
@@ -9180,14 +10878,13 @@ megasas_mgmt_fw_ioctl(struct megasas_instance *instance,
 		if (!ioc->sgl[i].iov_len)
 			continue;
 
-		kbuff_arr[i] = dma_alloc_coherent(&instance->pdev->dev,
+		ctx->kbuff_arr[i] = megasas_alloc_ioctl_buf(instance,
 						    ioc->sgl[i].iov_len,
-						    &buf_handle, GFP_KERNEL);
-		if (!kbuff_arr[i]) {
+						    &buf_handle);
+		if (!ctx->kbuff_arr[i]) {
 			printk(KERN_DEBUG "megasas: Failed to alloc "
 			       "kernel SGL buffer for IOCTL \n");
-			error = -ENOMEM;
-			goto out;
+			return -ENOMEM;
 		}
 
 		/*
@@ -9204,65 +10901,68 @@ megasas_mgmt_fw_ioctl(struct megasas_instance *instance,
 
 		/*
 		 * We created a kernel buffer corresponding to the
-		 * user buffer. Now copy in from the user buffer
+		 * user buffer. Now copy in from the user buffer, this also
+		 * overwrites whatever an earlier ioctl left in a pool buffer
 		 */
-		if (copy_from_user(kbuff_arr[i], ioc->sgl[i].iov_base,
-				   (u32) (ioc->sgl[i].iov_len))) {
-			error = -EFAULT;
-			goto out;
-		}
+		if (copy_from_user(ctx->kbuff_arr[i], ioc->sgl[i].iov_base,
+				   (u32) (ioc->sgl[i].iov_len)))
+			return -EFAULT;
 	}
 
 	if (ioc->sense_len) {
-		sense = dma_alloc_coherent(&instance->pdev->dev, ioc->sense_len,
-					     &sense_handle, GFP_KERNEL);
-		if (!sense) {
-			error = -ENOMEM;
-			goto out;
-		}
+		ctx->sense = megasas_alloc_ioctl_buf(instance, ioc->sense_len,
+						     &ctx->sense_handle);
+		if (!ctx->sense)
+			return -ENOMEM;
+		memset(ctx->sense, 0, ioc->sense_len);
 
 		sense_ptr =
 		(unsigned long *) ((unsigned long)cmd->frame + ioc->sense_off);
 		if (instance->consistent_mask_64bit)
-			*sense_ptr = cpu_to_le64(sense_handle);
+			*sense_ptr = cpu_to_le64(ctx->sense_handle);
 		else
-			*sense_ptr = cpu_to_le32(sense_handle);
+			*sense_ptr = cpu_to_le32(ctx->sense_handle);
 	}
 
-	/*
-	 * Set the sync_cmd flag so that the ISR knows not to complete this
-	 * cmd to the SCSI mid-layer
-	 */
-	cmd->sync_cmd = 1;
-	if (megasas_issue_blocked_cmd(instance, cmd, 0) == DCMD_NOT_FIRED) {
-		cmd->sync_cmd = 0;
-		dev_info(&instance->pdev->dev,
-			"return -EBUSY from %s %d cmd 0x%x opcode 0x%x cmd->cmd_status_drv 0x%x \n",
-			__func__, __LINE__, cmd->frame->hdr.cmd, opcode, cmd->cmd_status_drv);
-		return -EBUSY;
-	}
-	cmd->sync_cmd = 0;
+	return 0;
+}
+
+/**
+ * megasas_mgmt_ioc_complete -	Hand the results of a finished ioctl back
+ * @instance:			Adapter soft state
+ * @user_ioc:			User's ioctl packet
+ * @ioc:			Kernel copy of the user's ioctl packet
+ * @ctx:			Per packet state of the completed cmd
+ */
+static int
+megasas_mgmt_ioc_complete(struct megasas_instance *instance,
+			  struct megasas_iocpacket __user *user_ioc,
+			  struct megasas_iocpacket *ioc,
+			  struct megasas_ioc_ctx *ctx)
+{
+	unsigned long *sense_ptr;
+	int i;
 
 	if (instance->unload == 1) {
 		printk(KERN_INFO "megasas: we are doing unload so no need to submit data to" 
 			"application. This may be force exit from driver \n");
-		goto out;
+		return 0;
 	}
 
-	if (opcode == MR_DCMD_CTRL_IO_METRICS_GET) {
-		ProcessPerfMetricRequest(instance , kbuff_arr[0], ioc->sgl[0].iov_len);
+	if (ctx->opcode == MR_DCMD_CTRL_IO_METRICS_GET) {
+		ProcessPerfMetricRequest(instance , ctx->kbuff_arr[0], ioc->sgl[0].iov_len);
 	}
 
 	/*
-	 * copy out the kernel buffers to user buffers
+	 * copy out the kernel buffers to user buffers, FW did not touch
+	 * write-only ones
 	 */
-	for (i = 0; i < ioc->sge_count; i++) {
-		if (copy_to_user(ioc->sgl[i].iov_base, kbuff_arr[i],
+	for (i = 0; (ctx->data_dir != MFI_FRAME_DIR_WRITE) && (i < ioc->sge_count); i++) {
+		if (copy_to_user(ioc->sgl[i].iov_base, ctx->kbuff_arr[i],
 				 ioc->sgl[i].iov_len)) {
-			error = -EFAULT;
 			printk(KERN_ERR "megasas: Failed to copy out to user "
 					"kbuff\n");
-			goto out;
+			return -EFAULT;
 		}
 	}
 
@@ -9277,11 +10977,10 @@ megasas_mgmt_fw_ioctl(struct megasas_instance *instance,
 		sense_ptr = (unsigned long *) ((unsigned long)ioc->frame.raw +
 				ioc->sense_off);
 		if (copy_to_user((void __user *)((unsigned long) get_unaligned((unsigned long *) sense_ptr)),
-				 sense, ioc->sense_len)) {
+				 ctx->sense, ioc->sense_len)) {
 			printk(KERN_ERR "megasas: Failed to copy out to user "
 					"sense data\n");
-			error = -EFAULT;
-			goto out;
+			return -EFAULT;
 		}
 	}
 
@@ -9289,41 +10988,195 @@ megasas_mgmt_fw_ioctl(struct megasas_instance *instance,
 	 * copy the status codes returned by the fw
 	 */
 	if (copy_to_user(&user_ioc->frame.hdr.cmd_status,
-			 &cmd->frame->hdr.cmd_status, sizeof(u8))) {
+			 &ctx->cmd->frame->hdr.cmd_status, sizeof(u8))) {
 		printk(KERN_DEBUG "megasas: Error copying out cmd_status\n");
-		error = -EFAULT;
+		return -EFAULT;
 	}
 
-      out:
-	if (sense) {
-		dma_free_coherent(&instance->pdev->dev, ioc->sense_len,
-				    sense, sense_handle);
+	return 0;
+}
+
+/**
+ * megasas_mgmt_ioc_release -	Free the DMA buffers and cmd of an ioctl
+ * @instance:			Adapter soft state
+ * @ioc:			Kernel copy of the user's ioctl packet
+ * @ctx:			Per packet state
+ */
+static void
+megasas_mgmt_ioc_release(struct megasas_instance *instance,
+			 struct megasas_iocpacket *ioc,
+			 struct megasas_ioc_ctx *ctx)
+{
+	struct megasas_sge64 *kern_sge64;
+	struct megasas_sge32 *kern_sge32;
+	int i;
+
+	if (!ctx->cmd)
+		return;
+
+	kern_sge64 = (struct megasas_sge64 *)
+		((unsigned long)ctx->cmd->frame + ioc->sgl_off);
+	kern_sge32 = (struct megasas_sge32 *)
+		((unsigned long)ctx->cmd->frame + ioc->sgl_off);
+
+	if (ctx->sense) {
+		megasas_free_ioctl_buf(instance, ioc->sense_len,
+				       ctx->sense, ctx->sense_handle);
+		ctx->sense = NULL;
 	}
 
 	for (i = 0; i < ioc->sge_count; i++) {
-		if (kbuff_arr[i]) {
+		if (ctx->kbuff_arr[i]) {
 			if (instance->consistent_mask_64bit)
-				dma_free_coherent(&instance->pdev->dev,
+				megasas_free_ioctl_buf(instance,
 					le32_to_cpu(kern_sge64[i].length),
-					kbuff_arr[i],
+					ctx->kbuff_arr[i],
 					le64_to_cpu(kern_sge64[i].phys_addr));
 			else
-				dma_free_coherent(&instance->pdev->dev,
+				megasas_free_ioctl_buf(instance,
 					le32_to_cpu(kern_sge32[i].length),
-					kbuff_arr[i],
+					ctx->kbuff_arr[i],
 					le32_to_cpu(kern_sge32[i].phys_addr));
-			kbuff_arr[i] = NULL;
+			ctx->kbuff_arr[i] = NULL;
 		} 
 	}
 
 	/* Complete both MPT and MFI command from this context 
 	 * Applicable for Fusion Adapter only.
 	 */
-	megasas_return_cmd(instance, cmd);
+	megasas_return_cmd(instance, ctx->cmd);
+	ctx->cmd = NULL;
+}
+
+/**
+ * megasas_mgmt_fw_ioctl -	Issues management ioctls to FW
+ * @instance:			Adapter soft state
+ * @user_ioc:			User's ioctl packet
+ * @ioc:			Kernel copy of the user's ioctl packet
+ */
+static int
+megasas_mgmt_fw_ioctl(struct megasas_instance *instance,
+		      struct megasas_iocpacket __user * user_ioc,
+		      struct megasas_iocpacket *ioc)
+{
+	struct megasas_ioc_ctx ctx;
+	struct megasas_cmd *cmd;
+	struct megasas_instance *local_instance;
+	int error = 0, i;
+
+	error = megasas_mgmt_ioc_setup(instance, ioc, &ctx);
+	if (error)
+		return error;
+	cmd = ctx.cmd;
+
+	if (ctx.opcode == MR_DCMD_CTRL_SHUTDOWN) {
+		if (megasas_get_ctrl_info(instance) != DCMD_SUCCESS) {
+			megasas_return_cmd(instance, cmd);
+			return -1;
+		}
+	}
+
+	/* Check whether the DCMD sent is from crash dump utility*/
+	if (ctx.opcode == MR_DRIVER_SET_APP_CRASHDUMP_MODE) {
+
+		for (i = 0; i < megasas_mgmt_info.max_index; i++) {
+
+			if (megasas_mgmt_info.instance[i]) {
+				local_instance = megasas_mgmt_info.instance[i];
+				if (local_instance->crash_dump_drv_support && 
+					(atomic_read(&local_instance->adprecovery)
+						== MEGASAS_HBA_OPERATIONAL) &&
+					!megasas_set_crash_dump_params(local_instance,
+						cmd->frame->dcmd.mbox.w[0])) {
+					local_instance->crash_dump_app_support =
+						cmd->frame->dcmd.mbox.w[0];
+					dev_info(&local_instance->pdev->dev, "megasas: application crash dump mode set success\n");
+					error = 0; /*SUCCESS*/
+				} else {
+					dev_info(&local_instance->pdev->dev,"megasas: application crash dump mode set failed\n");
+					error = -1; /* FAILURE*/
+				}
+			}
+        	}
+		megasas_return_cmd(instance, cmd);
+		return error;
+	}	
+
+	error = megasas_mgmt_ioc_map(instance, ioc, &ctx);
+	if (error)
+		goto out;
+
+	/*
+	 * Set the sync_cmd flag so that the ISR knows not to complete this
+	 * cmd to the SCSI mid-layer
+	 */
+	cmd->sync_cmd = 1;
+	if (megasas_issue_blocked_cmd(instance, cmd, 0) == DCMD_NOT_FIRED) {
+		cmd->sync_cmd = 0;
+		dev_info(&instance->pdev->dev,
+			"return -EBUSY from %s %d cmd 0x%x opcode 0x%x cmd->cmd_status_drv 0x%x \n",
+			__func__, __LINE__, cmd->frame->hdr.cmd, ctx.opcode, cmd->cmd_status_drv);
+		error = -EBUSY;
+		goto out;
+	}
+	cmd->sync_cmd = 0;
+
+	error = megasas_mgmt_ioc_complete(instance, user_ioc, ioc, &ctx);
+
+      out:
+	megasas_mgmt_ioc_release(instance, ioc, &ctx);
 	
 	return error;
 }
 
+/**
+ * megasas_mgmt_ioc_submit -	Issue one packet of a batch without waiting
+ * @instance:			Adapter soft state
+ * @ioc:			Kernel copy of the user's ioctl packet
+ * @ctx:			Per packet state
+ *
+ * The completion path only sets cmd_status_drv and wakes int_cmd_wait_q
+ * for sync_cmd frames, so any number of them can be in flight and be
+ * reaped later in whatever order the caller likes.
+ */
+static int
+megasas_mgmt_ioc_submit(struct megasas_instance *instance,
+			struct megasas_iocpacket *ioc,
+			struct megasas_ioc_ctx *ctx)
+{
+	int error;
+
+	error = megasas_mgmt_ioc_setup(instance, ioc, ctx);
+	if (error)
+		return error;
+
+	/* These are handled by the driver itself, see megasas_mgmt_fw_ioctl */
+	if ((ctx->opcode == MR_DCMD_CTRL_SHUTDOWN) ||
+	    (ctx->opcode == MR_DRIVER_SET_APP_CRASHDUMP_MODE)) {
+		error = -EINVAL;
+		goto out;
+	}
+
+	error = megasas_mgmt_ioc_map(instance, ioc, ctx);
+	if (error)
+		goto out;
+
+	/* The batch only waited for the adapter once, before its first packet */
+	if (atomic_read(&instance->adprecovery) != MEGASAS_HBA_OPERATIONAL) {
+		error = -EBUSY;
+		goto out;
+	}
+
+	ctx->cmd->sync_cmd = 1;
+	ctx->cmd->cmd_status_drv = MFI_STAT_INVALID_STATUS;
+	instance->instancet->issue_dcmd(instance, ctx->cmd);
+	return 0;
+
+out:
+	megasas_mgmt_ioc_release(instance, ioc, ctx);
+	return error;
+}
+
 static int megasas_mgmt_ioctl_fw(struct file *file, unsigned long arg)
 {
 	struct megasas_iocpacket __user *user_ioc =
@@ -9385,6 +11238,126 @@ out_kfree_ioc:
 	return error;
 }
 
+/**
+ * megasas_mgmt_ioctl_fw_batch -	Pipelined pass-through of several packets
+ * @file:				Management char node
+ * @arg:				User's struct megasas_iocbatch
+ *
+ * Packets are issued back to back as long as ioctl_sem has a free slot and
+ * reaped in submission order, so a single caller keeps several DCMDs in
+ * flight instead of paying one FW round trip per packet. A batch shares the
+ * MEGASAS_FUSION_IOCTL_CMDS slots with every other ioctl and never holds
+ * more than those. Issuing stops at the first packet that fails, the ones
+ * already in flight are still reaped. A reset starting mid batch fails the
+ * packets not issued yet with -EBUSY.
+ */
+static int megasas_mgmt_ioctl_fw_batch(struct file *file, unsigned long arg)
+{
+	struct megasas_iocbatch __user *user_batch =
+	    (struct megasas_iocbatch __user *)arg;
+	struct megasas_iocpacket __user *user_ioc;
+	struct megasas_iocbatch batch;
+	struct megasas_iocpacket *ioc = NULL;
+	struct megasas_ioc_ctx *ctx = NULL;
+	struct megasas_instance *instance;
+	u32 issued = 0, reaped = 0, failed;
+	int error = 0, ret;
+	bool reap;
+
+	if (copy_from_user(&batch, user_batch, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || (batch.count > MEGASAS_IOC_BATCH_MAX))
+		return -EINVAL;
+
+	instance = megasas_lookup_instance(batch.host_no);
+	if (!instance)
+		return -ENODEV;
+
+	/* Same gating as megasas_mgmt_ioctl_fw */
+	if ((instance->requestorId && !allow_vf_ioctls) ||
+	    (atomic_read(&instance->adprecovery) == MEGASAS_HW_CRITICAL_ERROR) ||
+	    (instance->unload == 1))
+		return -ENODEV;
+
+	user_ioc = (struct megasas_iocpacket __user *)
+			(unsigned long)batch.packets;
+	ioc = kcalloc(batch.count, sizeof(*ioc), GFP_KERNEL);
+	ctx = kcalloc(batch.count, sizeof(*ctx), GFP_KERNEL);
+	if (!ioc || !ctx) {
+		error = -ENOMEM;
+		goto out_free;
+	}
+
+	if (copy_from_user(ioc, user_ioc, batch.count * sizeof(*ioc))) {
+		error = -EFAULT;
+		goto out_free;
+	}
+
+	if (megasas_wait_for_adapter_operational(instance)) {
+		error = -ENODEV;
+		goto out_free;
+	}
+
+	failed = batch.count;
+	while ((reaped < issued) || ((issued < batch.count) && (failed == batch.count))) {
+		reap = true;
+
+		if ((issued < batch.count) && (failed == batch.count)) {
+			/*
+			 * Only block for a slot when nothing of ours is in
+			 * flight, two batches must never wait on each other
+			 */
+			if (issued == reaped) {
+				if (down_interruptible(&instance->ioctl_sem)) {
+					error = -ERESTARTSYS;
+					failed = issued;
+					continue;
+				}
+				reap = false;
+			} else if (!down_trylock(&instance->ioctl_sem)) {
+				reap = false;
+			}
+		}
+
+		if (!reap) {
+			ret = megasas_mgmt_ioc_submit(instance, &ioc[issued],
+						      &ctx[issued]);
+			if (ret) {
+				up(&instance->ioctl_sem);
+				error = ret;
+				failed = issued;
+				continue;
+			}
+			issued++;
+			continue;
+		}
+
+		wait_event(instance->int_cmd_wait_q,
+			ctx[reaped].cmd->cmd_status_drv != MFI_STAT_INVALID_STATUS);
+		ctx[reaped].cmd->sync_cmd = 0;
+
+		ret = megasas_mgmt_ioc_complete(instance, &user_ioc[reaped],
+						&ioc[reaped], &ctx[reaped]);
+		megasas_mgmt_ioc_release(instance, &ioc[reaped], &ctx[reaped]);
+		up(&instance->ioctl_sem);
+
+		if (ret && (reaped < failed)) {
+			error = ret;
+			failed = reaped;
+		}
+		reaped++;
+	}
+
+	if (put_user(failed, &user_batch->completed))
+		error = -EFAULT;
+
+out_free:
+	kfree(ctx);
+	kfree(ioc);
+	return error;
+}
+
 static int megasas_mgmt_ioctl_aen(struct file *file, unsigned long arg)
 {
 	struct megasas_instance *instance;
@@ -9432,6 +11405,9 @@ megasas_mgmt_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case MEGASAS_IOC_FIRMWARE:
 		return megasas_mgmt_ioctl_fw(file, arg);
 
+	case MEGASAS_IOC_FIRMWARE_BATCH:
+		return megasas_mgmt_ioctl_fw_batch(file, arg);
+
 	case MEGASAS_IOC_GET_AEN:
 		return megasas_mgmt_ioctl_aen(file, arg);
 	}
@@ -9635,7 +11611,6 @@ megasas_aen_polling(struct work_struct *work)
 	struct 	scsi_device *sdev1;
 	u16	pd_index = 0;
 	u16	ld_index = 0;
-	unsigned long flags;
 	struct megasas_aen_event *ev =
 		container_of(work, struct megasas_aen_event, hotplug_work.work);
 	struct megasas_instance *instance = ev->instance;
@@ -9700,9 +11675,7 @@ megasas_aen_polling(struct work_struct *work)
 			break;
 		
 		case MR_EVT_CTRL_PERF_COLLECTION:
-				spin_lock_irqsave(&instance->hba_lock, flags);
 				ProcessPerfMetricAEN(instance , (MR_CTRL_IO_METRICS_CMD_TYPE)(instance->evt_detail->description[42] - 48));
-				spin_unlock_irqrestore(&instance->hba_lock, flags);
 				break;
 		case MR_EVT_CTRL_PROP_CHANGED:
 				dcmd_ret = megasas_get_ctrl_info(instance);
@@ -9824,6 +11797,9 @@ static int __init megasas_init(void)
 
 	megasas_mgmt_majorno = rval;
 
+	/* Before probe, hosts add their directories below it */
+	megasas_init_debugfs();
+
 	/*
 	 * Register ourselves as PCI hotplug module
 	 */
@@ -9896,6 +11872,7 @@ err_dcf_rel_date:
 err_dcf_attr_ver:
 	pci_unregister_driver(&megasas_pci_driver);
 err_pcidrv:
+	megasas_exit_debugfs();
 	unregister_chrdev(megasas_mgmt_majorno, "megaraid_sas_ioctl");
   	return rval;
 }
@@ -9923,6 +11900,7 @@ static void __exit megasas_exit(void)
 	}
 
 	pci_unregister_driver(&megasas_pci_driver);
+	megasas_exit_debugfs();
 	unregister_chrdev(megasas_mgmt_majorno, "megaraid_sas_ioctl");
 }
 
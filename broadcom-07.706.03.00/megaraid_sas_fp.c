@@ -38,8 +38,11 @@
 #include <linux/moduleparam.h>
 #include <linux/module.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/interrupt.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33))
 #include <linux/smp_lock.h>
@@ -85,6 +88,15 @@ static u8 mr_spanset_get_phy_params(struct megasas_instance *instance, u32 ld,
 static u64 get_row_from_strip(struct megasas_instance *instance, u32 ld, u64 strip,
 	MR_DRV_RAID_MAP_ALL *map);
 
+/*
+ * Span set info is kept per driver map buffer, so rebuilding it for a
+ * new map leaves the copy used by IOs on the published map untouched.
+ */
+static inline PLD_SPAN_INFO mr_get_span_info(struct fusion_context *fusion,
+	MR_DRV_RAID_MAP_ALL *map)
+{
+	return fusion->log_to_span[(map == fusion->ld_drv_map[1]) ? 1 : 0];
+}
 
 u32 mega_mod64(u64 dividend, u32 divisor)
 {
@@ -171,7 +183,8 @@ static MR_LD_SPAN *MR_LdSpanPtrGet(u32 ld, u32 span, MR_DRV_RAID_MAP_ALL *map)
 /*
  * This function will Populate Driver Map using firmware raid map
  */
-static int MR_PopulateDrvRaidMap(struct megasas_instance *instance, u64 map_id)
+static int MR_PopulateDrvRaidMap(struct megasas_instance *instance, u64 map_id,
+	MR_DRV_RAID_MAP_ALL *drv_map)
 {
 	struct fusion_context *fusion = instance->ctrl_context;
 	MR_FW_RAID_MAP_ALL     *fw_map_old    = NULL;
@@ -182,8 +195,6 @@ static int MR_PopulateDrvRaidMap(struct megasas_instance *instance, u64 map_id)
 	MR_FW_RAID_MAP_EXT *fw_map_ext;
 	MR_RAID_MAP_DESC_TABLE *desc_table;
 
-	MR_DRV_RAID_MAP_ALL *drv_map = 
-			fusion->ld_drv_map[(map_id & 1)];
 	MR_DRV_RAID_MAP *pDrvRaidMap = &drv_map->raidMap;
 	void *raid_map_data = NULL;
 
@@ -303,11 +314,16 @@ static int MR_PopulateDrvRaidMap(struct megasas_instance *instance, u64 map_id)
 
 /*
  * This function will validate Map info data provided by FW
+ *
+ * The driver map is built in whichever ld_drv_map[] buffer is not
+ * currently published, and is only published through fusion->cur_drv_map
+ * once it validates, so fast path IOs keep running on the old map while
+ * the new one is converted. Sleeps; must be called from process context.
  */
 u8 MR_ValidateMapInfo(struct megasas_instance *instance, u64 map_id)
 {
 	struct fusion_context *fusion;
-	MR_DRV_RAID_MAP_ALL *drv_map;
+	MR_DRV_RAID_MAP_ALL *drv_map, *cur_map;
 	MR_DRV_RAID_MAP *pDrvRaidMap;
 	PLD_LOAD_BALANCE_INFO lbInfo;
 	PLD_SPAN_INFO ldSpanInfo;
@@ -315,16 +331,27 @@ u8 MR_ValidateMapInfo(struct megasas_instance *instance, u64 map_id)
 	u16 num_lds, i;
 	u16 ld;
 	u32 expected_size;
+	u8 ret = 0;
 
-	if (MR_PopulateDrvRaidMap(instance, map_id))
-		return 0;
-	
 	fusion = instance->ctrl_context;
-	drv_map = fusion->ld_drv_map[(map_id & 1)];
+
+	mutex_lock(&fusion->drv_map_mutex);
+
+	cur_map = rcu_dereference_protected(fusion->cur_drv_map,
+		lockdep_is_held(&fusion->drv_map_mutex));
+	drv_map = (cur_map == fusion->ld_drv_map[0]) ?
+		fusion->ld_drv_map[1] : fusion->ld_drv_map[0];
+
+	/* IOs may still be walking the spare map from the previous update */
+	synchronize_rcu();
+
+	if (MR_PopulateDrvRaidMap(instance, map_id, drv_map))
+		goto out;
+	
 	pDrvRaidMap = &drv_map->raidMap;
 
 	lbInfo = fusion->load_balance_info;
-	ldSpanInfo = fusion->log_to_span;
+	ldSpanInfo = mr_get_span_info(fusion, drv_map);
 
 	BUG_ON(!pDrvRaidMap);
 	if (instance->maxRaidMapSize)
@@ -341,11 +368,13 @@ u8 MR_ValidateMapInfo(struct megasas_instance *instance, u64 map_id)
 		printk(KERN_ERR "megasas: span map %x, pDrvRaidMap->totalSize : %x\n", 
 			(unsigned int)sizeof(MR_LD_SPAN_MAP), 
 			le32_to_cpu(pDrvRaidMap->totalSize));
-		return 0;
+		goto out;
 	}
 
-	if (instance->UnevenSpanSupport)
+	if (instance->UnevenSpanSupport) {
+		memset(ldSpanInfo, 0, sizeof(LD_SPAN_INFO) * MAX_LOGICAL_DRIVES_EXT);
 		mr_update_span_set(drv_map, ldSpanInfo);
+	}
 
 	if (lbInfo)
 		mr_update_load_balance_params(instance, drv_map, lbInfo);
@@ -366,7 +395,11 @@ u8 MR_ValidateMapInfo(struct megasas_instance *instance, u64 map_id)
 		num_lds--;
 	}
 
-	return 1;
+	rcu_assign_pointer(fusion->cur_drv_map, drv_map);
+	ret = 1;
+out:
+	mutex_unlock(&fusion->drv_map_mutex);
+	return ret;
 }
 
 u32    MR_GetSpanBlock(u32 ld, u64 row, u64 *span_blk, MR_DRV_RAID_MAP_ALL *map)
@@ -427,7 +460,7 @@ u32 mr_spanset_get_span_block(struct megasas_instance *instance, u32 ld, u64 row
 	LD_SPAN_SET *span_set;
 	MR_QUAD_ELEMENT    *quad;
 	u32    span, info;
-	PLD_SPAN_INFO ldSpanInfo = fusion->log_to_span;
+	PLD_SPAN_INFO ldSpanInfo = mr_get_span_info(fusion, map);
 
 	for (info=0; info < MAX_QUAD_DEPTH; info++) {
 		span_set = &(ldSpanInfo[ld].span_set[info]);
@@ -485,7 +518,7 @@ static u64  get_row_from_strip(struct megasas_instance *instance,
 	struct fusion_context *fusion = instance->ctrl_context;
 	MR_LD_RAID	*raid = MR_LdRaidGet(ld, map);
 	LD_SPAN_SET 	*span_set;
-	PLD_SPAN_INFO	ldSpanInfo = fusion->log_to_span;
+	PLD_SPAN_INFO	ldSpanInfo = mr_get_span_info(fusion, map);
 	u32		info, strip_offset, span, span_offset;
 	u64		span_set_Strip, span_set_Row;
 
@@ -538,7 +571,7 @@ static u64 get_strip_from_row(struct megasas_instance *instance,
 	MR_LD_RAID         *raid = MR_LdRaidGet(ld, map);
 	LD_SPAN_SET *span_set;
 	MR_QUAD_ELEMENT    *quad;
-	PLD_SPAN_INFO ldSpanInfo = fusion->log_to_span;
+	PLD_SPAN_INFO ldSpanInfo = mr_get_span_info(fusion, map);
 	u32    span, info;
 	u64  strip;
 
@@ -595,7 +628,7 @@ static u32 get_arm_from_strip(struct megasas_instance *instance,
 	struct fusion_context *fusion = instance->ctrl_context;
 	MR_LD_RAID         *raid = MR_LdRaidGet(ld, map);
 	LD_SPAN_SET *span_set;
-	PLD_SPAN_INFO ldSpanInfo = fusion->log_to_span;
+	PLD_SPAN_INFO ldSpanInfo = mr_get_span_info(fusion, map);
 	u32    info, strip_offset, span, span_offset;
 
 	for (info=0; info<MAX_QUAD_DEPTH; info++) {
@@ -772,7 +805,7 @@ u8 MR_GetPhyParams(struct megasas_instance *instance, u32 ld, u64 stripRow,
 		   RAID_CONTEXT *pRAID_Context, MR_DRV_RAID_MAP_ALL *map)
 {
 	MR_LD_RAID  *raid = MR_LdRaidGet(ld, map);
-	u32         pd, arRef, r1_alt_pd;
+	u32         pd, arRef, r1_alt_pd, armIdx;
 	u8          physArm, span;
 	u64         row;
 	u8		retval = true;
@@ -801,7 +834,11 @@ u8 MR_GetPhyParams(struct megasas_instance *instance, u32 ld, u64 stripRow,
 	} else  {
 		if (raid->modFactor == 0)
 			return false;
-		physArm = MR_LdDataArmGet(ld,  mega_mod64(stripRow, raid->modFactor), map);
+		armIdx = mega_mod64(stripRow, raid->modFactor);
+		/* dataArmMap only describes MAX_RAIDMAP_ROW_SIZE arms */
+		if (armIdx >= MAX_RAIDMAP_ROW_SIZE)
+			return false;
+		physArm = MR_LdDataArmGet(ld, armIdx, map);
 	}
 
 	if (raid->spanDepth == 1) {
@@ -908,6 +945,7 @@ MR_BuildRaidContext(struct megasas_instance *instance,
 	 * return FALSE
 	 */
 	if (raid->rowDataSize == 0) { 
+		io_info->fp_miss = MEGASAS_FP_MISS_SPAN;
 		if (MR_LdSpanPtrGet(ld, 0, map)->spanRowDataSize == 0)
 			return false;
 		else if (instance->UnevenSpanSupport) {
@@ -990,7 +1028,13 @@ MR_BuildRaidContext(struct megasas_instance *instance,
 	} else
 		io_info->fpOkForIo = false;
 
-
+	if (!io_info->fpOkForIo)
+		io_info->fp_miss = (raid->capability.fpCapable &&
+				    (isRead ? raid->capability.fpReadCapable :
+					      raid->capability.fpWriteCapable)) ?
+			MEGASAS_FP_MISS_CROSS_STRIPE : MEGASAS_FP_MISS_NOT_CAPABLE;
+	else
+		io_info->fp_miss = MEGASAS_FP_MISS_NONE;
 
 
 	if (numRows == 1) {
@@ -1062,8 +1106,10 @@ MR_BuildRaidContext(struct megasas_instance *instance,
 				MR_GetPhyParams(instance, ld, start_strip,
 				    ref_in_start_stripe, io_info, pRAID_Context, map);
 		// If IO on an invalid Pd, then FP is not possible.
-		if (io_info->devHandle == MR_DEVHANDLE_INVALID) 
+		if (io_info->devHandle == MR_DEVHANDLE_INVALID) {
 			io_info->fpOkForIo = false;
+			io_info->fp_miss = MEGASAS_FP_MISS_PD_INVALID;
+		}
 		return retval;
 	} else if (isRead) {
 		uint stripIdx;
@@ -1201,6 +1247,7 @@ mr_update_load_balance_params(struct megasas_instance *instance,
 	int ldCount;
 	u16 ld;
 	MR_LD_RAID *raid;
+	MR_LB_SLOT *slots;
 
 	if(lb_pending_cmds > 128 || lb_pending_cmds < 1)
 		lb_pending_cmds = LB_PENDING_CMDS_DEFAULT;
@@ -1214,24 +1261,60 @@ mr_update_load_balance_params(struct megasas_instance *instance,
 		}
 
 		raid = MR_LdRaidGet(ld, drv_map);
+		/*
+		 * RAID-10 is level 1 with spanDepth > 1. Degraded mirrors are
+		 * left alone: the map has no PD state to keep reads off a
+		 * copy that is still being rebuilt.
+		 */
        		if ((raid->level != 1) || 
 			(raid->ldState != MR_LD_STATE_OPTIMAL)) {
 			lbInfo[ldCount].loadBalanceFlag = 0;
 			continue;
 		}
+
+		/* Only LDs that get balanced pay for the per arm state */
+		if (!lbInfo[ldCount].slots) {
+			slots = kcalloc(MR_LB_SLOTS, sizeof(MR_LB_SLOT),
+					GFP_KERNEL);
+			if (!slots) {
+				lbInfo[ldCount].loadBalanceFlag = 0;
+				continue;
+			}
+			lbInfo[ldCount].slots = slots;
+		}
+		/* Zeroed slots must be visible before the flag */
+		smp_wmb();
 		lbInfo[ldCount].loadBalanceFlag = 1;
 	}
 }
 
+/* PD on an arm of a span, MR_PD_INVALID past the end of the map arrays */
+static u16 mr_lb_arm_pd(u32 ld, u8 span, u32 arm, MR_DRV_RAID_MAP_ALL *map)
+{
+	if ((span >= MAX_RAIDMAP_SPAN_DEPTH) || (arm >= MAX_RAIDMAP_ROW_SIZE))
+		return MR_PD_INVALID;
+	return MR_ArPdGet(MR_LdSpanArrayGet(ld, span, map), arm, map);
+}
+
+/*
+ * megasas_get_best_arm_pd -	Pick the copy of a RAID-1 strip to read from
+ *
+ * Every valid arm of the mirror set holding the strip is a candidate, so
+ * spanned RAID-10 and N-way mirrors are balanced the same way as a
+ * two-disk RAID-1. Returns the load balance slot (span_arm) of the arm
+ * chosen and updates io_info->span_arm and io_info->pd_after_lb.
+ */
 static u8 megasas_get_best_arm_pd(struct megasas_instance *instance, PLD_LOAD_BALANCE_INFO lbInfo, 
 		struct IO_REQUEST_INFO *io_info, MR_DRV_RAID_MAP_ALL *drv_map)
 {
-	MR_LD_RAID  *raid;
-	u16	pd1_devHandle;
-	u16     pend0, pend1, ld;
-	u64     diff0, diff1;
-	u8      bestArm, pd0, pd1, span, arm;
-	u32     arRef, span_row_size;
+	MR_LD_RAID *raid;
+	u64     diff, near_diff = ~0ULL, idle_diff = 0;
+	u32     pend, near_pend = 0, idle_pend = ~0U, fast_pend = ~0U;
+	u32     lat, fast_lat = ~0U, slow_lat = 0;
+	u32     span_row_size, copies;
+	u16     ld, pd;
+	u8      bestArm, near_arm, idle_arm, fast_arm, slow_arm, span, arm, base;
+	u8      slot, i;
 	
 	u64 block = io_info->ldStartBlock;
 	u32 count = io_info->numBlocks;
@@ -1245,53 +1328,145 @@ static u8 megasas_get_best_arm_pd(struct megasas_instance *instance, PLD_LOAD_BA
 	span_row_size = instance->UnevenSpanSupport ? 
 				SPAN_ROW_SIZE(drv_map, ld, span) : raid->rowSize;
 
-	arRef       = MR_LdSpanArrayGet(ld, span, drv_map);    
-	pd0          = MR_ArPdGet(arRef, arm, drv_map);    
-	pd1          = MR_ArPdGet(arRef, (arm + 1) >= span_row_size ? 
-				(arm + 1 - span_row_size): arm + 1, drv_map);     
-				
-	/* Get PD1 Dev Handle */
+	/* two way unless the row carries more copies of each strip */
+	copies = 2;
+	if (raid->rowDataSize && (raid->rowSize / raid->rowDataSize > 2))
+		copies = raid->rowSize / raid->rowDataSize;
+
+	/*
+	 * The map keeps the copies of a strip on adjacent arms, data arm
+	 * first: dataArmMap of a level 1 LD lists arm n * copies for logical
+	 * arm n, get_arm() doubles the logical arm for uneven spans (two-way
+	 * sets only) and MR_GetPhyParams() falls back to physArm + 1 when the
+	 * data arm has no PD. So the mirror set starts at the arm rounded
+	 * down to a multiple of the copy count, even if the strip was mapped to
+	 * a copy rather than the data arm.
+	 */
+	base = arm - (arm % copies);
+	near_arm = idle_arm = fast_arm = slow_arm = arm;
 
-	pd1_devHandle = MR_PdDevHandleGet(pd1, drv_map);
+	for (i = 0; (i < copies) && (base + i < span_row_size); i++) {
+		pd = mr_lb_arm_pd(ld, span, base + i, drv_map);
+		if ((pd == MR_PD_INVALID) ||
+			(MR_PdDevHandleGet(pd, drv_map) == MR_DEVHANDLE_INVALID))
+			continue;
 
-	if (pd1_devHandle == MR_DEVHANDLE_INVALID) {
-		bestArm = arm;
-	} else {
-		/* get the pending cmds for the data and mirror arms */
-		pend0 = atomic_read(&lbInfo->scsi_pending_cmds[pd0]);
-		pend1 = atomic_read(&lbInfo->scsi_pending_cmds[pd1]);
-
-		/* Determine the disk whose head is nearer to the req. block */
-		diff0 = ABS_DIFF(block, lbInfo->last_accessed_block[pd0]);
-		diff1 = ABS_DIFF(block, lbInfo->last_accessed_block[pd1]);
-		/*bestArm = diff0<=diff1 ? arm : arm ^ 1;*/
-		bestArm = (diff0 <= diff1 ? arm : arm ^ 1);
-	
+		slot = (span << RAID_CTX_SPANARM_SPAN_SHIFT) | (base + i);
+		pend = atomic_read(&lbInfo->slots[slot].scsi_pending_cmds);
+		diff = ABS_DIFF(block, lbInfo->slots[slot].last_accessed_block);
+
+		/* disk whose head is nearest to the req. block */
+		if (diff < near_diff) {
+			near_diff = diff;
+			near_pend = pend;
+			near_arm = base + i;
+		}
+
+		/* fewest pending, head distance breaks ties */
+		if ((pend < idle_pend) ||
+			((pend == idle_pend) && (diff < idle_diff))) {
+			idle_pend = pend;
+			idle_diff = diff;
+			idle_arm = base + i;
+		}
+
+		/*
+		 * A latency sample runs from issue to completion, so it
+		 * already holds the time spent queued behind the arm's other
+		 * commands. Compare the EWMAs as they are, fewest pending
+		 * breaks ties. An arm without samples gets the next read.
+		 */
+		lat = lbInfo->slots[slot].pd_latency;
+		if ((lat < fast_lat) ||
+			((lat == fast_lat) && (pend < fast_pend))) {
+			fast_lat = lat;
+			fast_pend = pend;
+			fast_arm = base + i;
+		}
+		if (lat > slow_lat) {
+			slow_lat = lat;
+			slow_arm = base + i;
+		}
+	}
+
+	switch (instance->lb_policy) {
+	case MR_LB_POLICY_QUEUE:
+		bestArm = idle_arm;
+		break;
+	case MR_LB_POLICY_LATENCY:
+		bestArm = fast_arm;
+		/*
+		 * An arm's EWMA only moves when it is read. Send every
+		 * MR_LB_LATENCY_EXPLORE'th read to the slowest arm, else an
+		 * arm that had one bad stretch is never sampled again.
+		 */
+		if (!(atomic_inc_return(&lbInfo->latency_reads) &
+		      (MR_LB_LATENCY_EXPLORE - 1)))
+			bestArm = slow_arm;
+		break;
+	default:
 		/*Make balance count from 16 to 4 to keep driver in sync with Firmware*/
-		if ((bestArm == arm && pend0 > pend1 + lb_pending_cmds)  ||  
-			(bestArm != arm && pend1 > pend0 + lb_pending_cmds))
-			bestArm ^= 1;
+		bestArm = near_arm;
+		if ((idle_pend != ~0U) && (near_pend > idle_pend + lb_pending_cmds))
+			bestArm = idle_arm;
+		break;
+	}
 
-		/* Update the last accessed block on the correct pd */
+	pd = mr_lb_arm_pd(ld, span, bestArm, drv_map);
+	if (pd != MR_PD_INVALID) {
 		io_info->span_arm = (span << RAID_CTX_SPANARM_SPAN_SHIFT) | bestArm;
-		io_info->pd_after_lb = (bestArm == arm) ? pd0:pd1;
+		io_info->pd_after_lb = pd;
 	}
 
-	lbInfo->last_accessed_block[bestArm==arm ? pd0 : pd1] = block + count - 1;
-	return io_info->pd_after_lb;
+	/* Update the last accessed block on the correct pd */
+	slot = io_info->span_arm;
+	lbInfo->slots[slot].last_accessed_block = block + count - 1;
+	atomic_inc(&lbInfo->slots[slot].arm_reads);
+	return slot;
 }
 
 u16 get_updated_dev_handle(struct megasas_instance *instance, 
 		PLD_LOAD_BALANCE_INFO lbInfo, struct IO_REQUEST_INFO *io_info,
 		MR_DRV_RAID_MAP_ALL *drv_map)
 {
-	u8 arm_pd;
+	u8 slot;
 	u16 devHandle;
 
+	/* caller saw loadBalanceFlag, pairs with mr_update_load_balance_params */
+	smp_rmb();
+
 	/* get best new arm (PD ID) */
-	arm_pd  = megasas_get_best_arm_pd(instance, lbInfo, io_info, drv_map);
-	devHandle = MR_PdDevHandleGet(arm_pd, drv_map);          
-	io_info->pdInterface = MR_PdInterfaceTypeGet(arm_pd, drv_map);
-	atomic_inc(&lbInfo->scsi_pending_cmds[arm_pd]);
+	slot = megasas_get_best_arm_pd(instance, lbInfo, io_info, drv_map);
+	devHandle = MR_PdDevHandleGet(io_info->pd_after_lb, drv_map);          
+	io_info->pdInterface = MR_PdInterfaceTypeGet(io_info->pd_after_lb, drv_map);
+	atomic_inc(&lbInfo->slots[slot].scsi_pending_cmds);
 	return devHandle;
 }
+
+/*
+ * mr_update_pd_latency -	Fold a R1 read completion time into the arm EWMA
+ * @lbInfo:			Load balance info of the LD
+ * @slot:			span_arm the read was sent to
+ * @issue_ns:			Time the read was fired
+ *
+ * Updates from different reply queues may race; a lost sample only
+ * delays convergence, so no lock is taken.
+ */
+void mr_update_pd_latency(PLD_LOAD_BALANCE_INFO lbInfo, u8 slot, u64 issue_ns)
+{
+	u64 now = ktime_to_ns(ktime_get());
+	u32 sample, ewma;
+
+	if (now <= issue_ns)
+		return;
+
+	sample = (u32)min_t(u64, now - issue_ns, (u32)~0);
+	ewma = lbInfo->slots[slot].pd_latency;
+	if (!ewma)
+		ewma = sample;
+	else
+		ewma = ewma - (ewma >> MR_LB_LATENCY_SHIFT) +
+			(sample >> MR_LB_LATENCY_SHIFT);
+	/* zero means no samples */
+	lbInfo->slots[slot].pd_latency = ewma ? ewma : 1;
+}
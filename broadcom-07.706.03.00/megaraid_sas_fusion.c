@@ -50,6 +50,7 @@
 #include <linux/compat.h>
 #include <linux/blkdev.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/poll.h>
 
 #include <scsi/scsi.h>
@@ -62,6 +63,9 @@
 #include "megaraid_sas_fusion.h"
 #include "megaraid_sas.h"
 
+#define CREATE_TRACE_POINTS
+#include "megaraid_sas_trace.h"
+
 
 extern void megasas_free_cmds(struct megasas_instance *instance);
 extern struct megasas_cmd *megasas_get_cmd(struct megasas_instance
@@ -97,9 +101,10 @@ megasas_check_and_restore_queue_depth(struct megasas_instance *instance);
 u8 MR_ValidateMapInfo(struct megasas_instance *instance, u64 map_id);
 u16 get_updated_dev_handle(struct megasas_instance *instance, PLD_LOAD_BALANCE_INFO lbInfo, 
 				struct IO_REQUEST_INFO *in_info, MR_DRV_RAID_MAP_ALL *drv_map);
+void mr_update_pd_latency(PLD_LOAD_BALANCE_INFO lbInfo, u8 slot, u64 issue_ns);
 int megasas_transition_to_ready(struct megasas_instance* instance, int ocr);
 void megaraid_sas_kill_hba(struct megasas_instance *instance);
-void UpdateIOMetric(struct megasas_instance *instance, u8 TargetId, u8 isRead, 
+void UpdateIOMetric(struct megasas_instance *instance, u16 TargetId, u8 isRead, 
 			u64 startBlock, u32 NumBlocks, u32 sector_size);
 int megasas_handle_cpx_requests( struct megasas_instance *instance);
 extern u32 megasas_dbg_lvl;
@@ -113,6 +118,7 @@ void megasas_start_timer(struct megasas_instance *instance,
 extern struct megasas_mgmt_info megasas_mgmt_info;
 extern unsigned int resetwaittime;
 extern unsigned int dual_qdepth_disable;
+extern unsigned int chain_frame_pool;
 
 extern int
 megasas_set_crash_dump_params(struct megasas_instance *instance, u8 crash_buf_state);
@@ -246,6 +252,239 @@ inline struct megasas_cmd_fusion *megasas_get_cmd_fusion(struct megasas_instance
 	return fusion->cmd_list[blk_tag];
 }
 
+/**
+ * megasas_get_blk_tag -	Return the fusion command index of a SCSI command
+ * @instance:			Adapter soft state
+ * @scmd:			SCSI command from the mid-layer
+ *
+ * With multiple blk-mq hardware queues every hctx owns a tag space of
+ * hwq_depth tags, so the hwq number selects a slice of the command list.
+ */
+static inline u32
+megasas_get_blk_tag(struct megasas_instance *instance, struct scsi_cmnd *scmd)
+{
+#ifdef KERNEL_SUPPORT_BLK_MQ_MULTI_HWQ
+	u32 unique_tag;
+
+	if (instance->host->nr_hw_queues > 1) {
+		unique_tag = blk_mq_unique_tag(scmd->request);
+		return (blk_mq_unique_tag_to_hwq(unique_tag) * instance->hwq_depth) +
+			blk_mq_unique_tag_to_tag(unique_tag);
+	}
+#endif
+	return scmd->request->tag;
+}
+
+/**
+ * megasas_get_msix_index -	Select reply queue for a SCSI command
+ * @instance:			Adapter soft state
+ * @scmd:			SCSI command from the mid-layer
+ *
+ * Reply queue follows the blk-mq hctx when one hardware queue per reply
+ * queue is exposed, otherwise the per CPU map built at IRQ setup time.
+ */
+static inline u8
+megasas_get_msix_index(struct megasas_instance *instance, struct scsi_cmnd *scmd)
+{
+#ifdef KERNEL_SUPPORT_BLK_MQ_MULTI_HWQ
+	if (instance->host->nr_hw_queues > 1)
+		return blk_mq_unique_tag_to_hwq(blk_mq_unique_tag(scmd->request));
+#endif
+	return instance->reply_map[smp_processor_id()];
+}
+
+/**
+ * megasas_chain_cache_get -	Take a chain frame from this CPU's cache
+ * @fusion:			Fusion context
+ * @cmd:			Command that needs a chain frame
+ *
+ * Returns true if cmd got a frame.
+ */
+static bool
+megasas_chain_cache_get(struct fusion_context *fusion,
+			struct megasas_cmd_fusion *cmd)
+{
+	struct megasas_chain_cache *cache;
+	unsigned long flags;
+	bool hit = false;
+
+	if (!fusion->chain_cache)
+		return false;
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(fusion->chain_cache);
+	spin_lock(&cache->lock);
+	if (cache->count) {
+		cache->count--;
+		cmd->sg_frame = cache->frame[cache->count].frame;
+		cmd->sg_frame_phys_addr = cache->frame[cache->count].phys_addr;
+		if (cache->count < cache->low)
+			cache->low = cache->count;
+		hit = true;
+	}
+	spin_unlock(&cache->lock);
+	local_irq_restore(flags);
+
+	return hit;
+}
+
+/**
+ * megasas_chain_cache_put -	Keep a released chain frame on this CPU
+ * @fusion:			Fusion context
+ * @cmd:			Command giving its chain frame up
+ *
+ * Returns false if the cache is full and the frame goes back to the pool.
+ */
+static bool
+megasas_chain_cache_put(struct fusion_context *fusion,
+			struct megasas_cmd_fusion *cmd)
+{
+	struct megasas_chain_cache *cache;
+	unsigned long flags;
+	bool cached = false;
+
+	if (!fusion->chain_cache)
+		return false;
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(fusion->chain_cache);
+	spin_lock(&cache->lock);
+	if (cache->count < MEGASAS_CHAIN_CACHE_SZ) {
+		cache->frame[cache->count].frame = cmd->sg_frame;
+		cache->frame[cache->count].phys_addr = cmd->sg_frame_phys_addr;
+		cache->count++;
+		cached = true;
+	}
+	spin_unlock(&cache->lock);
+	local_irq_restore(flags);
+
+	if (cached && !delayed_work_pending(&fusion->chain_trim_work))
+		schedule_delayed_work(&fusion->chain_trim_work,
+				      MEGASAS_CHAIN_TRIM_TICK);
+	return cached;
+}
+
+/**
+ * megasas_chain_trim_work -	Give idle cached chain frames back to the pool
+ * @work:			chain_trim_work of the fusion context
+ *
+ * Frames a CPU did not dip into since the last tick are freed, so the
+ * caches drain back to sg_dma_pool once chained IO stops.
+ */
+static void megasas_chain_trim_work(struct work_struct *work)
+{
+	struct fusion_context *fusion = container_of(work,
+		struct fusion_context, chain_trim_work.work);
+	struct megasas_chain_frame idle[MEGASAS_CHAIN_CACHE_SZ];
+	struct megasas_chain_cache *cache;
+	unsigned long flags;
+	bool cached = false;
+	u32 i, nr_idle;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(fusion->chain_cache, cpu);
+
+		spin_lock_irqsave(&cache->lock, flags);
+		nr_idle = cache->low;
+		cache->count -= nr_idle;
+		memcpy(idle, &cache->frame[cache->count],
+		       nr_idle * sizeof(idle[0]));
+		cache->low = cache->count;
+		if (cache->count)
+			cached = true;
+		spin_unlock_irqrestore(&cache->lock, flags);
+
+		for (i = 0; i < nr_idle; i++)
+			pci_pool_free(fusion->sg_dma_pool, idle[i].frame,
+				      idle[i].phys_addr);
+	}
+
+	if (cached)
+		schedule_delayed_work(&fusion->chain_trim_work,
+				      MEGASAS_CHAIN_TRIM_TICK);
+}
+
+/**
+ * megasas_get_chain_frame -	Attach an SG chain frame to a command
+ * @instance:			Adapter soft state
+ * @cmd:			Command that needs a chain frame
+ *
+ * With chain_frame_pool, frames come from this CPU's cache, from
+ * sg_dma_pool on demand and from the reserve when the pool cannot grow.
+ * Returns 0 on success, -ENOMEM when all of them are exhausted.
+ */
+static int
+megasas_get_chain_frame(struct megasas_instance *instance,
+			struct megasas_cmd_fusion *cmd)
+{
+	struct fusion_context *fusion = instance->ctrl_context;
+	unsigned long flags;
+	u32 in_use;
+
+	if (cmd->sg_frame)
+		return 0;
+
+	if (!megasas_chain_cache_get(fusion, cmd))
+		cmd->sg_frame = pci_pool_alloc(fusion->sg_dma_pool, GFP_ATOMIC,
+					       &cmd->sg_frame_phys_addr);
+	if (!cmd->sg_frame) {
+		spin_lock_irqsave(&fusion->chain_lock, flags);
+		if (fusion->chain_reserve_free) {
+			fusion->chain_reserve_free--;
+			cmd->sg_frame =
+				fusion->chain_reserve[fusion->chain_reserve_free].frame;
+			cmd->sg_frame_phys_addr =
+				fusion->chain_reserve[fusion->chain_reserve_free].phys_addr;
+			cmd->sg_frame_reserved = 1;
+			if (fusion->chain_reserve_free < fusion->chain_reserve_low)
+				fusion->chain_reserve_low = fusion->chain_reserve_free;
+		}
+		spin_unlock_irqrestore(&fusion->chain_lock, flags);
+
+		if (!cmd->sg_frame) {
+			atomic_inc(&fusion->chain_frame_fails);
+			return -ENOMEM;
+		}
+	}
+
+	/* racy max, only used for reporting */
+	in_use = atomic_inc_return(&fusion->chain_frames_in_use);
+	if (in_use > fusion->chain_frames_hwm)
+		fusion->chain_frames_hwm = in_use;
+
+	return 0;
+}
+
+/**
+ * megasas_put_chain_frame -	Release the SG chain frame of a command
+ * @instance:			Adapter soft state
+ * @cmd:			Command being returned
+ */
+static void
+megasas_put_chain_frame(struct megasas_instance *instance,
+			struct megasas_cmd_fusion *cmd)
+{
+	struct fusion_context *fusion = instance->ctrl_context;
+	unsigned long flags;
+
+	if (cmd->sg_frame_reserved) {
+		spin_lock_irqsave(&fusion->chain_lock, flags);
+		fusion->chain_reserve[fusion->chain_reserve_free].frame =
+			cmd->sg_frame;
+		fusion->chain_reserve[fusion->chain_reserve_free].phys_addr =
+			cmd->sg_frame_phys_addr;
+		fusion->chain_reserve_free++;
+		spin_unlock_irqrestore(&fusion->chain_lock, flags);
+		cmd->sg_frame_reserved = 0;
+	} else if (!megasas_chain_cache_put(fusion, cmd))
+		pci_pool_free(fusion->sg_dma_pool, cmd->sg_frame,
+			      cmd->sg_frame_phys_addr);
+
+	cmd->sg_frame = NULL;
+	atomic_dec(&fusion->chain_frames_in_use);
+}
+
 /**
  * megasas_return_cmd_fusion -	Return a cmd to free command pool
  * @instance:		Adapter soft state
@@ -254,8 +493,12 @@ inline struct megasas_cmd_fusion *megasas_get_cmd_fusion(struct megasas_instance
 inline void
 megasas_return_cmd_fusion(struct megasas_instance *instance, struct megasas_cmd_fusion *cmd)
 {
+	struct fusion_context *fusion = instance->ctrl_context;
+
+	if (cmd->sg_frame && fusion->chain_on_demand)
+		megasas_put_chain_frame(instance, cmd);
+
 	cmd->scmd = NULL;
-	memset(cmd->io_request, 0, MEGA_MPI2_RAID_DEFAULT_IO_FRAME_SIZE);
 	cmd->r1_alt_dev_handle = MR_DEVHANDLE_INVALID;
 	cmd->cmd_completed = false;
 	cmd->sge_count = 0;
@@ -271,9 +514,10 @@ megasas_return_cmd_fusion(struct megasas_instance *instance, struct megasas_cmd_
 void
 megasas_free_cmds_fusion(struct megasas_instance *instance)
 {
-	int i;
+	int i, cpu;
 	struct fusion_context *fusion = instance->ctrl_context;
 	struct megasas_cmd_fusion *cmd;
+	struct megasas_chain_cache *cache;
 
 	if (fusion->sense)
 		pci_pool_free(fusion->sense_dma_pool, fusion->sense,
@@ -293,6 +537,25 @@ megasas_free_cmds_fusion(struct megasas_instance *instance)
 		kfree(fusion->cmd_list);
 	}
 
+	for (i = 0; i < fusion->chain_reserve_free; i++)
+		pci_pool_free(fusion->sg_dma_pool,
+			      fusion->chain_reserve[i].frame,
+			      fusion->chain_reserve[i].phys_addr);
+	fusion->chain_reserve_free = 0;
+
+	if (fusion->chain_cache) {
+		cancel_delayed_work_sync(&fusion->chain_trim_work);
+		for_each_possible_cpu(cpu) {
+			cache = per_cpu_ptr(fusion->chain_cache, cpu);
+			for (i = 0; i < cache->count; i++)
+				pci_pool_free(fusion->sg_dma_pool,
+					      cache->frame[i].frame,
+					      cache->frame[i].phys_addr);
+		}
+		free_percpu(fusion->chain_cache);
+		fusion->chain_cache = NULL;
+	}
+
 	if (fusion->sg_dma_pool) {
 		pci_pool_destroy(fusion->sg_dma_pool);
 		fusion->sg_dma_pool = NULL;
@@ -401,18 +664,53 @@ static int megasas_create_sg_sense_fusion(struct megasas_instance *instance)
 			return -ENOMEM;
 		}
 	}
+	/*
+	 * With chain_frame_pool, most IOs fit the main message and commands
+	 * only take a chain frame while they need one. Keep a small reserve
+	 * so chained IOs make progress when the pool cannot grow.
+	 */
+	fusion->chain_on_demand = chain_frame_pool ? true : false;
+	if (fusion->chain_on_demand) {
+		for (i = 0; i < MEGASAS_CHAIN_FRAME_RESERVE; i++) {
+			fusion->chain_reserve[i].frame =
+				pci_pool_alloc(fusion->sg_dma_pool, GFP_KERNEL,
+					       &fusion->chain_reserve[i].phys_addr);
+			if (!fusion->chain_reserve[i].frame) {
+				dev_err(&instance->pdev->dev,
+					"failed from %s %d\n",  __func__, __LINE__);
+				return -ENOMEM;
+			}
+			fusion->chain_reserve_free++;
+		}
+		fusion->chain_reserve_low = fusion->chain_reserve_free;
+
+		INIT_DELAYED_WORK(&fusion->chain_trim_work,
+				  megasas_chain_trim_work);
+		fusion->chain_cache = alloc_percpu(struct megasas_chain_cache);
+		if (fusion->chain_cache) {
+			for_each_possible_cpu(i)
+				spin_lock_init(&per_cpu_ptr(fusion->chain_cache,
+							    i)->lock);
+		} else
+			dev_info(&instance->pdev->dev, "no per CPU chain frame "
+				 "cache, using sg_dma_pool directly\n");
+	}
+
 	/*
 	 * Allocate and attach a frame to each of the commands in cmd_list
 	 */
 	for (i = 0; i < max_cmd; i++) {
 		cmd = fusion->cmd_list[i];
-		cmd->sg_frame = pci_pool_alloc(fusion->sg_dma_pool,
-					GFP_KERNEL, &cmd->sg_frame_phys_addr);
 
 		offset = SCSI_SENSE_BUFFERSIZE * i;
 		cmd->sense = (u8 *)fusion->sense + offset;
 		cmd->sense_phys_addr = fusion->sense_phys_addr + offset;
-		
+
+		if (fusion->chain_on_demand)
+			continue;
+
+		cmd->sg_frame = pci_pool_alloc(fusion->sg_dma_pool,
+					GFP_KERNEL, &cmd->sg_frame_phys_addr);
 		if (!cmd->sg_frame) {
 			dev_err(&instance->pdev->dev,
 				"failed from %s %d\n",  __func__, __LINE__);
@@ -939,9 +1237,12 @@ megasas_fire_cmd_fusion(struct megasas_instance *instance,
 	u64 req_data = (((u64)le32_to_cpu(req_desc->u.high) << 32) |
 		le32_to_cpu(req_desc->u.low));
 
+	trace_megasas_fire_cmd(instance, req_desc);
 	writeq(req_data, &instance->reg_set->inbound_low_queue_port);
 #else
 	unsigned long flags;
+
+	trace_megasas_fire_cmd(instance, req_desc);
 	spin_lock_irqsave(&instance->hba_lock, flags);
 	writel(le32_to_cpu(req_desc->u.low),
 		&instance->reg_set->inbound_low_queue_port);
@@ -952,6 +1253,48 @@ megasas_fire_cmd_fusion(struct megasas_instance *instance,
 #endif
 }
 
+/**
+ * megasas_fire_cmds_fusion -	Sends a batch of commands to the FW
+ * @instance:			Adapter soft state
+ * @req_descs:			Request descriptors, posted in array order
+ * @count:			Number of descriptors
+ *
+ * Same as megasas_fire_cmd_fusion, but when the descriptor has to be
+ * written as two 32 bit halves hba_lock is taken once for the whole
+ * batch (e.g. both legs of a R1 fast path write) instead of per command.
+ */
+static void
+megasas_fire_cmds_fusion(struct megasas_instance *instance,
+		MEGASAS_REQUEST_DESCRIPTOR_UNION **req_descs, int count)
+{
+	int i;
+#if defined(writeq) && defined(CONFIG_64BIT)
+	u64 req_data;
+
+	for (i = 0; i < count; i++) {
+		req_data = (((u64)le32_to_cpu(req_descs[i]->u.high) << 32) |
+			le32_to_cpu(req_descs[i]->u.low));
+		trace_megasas_fire_cmd(instance, req_descs[i]);
+		writeq(req_data, &instance->reg_set->inbound_low_queue_port);
+	}
+#else
+	unsigned long flags;
+
+	for (i = 0; i < count; i++)
+		trace_megasas_fire_cmd(instance, req_descs[i]);
+
+	spin_lock_irqsave(&instance->hba_lock, flags);
+	for (i = 0; i < count; i++) {
+		writel(le32_to_cpu(req_descs[i]->u.low),
+			&instance->reg_set->inbound_low_queue_port);
+		writel(le32_to_cpu(req_descs[i]->u.high),
+			&instance->reg_set->inbound_high_queue_port);
+	}
+	mmiowb();
+	spin_unlock_irqrestore(&instance->hba_lock, flags);
+#endif
+}
+
 /**
  * megasas_fusion_update_can_queue -	Do all Adapter Queue depth related calculations here 
  * @instance:							Adapter soft state
@@ -993,10 +1336,16 @@ megasas_fusion_update_can_queue(struct megasas_instance *instance, int fw_boot_c
 							MEGASAS_FUSION_IOCTL_CMDS);
 				instance->host->can_queue = instance->cur_can_queue; 
 				instance->ldio_threshold = ldio_threshold;
+				megasas_outstanding_set_limit(&instance->fw_outstanding,
+					instance->cur_can_queue);
+				megasas_outstanding_set_limit(&instance->ldio_outstanding,
+					ldio_threshold);
 		}
 	} else {
 		instance->max_fw_cmds = cur_max_fw_cmds;
 		instance->ldio_threshold = ldio_threshold;
+		megasas_outstanding_set_limit(&instance->ldio_outstanding,
+			ldio_threshold);
 		
 		/*
 		 * Reduce controller Queue depth hence reducing IO resources and
@@ -1352,13 +1701,13 @@ megasas_get_map_info(struct megasas_instance *instance)
 {
 	struct fusion_context *fusion = instance->ctrl_context;
 
-	fusion->fast_path_io = 0;
 	if (!megasas_get_ld_map_info(instance)) {
 		if (MR_ValidateMapInfo(instance, instance->map_id)) {
 			fusion->fast_path_io = 1;
 			return 0;
 		}
 	}
+	fusion->fast_path_io = 0;
 	return 1;
 }
 
@@ -1401,7 +1750,8 @@ megasas_sync_map_info(struct megasas_instance *instance)
 		return 1;
 	}
 
-	map = fusion->ld_drv_map[instance->map_id & 1];
+	rcu_read_lock();
+	map = rcu_dereference(fusion->cur_drv_map);
 
 	num_lds = le16_to_cpu(map->raidMap.ldCount);
 
@@ -1423,6 +1773,7 @@ megasas_sync_map_info(struct megasas_instance *instance)
 		ld_sync->targetId = MR_GetLDTgtId(i, map);
  		ld_sync->seqNum = raid->seqNum;
 	}
+	rcu_read_unlock();
 
 	size_map_info = fusion->current_map_sz; 
 
@@ -1441,6 +1792,7 @@ megasas_sync_map_info(struct megasas_instance *instance)
 
 	instance->map_update_cmd = cmd;
 
+	trace_megasas_map_sync(instance, num_lds, size_map_info);
 	instance->instancet->issue_dcmd(instance, cmd);
 
 	return 0;
@@ -1541,37 +1893,48 @@ static inline int megasas_allocate_raid_maps(struct megasas_instance *instance)
 			if (!fusion->ld_drv_map[i]) {
 				dev_err(&instance->pdev->dev, "Could not allocate memory for local map "
 					" size requested: %d", fusion->drv_map_sz);
-
-				if (fusion->ld_drv_map[0]) {
-					if (is_vmalloc_addr(fusion->ld_drv_map[0]))
-						vfree(fusion->ld_drv_map[0]);
-					else
-						free_pages((ulong)fusion->ld_drv_map[0],
-							fusion->drv_map_pages);
-				}
-
-				return -ENOMEM;
-
+				goto free_drv_map;
 			} else
 				memset(fusion->ld_drv_map[i], 0, fusion->drv_map_sz);
 		}
+		memset(fusion->ld_drv_map[i]->raidMap.ldTgtIdToLd, 0xff,
+			(sizeof(u16) * MAX_LOGICAL_DRIVES_DYN));
 	}
 
+	/* Readers always find a map; an empty one until the first validates */
+	RCU_INIT_POINTER(fusion->cur_drv_map, fusion->ld_drv_map[0]);
+
 	for (i = 0; i < 2; i++) {
 		fusion->ld_map[i] = dma_alloc_coherent(&instance->pdev->dev, fusion->max_map_sz,
 						       &fusion->ld_map_phys[i], GFP_KERNEL);
 		if (!fusion->ld_map[i]) {
 			printk(KERN_ERR "megasas: Could not allocate memory for map "
 			       " info %s:%d \n", __func__, __LINE__);
-
-			if (fusion->ld_map[0])
-				dma_free_coherent(&instance->pdev->dev, fusion->max_map_sz,
-					fusion->ld_map[0], fusion->ld_map_phys[0]);
-			return -ENOMEM;
+			goto free_ld_map;
 		}
 	}
 
 	return 0;
+
+	/* each stage frees the first i buffers of its own kind, then all earlier ones */
+free_ld_map:
+	while (--i >= 0) {
+		dma_free_coherent(&instance->pdev->dev, fusion->max_map_sz,
+			fusion->ld_map[i], fusion->ld_map_phys[i]);
+		fusion->ld_map[i] = NULL;
+	}
+	i = 2;
+free_drv_map:
+	RCU_INIT_POINTER(fusion->cur_drv_map, NULL);
+	while (--i >= 0) {
+		if (is_vmalloc_addr(fusion->ld_drv_map[i]))
+			vfree(fusion->ld_drv_map[i]);
+		else
+			free_pages((ulong)fusion->ld_drv_map[i],
+				fusion->drv_map_pages);
+		fusion->ld_drv_map[i] = NULL;
+	}
+	return -ENOMEM;
 }
 
 
@@ -1817,6 +2180,11 @@ map_cmd_status(struct fusion_context *fusion, struct scsi_cmnd *scmd,
 	case MFI_STAT_SCSI_DONE_WITH_ERROR:
 
 		scmd->result = (DID_OK << 16) | ext_status;
+		if ((ext_status == SAM_STAT_BUSY) ||
+		    (ext_status == SAM_STAT_TASK_SET_FULL))
+			megasas_qd_signal((struct megasas_instance *)
+					  scmd->device->host->hostdata,
+					  scmd->device, MEGASAS_QD_BUSY);
 		if (ext_status == SAM_STAT_CHECK_CONDITION) {
 			memset(scmd->sense_buffer, 0,
 			       SCSI_SENSE_BUFFERSIZE);
@@ -1954,7 +2322,7 @@ static bool
 megasas_make_prp_nvme(struct megasas_instance *instance, struct scsi_cmnd *scmd,
 	pMpi25IeeeSgeChain64_t sgl_ptr, struct megasas_cmd_fusion *cmd, int sge_count)
 {
-	int sge_len, offset, num_prp_in_chain = 0;
+	int sge_len, offset, run_pages, num_prp_in_chain = 0;
 	pMpi25IeeeSgeChain64_t main_chain_element, ptr_first_sgl;
 	u64 *ptr_sgl;
 	dma_addr_t ptr_sgl_phys;
@@ -1974,6 +2342,10 @@ megasas_make_prp_nvme(struct megasas_instance *instance, struct scsi_cmnd *scmd,
 	
 	if (!build_prp)
 		return false;
+
+	/* without a chain frame the IO still fits the main message as IEEE */
+	if (megasas_get_chain_frame(instance, cmd))
+		return false;
 	
 	/*
 	 * NVMe has a very convoluted PRP format.  One PRP is required
@@ -1986,11 +2358,13 @@ megasas_make_prp_nvme(struct megasas_instance *instance, struct scsi_cmnd *scmd,
 	 * SGL entry in the main message in IEEE 64 format.  The 2nd
 	 * entry in the main message is the chain element, and the rest
 	 * of the PRP entries are built in the contiguous PCIe buffer.
+	 *
+	 * Firmware only reads the chain element length worth of PRPs, so
+	 * the chain frame is not cleared first.
 	 */
 	page_mask = mr_nvme_pg_size - 1;
 	ptr_sgl = (u64 *) cmd->sg_frame;
 	ptr_sgl_phys = cmd->sg_frame_phys_addr;
-	memset(ptr_sgl, 0, instance->max_chain_frame_sz);
 
 	/* Build chain frame element which holds all PRPs except first*/
 	main_chain_element = (pMpi25IeeeSgeChain64_t)
@@ -2015,52 +2389,45 @@ megasas_make_prp_nvme(struct megasas_instance *instance, struct scsi_cmnd *scmd,
 	
 	ptr_first_sgl->Address = cpu_to_le64(sge_addr);
 	ptr_first_sgl->Length = cpu_to_le32(first_prp_len);
+	ptr_first_sgl->NextChainOffset = 0;
+	ptr_first_sgl->Flags = 0;
 	
 	data_len -= first_prp_len;	
-	
-	if (sge_len > first_prp_len) {
-		sge_addr += first_prp_len;
-		sge_len -= first_prp_len;
-	} else if (sge_len == first_prp_len) {
-		sg_scmd = sg_next(sg_scmd);
-		sge_addr = sg_dma_address(sg_scmd);
-		sge_len = sg_dma_len(sg_scmd);
-	}
+	sge_addr += first_prp_len;
+	sge_len -= first_prp_len;
 
-	for (;;) {
+	/*
+	 * megasas_is_prp_possible() made sure every SGE after the first PRP
+	 * starts page aligned and only the last one may end short, so each
+	 * SGE is a physically contiguous run of pages.
+	 */
+	while (data_len > 0) {
+		if (sge_len <= 0) {
+			sg_scmd = sg_next(sg_scmd);
+			sge_addr = sg_dma_address(sg_scmd);
+			sge_len = sg_dma_len(sg_scmd);
+		}
 
-		offset = (u32) (sge_addr & page_mask);
+		run_pages = DIV_ROUND_UP(min(sge_len, data_len), mr_nvme_pg_size);
+		sge_len -= run_pages * mr_nvme_pg_size;
+		data_len -= run_pages * mr_nvme_pg_size;
+
+		for (; run_pages; run_pages--) {
+			/* Put PRP pointer due to page boundary*/
+			page_mask_result = (uintptr_t)(ptr_sgl + 1) & page_mask;
+			if (unlikely(!page_mask_result)) {
+				ptr_sgl_phys += 8;
+				*ptr_sgl = cpu_to_le64(ptr_sgl_phys);
+				ptr_sgl++;
+				num_prp_in_chain++;
+			}
 
-		/* Put PRP pointer due to page boundary*/
-		page_mask_result = (uintptr_t)(ptr_sgl + 1) & page_mask;
-		if (unlikely(!page_mask_result)) {
-			scmd_printk(KERN_NOTICE, scmd, "BRCM: Put prp pointer as we are at page boundary"
-					" ptr_sgl: 0x%p\n", ptr_sgl);
-			ptr_sgl_phys += 8;
-			*ptr_sgl = cpu_to_le64(ptr_sgl_phys);
+			*ptr_sgl = cpu_to_le64(sge_addr);
 			ptr_sgl++;
+			ptr_sgl_phys += 8;
 			num_prp_in_chain++;
-	 	}
-
-		*ptr_sgl = cpu_to_le64(sge_addr);
-		ptr_sgl++;
-		ptr_sgl_phys += 8;
-		num_prp_in_chain++;
-
-		
-		sge_addr += mr_nvme_pg_size;
-		sge_len -= mr_nvme_pg_size;
-		data_len -= mr_nvme_pg_size;
-	
-		if (data_len <= 0)
-			break;
-
-		if (sge_len > 0)
-			continue;
-			
-	 	sg_scmd = sg_next(sg_scmd);
-		sge_addr = sg_dma_address(sg_scmd);
-		sge_len = sg_dma_len(sg_scmd);
+			sge_addr += mr_nvme_pg_size;
+		}
 	}
 	
 	main_chain_element->Length = cpu_to_le32(num_prp_in_chain * sizeof(u64));
@@ -2157,9 +2524,16 @@ void megasas_make_sgl(struct megasas_instance *instance, struct scsi_cmnd *scp,
 			struct megasas_cmd_fusion *cmd, int sge_count)
 {
 	bool build_prp = false;
+	u64 start_ns = 0, build_ns;
 
-	if (sge_count == 0)
+	if (sge_count == 0) {
+		/* no data, do not leave a stale SGE of the previous IO behind */
+		memset(&cmd->io_request->SGL, 0, sizeof(MPI2_SGE_IO_UNION));
 		return;
+	}
+
+	if (unlikely(megasas_dbg_lvl & SGL_BUILD_STATS))
+		start_ns = ktime_to_ns(ktime_get());
 
 	if ((le16_to_cpu(cmd->io_request->IoFlags) &
 			MPI25_SAS_DEVICE0_FLAGS_ENABLED_FAST_PATH) &&
@@ -2171,6 +2545,17 @@ void megasas_make_sgl(struct megasas_instance *instance, struct scsi_cmnd *scp,
 		megasas_make_sgl_fusion(instance, scp,
 			(pMpi25IeeeSgeChain64_t) &cmd->io_request->SGL, cmd, sge_count);
 
+	if (unlikely(start_ns)) {
+		build_ns = ktime_to_ns(ktime_get()) - start_ns;
+		if (build_prp) {
+			atomic64_add(build_ns, &instance->prp_sgl_build_ns);
+			atomic_inc(&instance->prp_sgl_timed);
+		} else {
+			atomic64_add(build_ns, &instance->ieee_sgl_build_ns);
+			atomic_inc(&instance->ieee_sgl_timed);
+		}
+	}
+
 	return;
 }
 
@@ -2347,7 +2732,54 @@ megasas_set_pd_lba(MEGASAS_RAID_SCSI_IO_REQUEST *io_request, u8 cdb_len, struct
 	}
 }
 
-/** stream detection on read and and write IOs */
+/**
+ * megasas_init_stream_detect -	Reset the stream tracker of one LD
+ * @instance:			Adapter soft state
+ * @current_ld_SD:		Stream tracker, sized for instance->stream_count streams
+ *
+ * All streams are forgotten, the hit/miss counters are kept.
+ */
+void megasas_init_stream_detect(struct megasas_instance *instance,
+				LD_STREAM_DETECT *current_ld_SD)
+{
+	u64 hits = current_ld_SD->streamHits;
+	u64 misses = current_ld_SD->streamMisses;
+	int i;
+
+	memset(current_ld_SD, 0, sizeof(LD_STREAM_DETECT) +
+		instance->stream_count * sizeof(STREAM_DETECT));
+	current_ld_SD->numStreams = instance->stream_count;
+	current_ld_SD->streamHits = hits;
+	current_ld_SD->streamMisses = misses;
+
+	INIT_LIST_HEAD(&current_ld_SD->lruList);
+	for (i = 0; i < MEGASAS_STREAM_HASH_BUCKETS; i++)
+		INIT_HLIST_HEAD(&current_ld_SD->hashTable[i]);
+	for (i = 0; i < current_ld_SD->numStreams; i++) {
+		INIT_HLIST_NODE(&current_ld_SD->streamTrack[i].hashNode);
+		list_add_tail(&current_ld_SD->streamTrack[i].lruNode,
+			      &current_ld_SD->lruList);
+	}
+}
+
+static inline u32 megasas_stream_hash(u64 lba)
+{
+	return (u32)(lba >> MEGASAS_STREAM_HASH_SHIFT) &
+		(MEGASAS_STREAM_HASH_BUCKETS - 1);
+}
+
+/**
+ * megasas_stream_detect -	Stream detection on read and write IOs
+ * @instance:			Adapter soft state
+ * @cmd:			Fusion command of the IO
+ * @io_info:			IO request info
+ *
+ * An IO continues a stream when it starts at most instance->stream_gap
+ * blocks past the stream's nextSeqLBA. Streams are hashed by nextSeqLBA
+ * in granules larger than the max gap, so only the bucket of the start
+ * LBA and the one of (start LBA - gap) have to be searched. On a miss the
+ * least recently used stream is recycled. Called with stream_lock held.
+ */
 static void megasas_stream_detect(struct megasas_instance *instance,
 				struct megasas_cmd_fusion *cmd,
 				struct IO_REQUEST_INFO *io_info)
@@ -2355,56 +2787,48 @@ static void megasas_stream_detect(struct megasas_instance *instance,
 	struct fusion_context *fusion = instance->ctrl_context;
 	u32 device_id = io_info->ldTgtId;
 	LD_STREAM_DETECT *current_ld_SD = fusion->streamDetectByLD[device_id];
-	u32 *track_stream = &current_ld_SD->mruBitMap, streamNum, shiftedValues,unshiftedValues;
-	u32 indexValueMask, shiftedValuesMask;
-	int i;
-	bool isReadAhead = false;
 	STREAM_DETECT *current_SD;
+	struct hlist_node *node;
+	u64 start = io_info->ldStartBlock;
+	u64 gap = instance->stream_gap;
+	u32 bucket, last_bucket;
+	bool hit = false;
+
+	bucket = megasas_stream_hash(start);
+	last_bucket = megasas_stream_hash(start > gap ? start - gap : 0);
+
 	/* find possible stream */
-	for( i=0; i<MAX_STREAMS_TRACKED; ++i ) {
-		streamNum = (*track_stream >>(i*BITS_PER_INDEX_STREAM)) & 
-						STREAM_MASK;
-		current_SD = &current_ld_SD->streamTrack[streamNum];
-	/* if we found a stream, update the raid context and also update the mruBitMap */
-		if(current_SD->nextSeqLBA && /*	boundry condition */
-				io_info->ldStartBlock >= current_SD->nextSeqLBA && 
-				(io_info->ldStartBlock <= (current_SD->nextSeqLBA+32)) &&
-				(current_SD->isRead == io_info->isRead))
-		{
-			if( io_info->ldStartBlock != current_SD->nextSeqLBA &&
-					(!io_info->isRead || !isReadAhead ))
-		/*
-		 *  Once the API availible we need to change this.
- 		 * At this point we are not allowing any gap
-		 */
-				continue;
-			SET_STREAM_DETECTED(cmd->io_request->RaidContext.raid_context_g35);
-			current_SD->nextSeqLBA = io_info->ldStartBlock + io_info->numBlocks;
-		/*
- 		 * 	 update the mruBitMap LRU	
- 		 */
-			shiftedValuesMask = (1 <<  i*BITS_PER_INDEX_STREAM) -1 ;
-			shiftedValues = ((*track_stream & shiftedValuesMask) 
-						<< BITS_PER_INDEX_STREAM );
-			indexValueMask = STREAM_MASK << i*BITS_PER_INDEX_STREAM;
-			unshiftedValues = *track_stream & ~(shiftedValuesMask| indexValueMask);
-			*track_stream = unshiftedValues | shiftedValues | streamNum;
-			return ;
-			
+	for (;;) {
+		for (node = current_ld_SD->hashTable[bucket].first; node;
+		     node = node->next) {
+			current_SD = hlist_entry(node, STREAM_DETECT, hashNode);
+			if ((current_SD->isRead == io_info->isRead) &&
+			    (start >= current_SD->nextSeqLBA) &&
+			    (start <= current_SD->nextSeqLBA + gap)) {
+				SET_STREAM_DETECTED(cmd->io_request->RaidContext.raid_context_g35);
+				current_ld_SD->streamHits++;
+				hit = true;
+				goto update;
+			}
 		}
-		
+		if (bucket == last_bucket)
+			break;
+		bucket = last_bucket;
 	}
-	/*
- 	* if we did not find any stream, create a new one from the least recently used
- 	*/
-	streamNum = (*track_stream >> ((MAX_STREAMS_TRACKED -1 ) *BITS_PER_INDEX_STREAM)) & 
-					STREAM_MASK;
-	current_SD = &current_ld_SD->streamTrack[streamNum];
+
+	/* if we did not find any stream, create a new one from the least recently used */
+	current_SD = list_entry(current_ld_SD->lruList.prev, STREAM_DETECT, lruNode);
 	current_SD->isRead = io_info->isRead;
-	current_SD->nextSeqLBA = io_info->ldStartBlock + io_info->numBlocks;
-	*track_stream = (((*track_stream & ZERO_LAST_STREAM) << 4 ) | streamNum);
-	return; 
+	current_ld_SD->streamMisses++;
+
+update:
+	current_SD->nextSeqLBA = start + io_info->numBlocks;
+	hlist_del_init(&current_SD->hashNode);
+	hlist_add_head(&current_SD->hashNode,
+		&current_ld_SD->hashTable[megasas_stream_hash(current_SD->nextSeqLBA)]);
+	list_move(&current_SD->lruNode, &current_ld_SD->lruList);
 
+	trace_megasas_stream_detect(instance, io_info, hit);
 }
 
 /**
@@ -2477,27 +2901,36 @@ megasas_set_raidflag_cpu_affinity(RAID_CONTEXT_UNION *pRAID_Context, MR_LD_RAID
 	}
 }
 
-/*
- * megasas_atomic_dec_if_positive - decrement by 1 if old value positive
- * @v: pointer of type atomic_t
- *
- * The function returns the old value of *v minus 1, even if
- * the atomic variable, v, was not decremented.
+/**
+ * megasas_account_fp -	Account a read/write LD IO to FP or FW path
+ * @instance:		Adapter soft state
+ * @device_id:		Target id of the LD
+ * @fp_miss:		MEGASAS_FP_MISS_NONE for FP IOs, else why FW got it
+ * @bytes:		Transfer length
+ * @region_lock:	FP IO still needs a FW region lock
  */
-static inline int megasas_atomic_dec_if_positive(atomic_t *v)
+static inline void
+megasas_account_fp(struct megasas_instance *instance, u32 device_id,
+		   u8 fp_miss, u32 bytes, bool region_lock)
 {
-	int c, old, dec;
-	c = atomic_read(v);
-	for (;;) {
-		dec = c - 1;
-		if (unlikely(dec < 0))
-			break;
-		old = atomic_cmpxchg((v), c, dec);
-		if (likely(old == c))
-			break;
-		c = old;
+	struct fusion_context *fusion = instance->ctrl_context;
+	struct megasas_fp_stats *stats;
+
+	if (!fusion->fp_stats || (device_id >= MAX_LOGICAL_DRIVES_EXT))
+		return;
+
+	stats = megasas_fp_stats_get(fusion, get_cpu(), device_id);
+	if (fp_miss == MEGASAS_FP_MISS_NONE) {
+		stats->fp_ops++;
+		stats->fp_bytes += bytes;
+		if (region_lock)
+			stats->region_lock++;
+	} else {
+		stats->fw_ops++;
+		stats->fw_bytes += bytes;
+		stats->miss[fp_miss]++;
 	}
-	return dec;
+	put_cpu();
 }
 
 /**
@@ -2528,6 +2961,7 @@ megasas_build_ldio_fusion(struct megasas_instance *instance,struct scsi_cmnd *sc
 	RAID_CONTEXT_UNION *pRAID_Context;
 	MR_LD_RAID *raid = NULL;
 	struct MR_PRIV_DEVICE *mrdev_priv;
+	u8 fp_miss;
 
 	device_id = MEGASAS_DEV_INDEX(scp);
 
@@ -2535,8 +2969,6 @@ megasas_build_ldio_fusion(struct megasas_instance *instance,struct scsi_cmnd *sc
 
 	io_request = cmd->io_request;
 	io_request->RaidContext.raid_context.VirtualDiskTgtId = cpu_to_le16(device_id);
-	io_request->RaidContext.raid_context.status = 0;
-	io_request->RaidContext.raid_context.exStatus = 0;
 
 	req_desc = (MEGASAS_REQUEST_DESCRIPTOR_UNION *)cmd->request_desc;
 
@@ -2605,7 +3037,8 @@ megasas_build_ldio_fusion(struct megasas_instance *instance,struct scsi_cmnd *sc
 	if (scp->sc_data_direction == PCI_DMA_FROMDEVICE)
 		io_info.isRead = 1;
 
-	local_map_ptr = fusion->ld_drv_map[(instance->map_id & 1)];
+	rcu_read_lock();
+	local_map_ptr = rcu_dereference(fusion->cur_drv_map);
 	ld = MR_TargetIdToLdGet(device_id, local_map_ptr);
 	if ((ld < instance->fw_supported_vd_count))
 		raid = MR_LdRaidGet(ld, local_map_ptr);
@@ -2613,6 +3046,7 @@ megasas_build_ldio_fusion(struct megasas_instance *instance,struct scsi_cmnd *sc
 	if (!raid || !fusion->fast_path_io) {
 		io_request->RaidContext.raid_context.regLockFlags  = 0;
 		fp_possible = false;
+		fp_miss = MEGASAS_FP_MISS_NO_MAP;
 	} else {
 		if (MR_BuildRaidContext(
 				instance, &io_info,
@@ -2620,9 +3054,11 @@ megasas_build_ldio_fusion(struct megasas_instance *instance,struct scsi_cmnd *sc
 				local_map_ptr, &raidLUN)
 			)
 			fp_possible = (io_info.fpOkForIo > 0) ? true : false;
+		fp_miss = fp_possible ? MEGASAS_FP_MISS_NONE :
+			(io_info.fp_miss ? io_info.fp_miss : MEGASAS_FP_MISS_SPAN);
 	}
 
-	cmd->request_desc->SCSIIO.MSIxIndex = instance->msix_vectors ? smp_processor_id() % instance->msix_vectors : 0;
+	cmd->request_desc->SCSIIO.MSIxIndex = megasas_get_msix_index(instance, scp);
 
 	pRAID_Context = &io_request->RaidContext;
 
@@ -2639,14 +3075,17 @@ megasas_build_ldio_fusion(struct megasas_instance *instance,struct scsi_cmnd *sc
 		if (io_info.r1_alt_dev_handle != MR_DEVHANDLE_INVALID) {
 			mrdev_priv = scp->device->hostdata;
 
-			if (atomic_inc_return(&instance->fw_outstanding) >
-				(instance->host->can_queue)) {
+			/* only the first reason that took FP away is counted */
+			if (!megasas_outstanding_get(&instance->fw_outstanding)) {
+				if (fp_possible)
+					fp_miss = MEGASAS_FP_MISS_R1_CREDIT;
 				fp_possible = false;
-				atomic_dec(&instance->fw_outstanding);
 			} else if ((scsi_buff_len > MR_LARGE_IO_MIN_SIZE) ||
 				megasas_atomic_dec_if_positive(&mrdev_priv->r1_ldio_hint) > 0) {
+				if (fp_possible)
+					fp_miss = MEGASAS_FP_MISS_R1_LARGE;
 				fp_possible = false;
-				atomic_dec(&instance->fw_outstanding);
+				megasas_outstanding_put(&instance->fw_outstanding);
 				if (scsi_buff_len > MR_LARGE_IO_MIN_SIZE)
 					atomic_set(&mrdev_priv->r1_ldio_hint,
 						instance->r1_ldio_hint_default);
@@ -2658,8 +3097,11 @@ megasas_build_ldio_fusion(struct megasas_instance *instance,struct scsi_cmnd *sc
 				spin_lock_irqsave(&instance->stream_lock, spinlock_flags);
 				megasas_stream_detect(instance, cmd, &io_info);
 				spin_unlock_irqrestore(&instance->stream_lock, spinlock_flags);
-				if (is_stream_detected(&io_request->RaidContext.raid_context_g35))
+				if (fp_possible &&
+				    is_stream_detected(&io_request->RaidContext.raid_context_g35)) {
 					fp_possible = false;
+					fp_miss = MEGASAS_FP_MISS_STREAM;
+				}
 		}
 
 		if (raid)
@@ -2718,7 +3160,7 @@ megasas_build_ldio_fusion(struct megasas_instance *instance,struct scsi_cmnd *sc
 			io_info.devHandle = get_updated_dev_handle(instance,
 						&fusion->load_balance_info[device_id], &io_info, local_map_ptr);
 			scp->SCp.Status |= MEGASAS_LOAD_BALANCE_FLAG;
-			cmd->pd_r1_lb = io_info.pd_after_lb;
+			cmd->r1_lb_slot = io_info.span_arm;
 			if (instance->adapter_type == VENTURA_SERIES)
 				io_request->RaidContext.raid_context_g35.spanArm = io_info.span_arm;
 			else
@@ -2771,13 +3213,20 @@ megasas_build_ldio_fusion(struct megasas_instance *instance,struct scsi_cmnd *sc
 		io_request->Function = MEGASAS_MPI2_FUNCTION_LD_IO_REQUEST;
 		io_request->DevHandle = cpu_to_le16(device_id);
 	} /* Not FP */
-
-	/* Update IO metrics */
-	lba = (u64)start_lba_hi << 32 | start_lba_lo;
-	spin_lock_irqsave(&instance->hba_lock, spinlock_flags);
-	UpdateIOMetric(instance, device_id, io_info.isRead, lba, datalength,
-		scp->device->sector_size);
-	spin_unlock_irqrestore(&instance->hba_lock, spinlock_flags);
+	rcu_read_unlock();
+
+	megasas_account_fp(instance, device_id, fp_miss, scsi_buff_len,
+		fp_possible && (instance->adapter_type == INVADER_SERIES) &&
+		((cmd->request_desc->SCSIIO.RequestFlags >>
+		  MEGASAS_REQ_DESCRIPT_FLAGS_TYPE_SHIFT) !=
+		 MEGASAS_REQ_DESCRIPT_FLAGS_NO_LOCK));
+
+	/* Update IO metrics, only while FW runs a collection */
+	if (instance->PerformanceMetric.LogOn) {
+		lba = (u64)start_lba_hi << 32 | start_lba_lo;
+		UpdateIOMetric(instance, device_id, io_info.isRead, lba,
+			datalength, scp->device->sector_size);
+	}
 
 }
 
@@ -2805,7 +3254,8 @@ static void megasas_build_ld_nonrw_fusion(struct megasas_instance *instance,
 
 	io_request = cmd->io_request;
 	device_id = MEGASAS_DEV_INDEX(scmd);
-	local_map_ptr = fusion->ld_drv_map[(instance->map_id & 1)];
+	rcu_read_lock();
+	local_map_ptr = rcu_dereference(fusion->cur_drv_map);
 	io_request->DataLength = cpu_to_le32(scsi_bufflen(scmd));
 	/* get RAID_Context pointer */
 	pRAID_Context = &io_request->RaidContext.raid_context;
@@ -2865,6 +3315,7 @@ static void megasas_build_ld_nonrw_fusion(struct megasas_instance *instance,
 		io_request->Function = MPI2_FUNCTION_SCSI_IO_REQUEST;
 		io_request->DevHandle = devHandle;
 	}
+	rcu_read_unlock();
 }
 
 /**
@@ -2907,9 +3358,6 @@ megasas_build_syspd_fusion(struct megasas_instance *instance,
 	pRAID_Context->regLockRowLBA = 0;
 	pRAID_Context->regLockLength = 0;
 	io_request->DataLength = cpu_to_le32(scsi_bufflen(scmd));
-	io_request->LUN[1] = scmd->device->lun;
-	pRAID_Context->RAIDFlags = MR_RAID_FLAGS_IO_SUB_TYPE_SYSTEM_PD
-		<< MR_RAID_CTX_RAID_FLAGS_IO_SUB_TYPE_SHIFT;
 
 	/* If FW supports PD sequence number */
 	if (instance->use_seqnum_jbod_fp &&
@@ -2937,9 +3385,11 @@ megasas_build_syspd_fusion(struct megasas_instance *instance,
 	} else if (fusion->fast_path_io) {
 		pRAID_Context->VirtualDiskTgtId = cpu_to_le16(device_id);
 		pRAID_Context->configSeqNum = 0;
-		local_map_ptr = fusion->ld_drv_map[(instance->map_id & 1)];
+		rcu_read_lock();
+		local_map_ptr = rcu_dereference(fusion->cur_drv_map);
 		io_request->DevHandle =
 			local_map_ptr->raidMap.devHndlInfo[device_id].curDevHdl;
+		rcu_read_unlock();
 	} else {
 		/*Want to send all IO via FW path*/
 		pRAID_Context->VirtualDiskTgtId = cpu_to_le16(device_id);
@@ -2948,9 +3398,7 @@ megasas_build_syspd_fusion(struct megasas_instance *instance,
 	}
 
 	cmd->request_desc->SCSIIO.DevHandle = io_request->DevHandle;
-	cmd->request_desc->SCSIIO.MSIxIndex =
-		instance->msix_vectors ?
-		(smp_processor_id() % instance->msix_vectors) : 0;
+	cmd->request_desc->SCSIIO.MSIxIndex = megasas_get_msix_index(instance, scmd);
 
 	if (!fp_possible) {
 		/* system pd firmware path */
@@ -2991,6 +3439,38 @@ megasas_build_syspd_fusion(struct megasas_instance *instance,
 	}
 }
 
+/**
+ * megasas_init_io_frame_template -	Preset the IO frame header of a device
+ * @instance:				Adapter soft state
+ * @sdev:				SCSI device
+ *
+ * Every IO to the device starts from a copy of this template, so the
+ * frame no longer has to be cleared when a command completes and the
+ * builders only fill in what differs per IO.
+ */
+void
+megasas_init_io_frame_template(struct megasas_instance *instance,
+			       struct scsi_device *sdev)
+{
+	struct MR_PRIV_DEVICE *mr_device_priv_data = sdev->hostdata;
+	MEGASAS_RAID_SCSI_IO_REQUEST *io_template;
+
+	io_template = &mr_device_priv_data->io_frame_template;
+	memset(io_template, 0, sizeof(*io_template));
+
+	io_template->SGLOffset0 =
+		offsetof(MEGASAS_RAID_SCSI_IO_REQUEST, SGL) / 4;
+	io_template->SGLFlags = cpu_to_le16(MPI2_SGE_FLAGS_64_BIT_ADDRESSING);
+	io_template->SenseBufferLength = SCSI_SENSE_BUFFERSIZE;
+
+	if (!MEGASAS_IS_LOGICAL(sdev)) {
+		io_template->LUN[1] = sdev->lun;
+		io_template->RaidContext.raid_context.RAIDFlags =
+			MR_RAID_FLAGS_IO_SUB_TYPE_SYSTEM_PD
+			<< MR_RAID_CTX_RAID_FLAGS_IO_SUB_TYPE_SHIFT;
+	}
+}
+
 /**
  * megasas_build_io_fusion -	Prepares IOs to devices 
  * @instance:		Adapter soft state
@@ -3008,20 +3488,13 @@ megasas_build_io_fusion(struct megasas_instance *instance, struct scsi_cmnd *scp
 	u8  cmd_type;
 	MEGASAS_RAID_SCSI_IO_REQUEST *io_request = cmd->io_request;
 	struct MR_PRIV_DEVICE *mr_device_priv_data;
+	struct fusion_context *fusion = instance->ctrl_context;
 
 	mr_device_priv_data = scp->device->hostdata;
 
-	/* Zero out some fields so they don't get reused */
-	io_request->LUN[1] = 0;
-	io_request->CDB.EEDP32.PrimaryReferenceTag = 0;
-	io_request->CDB.EEDP32.PrimaryApplicationTagMask = 0;
-	io_request->EEDPFlags = 0;
-	io_request->Control = 0;
-	io_request->EEDPBlockSize = 0;
-	io_request->ChainOffset = 0;
-	io_request->RaidContext.raid_context.RAIDFlags = 0;
-	io_request->RaidContext.raid_context.Type = 0;
-	io_request->RaidContext.raid_context.nseg = 0;
+	/* Frames are not cleared on completion, start from the device template */
+	memcpy(io_request, &mr_device_priv_data->io_frame_template,
+	       MEGASAS_IO_FRAME_TEMPLATE_SIZE);
 
 	memcpy(io_request->CDB.CDB32, scp->cmnd, scp->cmd_len);
 
@@ -3032,6 +3505,13 @@ megasas_build_io_fusion(struct megasas_instance *instance, struct scsi_cmnd *scp
 		return 1;
 	}
 
+	/* IEEE SGLs spilling out of the main message need a chain frame */
+	if ((sge_count > fusion->max_sge_in_main_msg) &&
+	    megasas_get_chain_frame(instance, cmd)) {
+		scsi_dma_unmap(scp);
+		return -ENOMEM;
+	}
+
 	cmd->sge_count = sge_count;
 
 	/*
@@ -3079,18 +3559,13 @@ megasas_build_io_fusion(struct megasas_instance *instance, struct scsi_cmnd *scp
 			io_request->RaidContext.raid_context.numSGEExt = (u8)(sge_count >> 8);
 	}
 
-	io_request->SGLFlags = cpu_to_le16(MPI2_SGE_FLAGS_64_BIT_ADDRESSING);
-
 	if (scp->sc_data_direction == PCI_DMA_TODEVICE)
 		io_request->Control |= cpu_to_le32(MPI2_SCSIIO_CONTROL_WRITE);
 	else if (scp->sc_data_direction == PCI_DMA_FROMDEVICE)
 		io_request->Control |= cpu_to_le32(MPI2_SCSIIO_CONTROL_READ);
 
-	io_request->SGLOffset0 = offsetof(MEGASAS_RAID_SCSI_IO_REQUEST, SGL) / 4;
-
 	io_request->SenseBufferLowAddress =
 		cpu_to_le32(lower_32_bits(cmd->sense_phys_addr));
-	io_request->SenseBufferLength = SCSI_SENSE_BUFFERSIZE;
 
 	cmd->scmd = scp;
 	scp->SCp.ptr = (char *)cmd;
@@ -3152,6 +3627,66 @@ static void megasas_prepare_secondRaid1_IO(struct megasas_instance *instance,
 	atomic_inc(&instance->r1_fp_writes_count);
 }
 
+/**
+ * megasas_hybrid_poll -	Poll a reply queue right after submission
+ * @instance:			Adapter soft state
+ * @MSIxIndex:			Reply queue the command will complete on
+ *
+ * Low queue depth IO is dominated by interrupt latency, so the submitting
+ * CPU spins on its reply queue for a short window. The window adapts to
+ * the time the last successful polls needed: it is doubled from the last
+ * observed completion time and halved on every miss. The MSI-x vector
+ * stays armed, the ISR and the poller are serialized by irq_context->in_use
+ * and replies not seen within the window are completed from the interrupt.
+ * An interrupt dropped while the poller owns the reply queue is covered by
+ * complete_cmd_fusion() re-checking the queue once it lets go of it.
+ */
+static void
+megasas_hybrid_poll(struct megasas_instance *instance, u8 MSIxIndex)
+{
+	struct megasas_irq_context *irq_context;
+	u64 start, elapsed, window;
+	int num_completed = 0, pass;
+
+	irq_context = &instance->irq_context[MSIxIndex];
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+	if (irq_context->irq_poll_scheduled)
+		return;
+#endif
+	window = min_t(u64, irq_context->poll_window_ns,
+		       (u64)instance->hybrid_poll_us * NSEC_PER_USEC);
+	start = ktime_to_ns(ktime_get());
+
+	do {
+		num_completed = complete_cmd_fusion(instance, MSIxIndex,
+						    irq_context);
+		elapsed = ktime_to_ns(ktime_get()) - start;
+		if (num_completed)
+			break;
+		cpu_relax();
+	} while (elapsed < window);
+
+	/*
+	 * A pass stopped by irq_poll_budget skips the re-check, no irq_poll
+	 * run follows it here, so keep draining until a pass comes up short.
+	 */
+	pass = num_completed;
+	while (pass && pass >= instance->irq_poll_budget) {
+		pass = complete_cmd_fusion(instance, MSIxIndex, irq_context);
+		num_completed += pass;
+	}
+
+	if (num_completed) {
+		atomic64_add(num_completed, &irq_context->polled_completions);
+		irq_context->poll_window_ns = max_t(u64,
+			MEGASAS_HYBRID_POLL_MIN_NS, 2 * elapsed);
+	} else {
+		atomic64_inc(&irq_context->poll_misses);
+		irq_context->poll_window_ns = max_t(u64,
+			MEGASAS_HYBRID_POLL_MIN_NS, window / 2);
+	}
+}
+
 /**
  * megasas_build_and_issue_cmd_fusion -Main routine for building and 
  *                                     issuing non IOCTL cmd
@@ -3163,33 +3698,38 @@ megasas_build_and_issue_cmd_fusion(struct megasas_instance *instance,
 				   struct scsi_cmnd *scmd)
 {
 	struct megasas_cmd_fusion *cmd, *r1_cmd = NULL;
-	MEGASAS_REQUEST_DESCRIPTOR_UNION *req_desc;
-	u32 index;
+	MEGASAS_REQUEST_DESCRIPTOR_UNION *req_desc, *req_descs[2];
+	u32 index, blk_tag;
+	u8 msix_index;
+	int ret;
+	bool ldio_counted = false;
 	struct fusion_context *fusion;
 	
 
 	fusion = instance->ctrl_context;
 
 	if ((megasas_cmd_type(scmd) == READ_WRITE_LDIO) &&
-			instance->ldio_threshold &&
-			(atomic_inc_return(&instance->ldio_outstanding) >
-			instance->ldio_threshold)) {
-			atomic_dec(&instance->ldio_outstanding);
+			instance->ldio_threshold) {
+		if (!megasas_outstanding_get(&instance->ldio_outstanding)) {
+			if (fusion->fp_stats &&
+			    (MEGASAS_DEV_INDEX(scmd) < MAX_LOGICAL_DRIVES_EXT)) {
+				megasas_fp_stats_get(fusion, get_cpu(),
+					MEGASAS_DEV_INDEX(scmd))->ldio_busy++;
+				put_cpu();
+			}
 			return SCSI_MLQUEUE_DEVICE_BUSY;
+		}
+		ldio_counted = true;
 	}
 
-	if (atomic_inc_return(&instance->fw_outstanding) >
-			instance->host->can_queue) {
-		atomic_dec(&instance->fw_outstanding);
-		return SCSI_MLQUEUE_HOST_BUSY;
-	}
+	if (!megasas_outstanding_get(&instance->fw_outstanding))
+		goto out_ldio;
 	
-	cmd = megasas_get_cmd_fusion(instance, scmd->request->tag);
+	blk_tag = megasas_get_blk_tag(instance, scmd);
+	cmd = megasas_get_cmd_fusion(instance, blk_tag);
 
-	if (!cmd) {
-		atomic_dec(&instance->fw_outstanding);
-		return SCSI_MLQUEUE_HOST_BUSY;
-	}
+	if (!cmd)
+		goto out_fw;
 
 	index = cmd->index;
 
@@ -3198,16 +3738,19 @@ megasas_build_and_issue_cmd_fusion(struct megasas_instance *instance,
 	req_desc->Words = 0;
 	cmd->request_desc = req_desc;
 
-	if (megasas_build_io_fusion(instance, scmd, cmd)) {
+	ret = megasas_build_io_fusion(instance, scmd, cmd);
+	if (ret) {
 		megasas_return_cmd_fusion(instance, cmd);
-		printk(KERN_ERR "Error build cmd at : %s\n", __FUNCTION__);
+		/* out of chain frames is counted in chain_stats, just requeue */
+		if (ret != -ENOMEM)
+			printk(KERN_ERR "Error build cmd at : %s\n", __FUNCTION__);
 		cmd->request_desc = NULL;
-		atomic_dec(&instance->fw_outstanding);
-		return SCSI_MLQUEUE_HOST_BUSY;
+		goto out_fw;
 	}
 
 	req_desc = cmd->request_desc;
 	req_desc->SCSIIO.SMID = cpu_to_le16(index);
+	msix_index = req_desc->SCSIIO.MSIxIndex;
 
 	if (cmd->io_request->ChainOffset !=0 && cmd->io_request->ChainOffset !=0xF )
 		printk(KERN_ERR "megasas: The chain offset value is not correct : %x\n", cmd->io_request->ChainOffset);
@@ -3224,19 +3767,137 @@ megasas_build_and_issue_cmd_fusion(struct megasas_instance *instance,
  	 * to get new command*/
 	if (cmd->r1_alt_dev_handle != MR_DEVHANDLE_INVALID) {
 		r1_cmd = megasas_get_cmd_fusion(instance,
-				(scmd->request->tag + instance->max_fw_cmds));
+				(blk_tag + instance->max_fw_cmds));
 		megasas_prepare_secondRaid1_IO(instance, cmd, r1_cmd);
 	}
+	trace_megasas_io_submit(instance, scmd, cmd, msix_index, r1_cmd);
+
 	/*
-	 * Issue the command to the FW
+	 * Fire time for latency load balancing, the latency histograms and
+	 * the queue depth latency target
 	 */
-	
-	megasas_fire_cmd_fusion(instance, req_desc);
-
+	if ((megasas_dbg_lvl & LATENCY_HIST) || instance->qd_ctrl.lat_target_ns ||
+	    ((instance->lb_policy == MR_LB_POLICY_LATENCY) &&
+	     (scmd->SCp.Status & MEGASAS_LOAD_BALANCE_FLAG)))
+		cmd->issue_ns = ktime_to_ns(ktime_get());
+	else
+		cmd->issue_ns = 0;
 	if (r1_cmd)
-		megasas_fire_cmd_fusion(instance, r1_cmd->request_desc);
+		r1_cmd->issue_ns = cmd->issue_ns;
+
+	if (instance->hybrid_poll_us)
+		atomic_add(r1_cmd ? 2 : 1, &instance->hybrid_poll_qd);
+
+	/*
+	 * Issue the command to the FW, both R1 legs in one go
+	 */
+	if (r1_cmd) {
+		req_descs[0] = req_desc;
+		req_descs[1] = r1_cmd->request_desc;
+		megasas_fire_cmds_fusion(instance, req_descs, 2);
+	} else
+		megasas_fire_cmd_fusion(instance, req_desc);
+
+	/* cmd may already be completed, only the reply queue index is safe */
+	if (instance->hybrid_poll_us && instance->msix_vectors &&
+	    (atomic_read(&instance->hybrid_poll_qd) <= MEGASAS_HYBRID_POLL_MAX_QD))
+		megasas_hybrid_poll(instance, msix_index);
 
 	return 0;
+
+out_fw:
+	megasas_outstanding_put(&instance->fw_outstanding);
+out_ldio:
+	if (ldio_counted)
+		megasas_outstanding_put(&instance->ldio_outstanding);
+	return SCSI_MLQUEUE_HOST_BUSY;
+}
+
+/**
+ * megasas_lat_bucket -		Log-linear histogram bucket of a latency
+ * @us:				Latency in usecs
+ */
+static inline u32 megasas_lat_bucket(u64 us)
+{
+	u32 msb, idx;
+
+	if (us < (1 << MEGASAS_LAT_SUB_BITS))
+		return (u32)us;
+
+	msb = fls64(us) - 1;
+	idx = ((msb - MEGASAS_LAT_SUB_BITS + 1) << MEGASAS_LAT_SUB_BITS) |
+		((us >> (msb - MEGASAS_LAT_SUB_BITS)) &
+		((1 << MEGASAS_LAT_SUB_BITS) - 1));
+
+	return min_t(u32, idx, MEGASAS_LAT_BUCKETS - 1);
+}
+
+/**
+ * megasas_record_latency -	Account a latency to this CPU's histogram
+ * @fusion:			Fusion context
+ * @hist:			MEGASAS_LAT_* category
+ * @ns:				Latency in nsecs
+ */
+static inline void megasas_record_latency(struct fusion_context *fusion,
+					  int hist, u64 ns)
+{
+	if (!fusion->lat_hist)
+		return;
+
+	this_cpu_inc(fusion->lat_hist->bucket[hist]
+		[megasas_lat_bucket(div_u64(ns, NSEC_PER_USEC))]);
+}
+
+/**
+ * megasas_account_io_latency -	Account a completed non R1 SCSI IO
+ * @fusion:			Fusion context
+ * @cmd:			Completed command, issue_ns is set
+ * @function:			MPI function the IO was issued with
+ */
+static inline void megasas_account_io_latency(struct fusion_context *fusion,
+		struct megasas_cmd_fusion *cmd, u8 function)
+{
+	int hist;
+
+	switch (megasas_cmd_type(cmd->scmd)) {
+	case READ_WRITE_LDIO:
+		hist = 0;
+		break;
+	case READ_WRITE_SYSPDIO:
+		hist = MEGASAS_LAT_SYSPD;
+		break;
+	default:
+		return;
+	}
+
+	if (function == MPI2_FUNCTION_SCSI_IO_REQUEST)
+		hist |= MEGASAS_LAT_FP;
+	if (cmd->scmd->sc_data_direction == DMA_TO_DEVICE)
+		hist |= MEGASAS_LAT_WRITE;
+
+	megasas_record_latency(fusion, hist,
+		ktime_to_ns(ktime_get()) - cmd->issue_ns);
+}
+
+/**
+ * megasas_qd_account_latency -	Feed a completion to the queue depth control
+ * @instance:			Adapter soft state
+ * @cmd:			Completed command, issue_ns is set
+ */
+static inline void megasas_qd_account_latency(struct megasas_instance *instance,
+		struct megasas_cmd_fusion *cmd)
+{
+	struct megasas_qd_ctrl *qd = &instance->qd_ctrl;
+	u64 ns = ktime_to_ns(ktime_get()) - cmd->issue_ns;
+
+	if (!qd->lat)
+		return;
+
+	this_cpu_add(qd->lat->sum_ns, ns);
+	this_cpu_inc(qd->lat->count);
+	if (ns > qd->lat_target_ns)
+		megasas_qd_signal(instance, cmd->scmd->device,
+				  MEGASAS_QD_LATENCY);
 }
 
 /**
@@ -3263,9 +3924,21 @@ static inline void megasas_complete_r1_command(struct megasas_instance *instance
 	sense = cmd->sense;
 
 	cmd->cmd_completed = true;
+	trace_megasas_r1_complete(instance, cmd, r1_cmd);
 			
 	/* Check if peer command is completed or not*/
 	if (r1_cmd->cmd_completed) {
+		if (cmd->issue_ns && instance->qd_ctrl.lat_target_ns)
+			megasas_qd_account_latency(instance, cmd);
+		if (cmd->issue_ns && (megasas_dbg_lvl & LATENCY_HIST)) {
+			u64 now = ktime_to_ns(ktime_get());
+
+			megasas_record_latency(fusion, MEGASAS_LAT_R1_WRITE,
+					       now - cmd->issue_ns);
+			megasas_record_latency(fusion, MEGASAS_LAT_R1_PEER,
+					       now - r1_cmd->issue_ns);
+		}
+
 		if (r1_cmd->io_request->RaidContext.raid_context.status != MFI_STAT_OK) {
 			status = r1_cmd->io_request->RaidContext.raid_context.status;
 			extStatus = r1_cmd->io_request->RaidContext.raid_context.exStatus;
@@ -3277,21 +3950,59 @@ static inline void megasas_complete_r1_command(struct megasas_instance *instance
 		map_cmd_status(fusion, scmd_local, status, extStatus,
 			le32_to_cpu(data_length), sense);
 		if (instance->ldio_threshold && megasas_cmd_type(scmd_local) == READ_WRITE_LDIO)
-			atomic_dec(&instance->ldio_outstanding);
+			megasas_outstanding_put(&instance->ldio_outstanding);
 		scmd_local->SCp.ptr = NULL;
 		megasas_return_cmd_fusion(instance, cmd);
 		scsi_dma_unmap(scmd_local);
 		scmd_local->scsi_done(scmd_local);
+	} else if (cmd->issue_ns) {
+		/* first leg done, the peer measures the skew against this */
+		cmd->issue_ns = ktime_to_ns(ktime_get());
 	}
 }
 
+/*
+ * megasas_release_reply_queue -	Give up ownership of a reply queue
+ *
+ * Returns true if a reply is pending, its interrupt may have been dropped
+ * while we owned the queue and the caller has to drain it again.
+ */
+static inline bool
+megasas_release_reply_queue(struct fusion_context *fusion, u32 MSIxIndex,
+			    struct megasas_irq_context *irq_context)
+{
+	Mpi2ReplyDescriptorsUnion_t *desc;
+
+	atomic_dec(&irq_context->in_use);
+	/* order the release before the reply descriptor read */
+	smp_mb();
+
+	desc = fusion->reply_frames_desc[MSIxIndex] +
+		fusion->last_reply_idx[MSIxIndex];
+	return (((MPI2_SCSI_IO_SUCCESS_REPLY_DESCRIPTOR *)desc)->ReplyFlags &
+		MPI2_RPY_DESCRIPT_FLAGS_TYPE_MASK) !=
+		MPI2_RPY_DESCRIPT_FLAGS_UNUSED;
+}
+
 /**
  * complete_cmd_fusion -	Completes command
  * @instance:			Adapter soft state
+ * @MSIxIndex:			Reply queue to be processed
+ * @irq_context:		Reply queue owner context, NULL without MSI-x.
+ *				Serializes ISR, irq_poll, hybrid poll and the
+ *				reset path and applies irq_poll_budget if
+ *				enabled.
  * Completes all commands that is in reply descriptor queue
+ *
+ * An interrupt that finds the reply queue owned by someone else is
+ * dropped, so the owner looks at the reply queue once more after giving
+ * it up and drains it again if a reply slipped in meanwhile.
+ *
+ * Returns the number of replies processed.
  */
 int 
-complete_cmd_fusion(struct megasas_instance *instance, u32 MSIxIndex)
+complete_cmd_fusion(struct megasas_instance *instance, u32 MSIxIndex,
+		    struct megasas_irq_context *irq_context)
 {
 	Mpi2ReplyDescriptorsUnion_t *desc;
 	MPI2_SCSI_IO_SUCCESS_REPLY_DESCRIPTOR *reply_desc;
@@ -3307,12 +4018,19 @@ complete_cmd_fusion(struct megasas_instance *instance, u32 MSIxIndex)
 	union desc_value d_val;
 	PLD_LOAD_BALANCE_INFO lbinfo;
 	int threshold_reply_count = 0;
+	int total_completed = 0;
+	bool budget_hit = false;
 	struct scsi_cmnd *scmd_local = NULL;
 
 	fusion = instance->ctrl_context;
 
 	if (atomic_read(&instance->adprecovery) == MEGASAS_HW_CRITICAL_ERROR)
-		return IRQ_HANDLED;
+		return 0;
+
+again:
+	/* Someone else is already draining this reply queue */
+	if (irq_context && !atomic_add_unless(&irq_context->in_use, 1, 1))
+		return total_completed;
 
 	desc = fusion->reply_frames_desc[MSIxIndex] +
 				fusion->last_reply_idx[MSIxIndex];
@@ -3322,8 +4040,12 @@ complete_cmd_fusion(struct megasas_instance *instance, u32 MSIxIndex)
 
 	reply_descript_type = reply_desc->ReplyFlags & MPI2_RPY_DESCRIPT_FLAGS_TYPE_MASK;
 
-	if (reply_descript_type == MPI2_RPY_DESCRIPT_FLAGS_UNUSED)
-		return IRQ_NONE;
+	if (reply_descript_type == MPI2_RPY_DESCRIPT_FLAGS_UNUSED) {
+		if (irq_context && megasas_release_reply_queue(fusion,
+				MSIxIndex, irq_context))
+			goto again;
+		return total_completed;
+	}
 
 	num_completed = 0;
 
@@ -3341,6 +4063,7 @@ complete_cmd_fusion(struct megasas_instance *instance, u32 MSIxIndex)
 		extStatus = scsi_io_req->RaidContext.raid_context.exStatus;
 		sense = cmd_fusion->sense;
 		data_length = scsi_io_req->DataLength;
+		trace_megasas_io_complete(instance, MSIxIndex, smid, scsi_io_req);
 		switch (scsi_io_req->Function)
 		{
 		case MPI2_FUNCTION_SCSI_TASK_MGMT:
@@ -3359,22 +4082,29 @@ complete_cmd_fusion(struct megasas_instance *instance, u32 MSIxIndex)
 					(cmd_fusion->scmd->SCp.Status & MEGASAS_LOAD_BALANCE_FLAG)) {
 				device_id = MEGASAS_DEV_INDEX(scmd_local);
 				lbinfo = &fusion->load_balance_info[device_id];
-				atomic_dec(&lbinfo->scsi_pending_cmds[cmd_fusion->pd_r1_lb]);
+				atomic_dec(&lbinfo->slots[cmd_fusion->r1_lb_slot].scsi_pending_cmds);
+				if (instance->lb_policy == MR_LB_POLICY_LATENCY)
+					mr_update_pd_latency(lbinfo,
+						cmd_fusion->r1_lb_slot,
+						cmd_fusion->issue_ns);
 				cmd_fusion->scmd->SCp.Status &= ~MEGASAS_LOAD_BALANCE_FLAG;
 			}
-
-			if (reply_descript_type == MPI2_RPY_DESCRIPT_FLAGS_SCSI_IO_SUCCESS) {
-				if (megasas_dbg_lvl == 5)
-					printk(KERN_ERR "\nmegasas: FAST Path IO Success\n");
-			}
 			//Fall thru and complete IO
 		case MEGASAS_MPI2_FUNCTION_LD_IO_REQUEST : /* LD-IO Path */
-			atomic_dec(&instance->fw_outstanding);
+			megasas_outstanding_put(&instance->fw_outstanding);
+			/* IOs issued before hybrid polling was enabled are not counted */
+			if (instance->hybrid_poll_us)
+				megasas_atomic_dec_if_positive(&instance->hybrid_poll_qd);
  			if ((cmd_fusion->r1_alt_dev_handle == MR_DEVHANDLE_INVALID)) {
+				if (cmd_fusion->issue_ns && (megasas_dbg_lvl & LATENCY_HIST))
+					megasas_account_io_latency(fusion, cmd_fusion,
+						scsi_io_req->Function);
+				if (cmd_fusion->issue_ns && instance->qd_ctrl.lat_target_ns)
+					megasas_qd_account_latency(instance, cmd_fusion);
  				map_cmd_status(fusion, scmd_local, status,
 					extStatus, le32_to_cpu(data_length), sense);
  				if (instance->ldio_threshold && megasas_cmd_type(scmd_local) == READ_WRITE_LDIO)
- 					atomic_dec(&instance->ldio_outstanding);
+ 					megasas_outstanding_put(&instance->ldio_outstanding);
 				scmd_local->SCp.ptr = NULL;
  				megasas_return_cmd_fusion(instance, cmd_fusion);
  				scsi_dma_unmap(scmd_local);
@@ -3419,6 +4149,14 @@ complete_cmd_fusion(struct megasas_instance *instance, u32 MSIxIndex)
 		if(reply_descript_type == MPI2_RPY_DESCRIPT_FLAGS_UNUSED)
 			break;
 
+		/* Remaining replies are left for megasas_irqpoll */
+		if (irq_context && instance->irq_poll_enable &&
+		    (total_completed + num_completed >=
+		     instance->irq_poll_budget)) {
+			budget_hit = true;
+			break;
+		}
+
 		/* 
 		 * Write to reply post host index register after completing threshold
 		 * number of reply counts and still there are more replies in reply queue
@@ -3437,8 +4175,12 @@ complete_cmd_fusion(struct megasas_instance *instance, u32 MSIxIndex)
         	}
 	}
 	
-	if (!num_completed)
-		return IRQ_NONE;
+	if (!num_completed) {
+		if (irq_context && megasas_release_reply_queue(fusion,
+				MSIxIndex, irq_context))
+			goto again;
+		return total_completed;
+	}
 
 	wmb();
 	if (instance->msix_combined)
@@ -3449,10 +4191,54 @@ complete_cmd_fusion(struct megasas_instance *instance, u32 MSIxIndex)
 		writel((MSIxIndex << 24) |
 			fusion->last_reply_idx[MSIxIndex],
 			instance->reply_post_host_index_addr[0]);
+	trace_megasas_reply_queue(instance, MSIxIndex, num_completed,
+		fusion->last_reply_idx[MSIxIndex], fusion->reply_q_depth);
 	megasas_check_and_restore_queue_depth(instance);
-	return IRQ_HANDLED;
+	total_completed += num_completed;
+	if (irq_context) {
+		/* at budget irq_poll takes over, it re-checks when done */
+		if (budget_hit)
+			atomic_dec(&irq_context->in_use);
+		else if (megasas_release_reply_queue(fusion, MSIxIndex,
+						     irq_context)) {
+			threshold_reply_count = 0;
+			goto again;
+		}
+	}
+	return total_completed;
 }
 
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+/**
+ * megasas_irqpoll -	irq_poll handler of a reply queue
+ * @irqpoll:		irq_poll context of the reply queue
+ * @budget:		Max replies to complete in this run
+ *
+ * The MSI-x vector stays masked while polling and is re-armed once the
+ * reply queue is drained below budget.
+ */
+int megasas_irqpoll(struct irq_poll *irqpoll, int budget)
+{
+	struct megasas_irq_context *irq_context;
+	struct megasas_instance *instance;
+	int num_entries;
+
+	irq_context = container_of(irqpoll, struct megasas_irq_context, irqpoll);
+	instance = irq_context->instance;
+
+	num_entries = complete_cmd_fusion(instance, irq_context->MSIxIndex,
+					  irq_context);
+	atomic64_add(num_entries, &irq_context->irq_completions);
+	if (num_entries < budget) {
+		irq_poll_complete(irqpoll);
+		irq_context->irq_poll_scheduled = false;
+		enable_irq(irq_context->os_irq);
+	}
+
+	return num_entries;
+}
+#endif
+
 /**
  * megasas_sync_irqs -	Synchronizes all IRQs owned by adapter
  * @instance:			Adapter soft state
@@ -3463,10 +4249,31 @@ void megasas_sync_irqs(unsigned long instance_addr)
 	struct megasas_instance *instance =
 		(struct megasas_instance *)instance_addr;
 
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+	struct megasas_irq_context *irq_context;
+#endif
+
 	count = instance->msix_vectors > 0 ? instance->msix_vectors : 1;
     
-	for (i = 0; i < count; i++)
+	for (i = 0; i < count; i++) {
 	    synchronize_irq(instance->msixentry[i].vector);
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+		if (!instance->msix_vectors)
+			continue;
+		/*
+		 * Cancel a pending irq_poll run, re-arm its vector and
+		 * complete the replies the cancelled run would have seen.
+		 */
+		irq_context = &instance->irq_context[i];
+		irq_poll_disable(&irq_context->irqpoll);
+		if (irq_context->irq_poll_scheduled) {
+			irq_context->irq_poll_scheduled = false;
+			enable_irq(irq_context->os_irq);
+			complete_cmd_fusion(instance, i, irq_context);
+		}
+		irq_poll_enable(&irq_context->irqpoll);
+#endif
+	}
 }
 /**
  * megasas_complete_cmd_dpc_fusion -	Completes command
@@ -3479,7 +4286,9 @@ megasas_complete_cmd_dpc_fusion(unsigned long instance_addr)
 {
 	struct megasas_instance *instance =
 		(struct megasas_instance *)instance_addr;
+	struct megasas_irq_context *irq_context;
 	u32 count, MSIxIndex;
+	int num_completed;
 
 	count = instance->msix_vectors > 0 ? instance->msix_vectors : 1;
 
@@ -3487,8 +4296,22 @@ megasas_complete_cmd_dpc_fusion(unsigned long instance_addr)
 	if (atomic_read(&instance->adprecovery) == MEGASAS_HW_CRITICAL_ERROR )
 		return;
 
-	for (MSIxIndex = 0 ; MSIxIndex < count; MSIxIndex++)
-		complete_cmd_fusion(instance, MSIxIndex);
+	/*
+	 * The ISR bails out during reset but irq_poll and the hybrid poller
+	 * may still be draining, so own each reply queue like they do. A queue
+	 * owned by someone else is drained by its owner. Passes stopped by
+	 * irq_poll_budget are not followed by an irq_poll run here, keep
+	 * draining until one comes up short.
+	 */
+	for (MSIxIndex = 0 ; MSIxIndex < count; MSIxIndex++) {
+		irq_context = instance->msix_vectors ?
+			&instance->irq_context[MSIxIndex] : NULL;
+		do {
+			num_completed = complete_cmd_fusion(instance, MSIxIndex,
+							    irq_context);
+		} while (irq_context && instance->irq_poll_enable &&
+			 num_completed >= instance->irq_poll_budget);
+	}
 }
 
 /**
@@ -3499,6 +4322,7 @@ irqreturn_t megasas_isr_fusion(int irq, void *devp)
 	struct megasas_irq_context *irq_context = devp;
 	struct megasas_instance *instance = irq_context->instance;
 	u32 mfiStatus, fw_state, dma_state;
+	int num_completed;
 
 	if (instance->mask_interrupts)
 		return IRQ_NONE;
@@ -3515,7 +4339,44 @@ irqreturn_t megasas_isr_fusion(int irq, void *devp)
 		return IRQ_HANDLED;
 	}
 
-	if (!complete_cmd_fusion(instance, irq_context->MSIxIndex)) {
+	/* Adapter is declared dead, nothing to complete or to recover */
+	if (atomic_read(&instance->adprecovery) == MEGASAS_HW_CRITICAL_ERROR)
+		return IRQ_HANDLED;
+
+	/*
+	 * The reply queue owner re-checks it when letting go, no need to
+	 * clear the interrupt or to look for a FW fault here.
+	 */
+	if (instance->msix_vectors && atomic_read(&irq_context->in_use))
+		return IRQ_HANDLED;
+
+#ifdef KERNEL_SUPPORT_IRQ_POLL
+	/*
+	 * Bounded completion: hard IRQ completes one budget worth of replies,
+	 * the rest is completed from irq_poll with this vector masked.
+	 */
+	if (instance->irq_poll_enable && instance->msix_vectors) {
+		if (irq_context->irq_poll_scheduled)
+			return IRQ_HANDLED;
+		num_completed = complete_cmd_fusion(instance,
+				irq_context->MSIxIndex, irq_context);
+		atomic64_add(num_completed, &irq_context->irq_completions);
+		if (num_completed >= instance->irq_poll_budget) {
+			irq_context->irq_poll_scheduled = true;
+			disable_irq_nosync(irq_context->os_irq);
+			irq_poll_sched(&irq_context->irqpoll);
+			return IRQ_HANDLED;
+		}
+	} else
+#endif
+	{
+		num_completed = complete_cmd_fusion(instance,
+				irq_context->MSIxIndex,
+				instance->msix_vectors ? irq_context : NULL);
+		atomic64_add(num_completed, &irq_context->irq_completions);
+	}
+
+	if (!num_completed) {
 		instance->instancet->clear_intr(instance->reg_set);
 		/* If we didn't complete any commands, check for FW fault */
 		fw_state = instance->instancet->read_fw_status_reg(instance->reg_set) & MFI_STATE_MASK;
@@ -3581,6 +4442,8 @@ build_mpt_mfi_pass_thru(struct megasas_instance *instance, struct megasas_cmd *m
 			cmd->sync_cmd_idx);
 #endif
 	io_req = cmd->io_request;
+	/* frames are recycled without being cleared on completion */
+	memset(io_req, 0, MEGA_MPI2_RAID_DEFAULT_IO_FRAME_SIZE);
 
 	if (instance->adapter_type >= INVADER_SERIES) {
 		pMpi25IeeeSgeChain64_t sgl_ptr_end = (pMpi25IeeeSgeChain64_t) &io_req->SGL;
@@ -3725,7 +4588,8 @@ megasas_free_host_crash_buffer(struct megasas_instance *instance)
 static int 
 megasas_adp_reset_fusion(struct megasas_instance *instance, struct megasas_register_set __iomem * regs)
 {
-	u32 host_diag, abs_state, retry;
+	u32 host_diag, abs_state;
+	unsigned long deadline;
 	
 	/* Now try to reset the chip */
 	writel(MPI2_WRSEQ_FLUSH_KEY_VALUE, &instance->reg_set->fusion_seq_offset);
@@ -3738,47 +4602,52 @@ megasas_adp_reset_fusion(struct megasas_instance *instance, struct megasas_regis
 
 	/* Check that the diag write enable (DRWE) bit is on */
 	host_diag = readl(&instance->reg_set->fusion_host_diag);
-	retry = 0;
+	deadline = jiffies + msecs_to_jiffies(MEGASAS_DIAG_UNLOCK_WAIT_MS);
 	while (!(host_diag & HOST_DIAG_WRITE_ENABLE)) {
-		msleep(100);
-		host_diag = readl(&instance->reg_set->fusion_host_diag);
-		if (retry++ == 100) {
+		if (time_after(jiffies, deadline)) {
 			dev_warn(&instance->pdev->dev,
 				"Host diag unlock failed from %s %d\n",
 				__func__, __LINE__);
 			break;
 		}
+		msleep(MEGASAS_OCR_POLL_MS);
+		host_diag = readl(&instance->reg_set->fusion_host_diag);
 	}
 	if (!(host_diag & HOST_DIAG_WRITE_ENABLE))
 		return -1;
 
-	/* Send chip reset command */
+	/*
+	 * Send chip reset command. The IOC may not respond to register reads
+	 * right after the reset, so keep the long settle time before the
+	 * first read and poll the reset bit finely from there on.
+	 */
 	writel(host_diag | HOST_DIAG_RESET_ADAPTER,
 		&instance->reg_set->fusion_host_diag);
-	msleep(3000);
+	msleep(MEGASAS_ADP_RESET_FIRST_READ_MS);
 
 	/* Make sure reset adapter bit is cleared */
 	host_diag = readl(&instance->reg_set->fusion_host_diag);
-	retry = 0;
+	deadline = jiffies + msecs_to_jiffies(MEGASAS_DIAG_RESET_WAIT_MS);
 	while (host_diag & HOST_DIAG_RESET_ADAPTER) {
-		msleep(100);
-		host_diag = readl(&instance->reg_set->fusion_host_diag);
-		if (retry++ == 1000) {
+		if (time_after(jiffies, deadline)) {
 			dev_warn(&instance->pdev->dev,
 				"Diag reset adapter never cleared %s %d\n",
 				__func__, __LINE__);
 			break;
 		}
+		msleep(MEGASAS_OCR_POLL_MS);
+		host_diag = readl(&instance->reg_set->fusion_host_diag);
 	}
 	if (host_diag & HOST_DIAG_RESET_ADAPTER)
 		return -1;
 
 	abs_state = instance->instancet->read_fw_status_reg(instance->reg_set)
 			& MFI_STATE_MASK;
-	retry = 0;
+	deadline = jiffies + msecs_to_jiffies(MEGASAS_FW_INIT_WAIT_MS);
 
-	while ((abs_state <= MFI_STATE_FW_INIT) && (retry++ < 1000)) {
-		msleep(100);
+	while ((abs_state <= MFI_STATE_FW_INIT) &&
+	       time_before(jiffies, deadline)) {
+		msleep(MEGASAS_OCR_POLL_MS);
 		abs_state = instance->instancet->
 			read_fw_status_reg(instance->reg_set) & MFI_STATE_MASK;
 	}
@@ -3805,10 +4674,17 @@ megasas_check_reset_fusion(struct megasas_instance *instance, struct megasas_reg
 int megasas_wait_for_outstanding_fusion(struct megasas_instance *instance,
 					u8 reason, int *convert)
 {
-	int i, outstanding, retval = 0, hb_seconds_missed = 0;
+	int outstanding, retval = 0, hb_seconds_missed = 0;
 	u32 fw_state;
+	unsigned long start, deadline, next_hb, next_notice;
 
-	for (i = 0; i < resetwaittime; i++) {
+	/*
+	 * Poll finely so OCR starts as soon as the FW drains or faults. msleep
+	 * overshoots, time the wait by jiffies rather than by poll count.
+	 */
+	start = next_hb = next_notice = jiffies;
+	deadline = start + resetwaittime * HZ;
+	while (time_before(jiffies, deadline)) {
 		/* Check if firmware is in fault state */
 		fw_state = instance->instancet->read_fw_status_reg(instance->reg_set) & MFI_STATE_MASK;
 		if (fw_state == MFI_STATE_FAULT) {
@@ -3844,7 +4720,9 @@ int megasas_wait_for_outstanding_fusion(struct megasas_instance *instance,
 		}
 
 		/* If SR-IOV VF mode & I/O timeout, check for HB timeout */
-		if (instance->requestorId && (reason == SCSIIO_TIMEOUT_OCR)) {
+		if (instance->requestorId && (reason == SCSIIO_TIMEOUT_OCR) &&
+		    time_after_eq(jiffies, next_hb)) {
+			next_hb = jiffies + HZ;
 			if (instance->hb_host_mem->HB.fwCounter !=
 			    instance->hb_host_mem->HB.driverCounter) {
 				instance->hb_host_mem->HB.driverCounter =
@@ -3868,19 +4746,22 @@ int megasas_wait_for_outstanding_fusion(struct megasas_instance *instance,
 		}
 
 		megasas_complete_cmd_dpc_fusion((unsigned long)instance);
-		outstanding = atomic_read(&instance->fw_outstanding);
+		outstanding = megasas_outstanding_read(&instance->fw_outstanding);
 		if (!outstanding) 
 			goto out;
 
-		if (!(i % MEGASAS_RESET_NOTICE_INTERVAL)) {
+		if (time_after_eq(jiffies, next_notice)) {
+			next_notice = jiffies +
+				MEGASAS_RESET_NOTICE_INTERVAL * HZ;
 			dev_info(&instance->pdev->dev, "[%2d]waiting for %d "
-			       "commands to complete for scsi%d\n",i,
-			       outstanding, instance->host->host_no);
+			       "commands to complete for scsi%d\n",
+			       (int)((jiffies - start) / HZ), outstanding,
+			       instance->host->host_no);
 		}
-		msleep(1000);
+		msleep(MEGASAS_OCR_POLL_MS);
 	}
 
-	if (atomic_read(&instance->fw_outstanding)) {
+	if (megasas_outstanding_read(&instance->fw_outstanding)) {
 		dev_info(&instance->pdev->dev, "pending commands remain after waiting, "
 		       "will reset adapter scsi%d.\n", instance->host->host_no);
 		*convert = 1;
@@ -4481,6 +5362,74 @@ out:
 	return ret;
 }
 
+/**
+ * megasas_ocr_phase_done -	Account the time since the last OCR stage
+ * @fusion:			Fusion context
+ * @phase:			Stage that just finished
+ *
+ * Stages are retried along with the chip reset, so time accumulates.
+ */
+static void
+megasas_ocr_phase_done(struct fusion_context *fusion, enum MEGASAS_OCR_PHASE phase)
+{
+	u64 now = ktime_to_ns(ktime_get());
+
+	fusion->ocr_phase_ms[phase] +=
+		(u32)div_u64(now - fusion->ocr_phase_start_ns, NSEC_PER_MSEC);
+	fusion->ocr_phase_start_ns = now;
+}
+
+/**
+ * megasas_ocr_phase_report -	Log the stage times of a finished OCR
+ * @instance:			Adapter soft state
+ * @failed:			The adapter is about to be killed
+ *
+ * The times are also kept for the ocr_stats sysfs attribute.
+ */
+static void
+megasas_ocr_phase_report(struct megasas_instance *instance, bool failed)
+{
+	struct fusion_context *fusion = instance->ctrl_context;
+
+	memcpy(fusion->ocr_last_phase_ms, fusion->ocr_phase_ms,
+	       sizeof(fusion->ocr_last_phase_ms));
+	fusion->ocr_last_failed = failed;
+	fusion->ocr_count++;
+
+	dev_info(&instance->pdev->dev, "OCR stage times (ms): quiesce %u flush %u"
+		" chip reset %u ready %u ioc init %u restore %u\n",
+		fusion->ocr_phase_ms[MEGASAS_OCR_PHASE_QUIESCE],
+		fusion->ocr_phase_ms[MEGASAS_OCR_PHASE_FLUSH],
+		fusion->ocr_phase_ms[MEGASAS_OCR_PHASE_CHIP_RESET],
+		fusion->ocr_phase_ms[MEGASAS_OCR_PHASE_READY],
+		fusion->ocr_phase_ms[MEGASAS_OCR_PHASE_IOC_INIT],
+		fusion->ocr_phase_ms[MEGASAS_OCR_PHASE_RESTORE]);
+}
+
+/**
+ * megasas_reset_load_balance_info -	Forget R1 load balance state
+ * @fusion:				Fusion context
+ *
+ * The per arm state stays allocated, the map refetch after OCR decides
+ * again which LDs are balanced.
+ */
+static void megasas_reset_load_balance_info(struct fusion_context *fusion)
+{
+	PLD_LOAD_BALANCE_INFO lbInfo;
+	u32 i;
+
+	if (!fusion->load_balance_info)
+		return;
+
+	for (i = 0; i < MAX_LOGICAL_DRIVES_EXT; i++) {
+		lbInfo = &fusion->load_balance_info[i];
+		lbInfo->loadBalanceFlag = 0;
+		atomic_set(&lbInfo->latency_reads, 0);
+		if (lbInfo->slots)
+			memset(lbInfo->slots, 0, MR_LB_SLOTS * sizeof(MR_LB_SLOT));
+	}
+}
+
 /*
  * megasas_reset_fusion :	Core reset function for fusion adapters
  * shost	        :	SCSI host 	
@@ -4499,11 +5448,12 @@ int megasas_reset_fusion(struct Scsi_Host *shost, u8 reason)
 	struct megasas_cmd_fusion *cmd_fusion, *mpt_cmd_fusion;
 	struct fusion_context *fusion;
 	u32 abs_state, status_reg, reset_adapter;
-	u32 io_timeout_in_crash_mode = 0;
+	unsigned long crash_wait_start, crash_wait_notice;
 	struct scsi_cmnd *scmd_local = NULL;
 	struct scsi_device *sdev;
 	int ret_target_prop = DCMD_FAILED;
 	bool is_target_prop = false;
+	int ret_wait;
 
 	instance = (struct megasas_instance *)shost->hostdata;
 	fusion = instance->ctrl_context;
@@ -4531,13 +5481,21 @@ int megasas_reset_fusion(struct Scsi_Host *shost, u8 reason)
 		 /* Flush PCI write*/
                 readl(&instance->reg_set->doorbell);
 		mutex_unlock(&instance->reset_mutex);
+		crash_wait_start = jiffies;
+		crash_wait_notice = crash_wait_start +
+			msecs_to_jiffies(MEGASAS_CRASH_DUMP_NOTICE_MS);
                 do {
-                        ssleep(3);
-                        io_timeout_in_crash_mode++;
-	                    dev_info(&instance->pdev->dev, "waiting for [%d] seconds for crash dump collection"
-                                " and OCR to be done\n", (io_timeout_in_crash_mode * 3));
+                        msleep(MEGASAS_OCR_POLL_MS);
+                        if (time_after_eq(jiffies, crash_wait_notice)) {
+                            crash_wait_notice = jiffies +
+                                msecs_to_jiffies(MEGASAS_CRASH_DUMP_NOTICE_MS);
+	                    dev_info(&instance->pdev->dev, "waiting for [%u] seconds for crash dump collection"
+                                " and OCR to be done\n",
+                                jiffies_to_msecs(jiffies - crash_wait_start) / 1000);
+                        }
                 } while ((atomic_read(&instance->adprecovery) != MEGASAS_HBA_OPERATIONAL) &&
-                        (io_timeout_in_crash_mode < 40));
+                        time_before(jiffies, crash_wait_start +
+                                msecs_to_jiffies(MEGASAS_CRASH_DUMP_OCR_WAIT_MS)));
 
                 if(atomic_read(&instance->adprecovery) ==
 					MEGASAS_HBA_OPERATIONAL) {
@@ -4555,14 +5513,20 @@ int megasas_reset_fusion(struct Scsi_Host *shost, u8 reason)
 
 	if (instance->requestorId && !instance->skip_heartbeat_timer_del)
 		del_timer_sync(&instance->sriov_heartbeat_timer);
+
+	memset(fusion->ocr_phase_ms, 0, sizeof(fusion->ocr_phase_ms));
+	fusion->ocr_phase_start_ns = ktime_to_ns(ktime_get());
+
 	set_bit(MEGASAS_FUSION_IN_RESET, &instance->reset_flags);
 	atomic_set(&instance->adprecovery, MEGASAS_ADPRESET_SM_POLLING);
 	instance->instancet->disable_intr(instance);
 	megasas_sync_irqs((unsigned long)instance);
 
 	/* First try waiting for commands to complete */
-	if (megasas_wait_for_outstanding_fusion(instance, reason,
-		    &convert)) {
+	ret_wait = megasas_wait_for_outstanding_fusion(instance, reason,
+						       &convert);
+	megasas_ocr_phase_done(fusion, MEGASAS_OCR_PHASE_QUIESCE);
+	if (ret_wait) {
 		atomic_set(&instance->adprecovery, MEGASAS_ADPRESET_SM_INFAULT);
 	    dev_info(&instance->pdev->dev, "resetting fusion adapter scsi%d.\n",
             instance->host->host_no);
@@ -4594,15 +5558,17 @@ int megasas_reset_fusion(struct Scsi_Host *shost, u8 reason)
 					megasas_check_mpio_paths(instance,
 							scmd_local);
 			    if (instance->ldio_threshold && (megasas_cmd_type(scmd_local) == READ_WRITE_LDIO))
-					atomic_dec(&instance->ldio_outstanding);
+					megasas_outstanding_put(&instance->ldio_outstanding);
 				megasas_return_cmd_fusion(instance, cmd_fusion);
 				scsi_dma_unmap(scmd_local);
 				scmd_local->scsi_done(scmd_local);
-				atomic_dec(&instance->fw_outstanding);
+				megasas_outstanding_put(&instance->fw_outstanding);
 			}
 		}
 
- 		atomic_set(&instance->fw_outstanding, 0);
+ 		megasas_outstanding_reset(&instance->fw_outstanding);
+		atomic_set(&instance->hybrid_poll_qd, 0);
+		megasas_ocr_phase_done(fusion, MEGASAS_OCR_PHASE_FLUSH);
 
 		status_reg = instance->instancet->read_fw_status_reg(instance->reg_set);
 		abs_state = status_reg & MFI_STATE_MASK;
@@ -4622,18 +5588,23 @@ int megasas_reset_fusion(struct Scsi_Host *shost, u8 reason)
 		/* Let SR-IOV VF & PF sync up if there was a HB failure */
 		if (instance->requestorId && !reason) {
 			msleep(MEGASAS_OCR_SETTLE_TIME_VF);
+			megasas_ocr_phase_done(fusion, MEGASAS_OCR_PHASE_CHIP_RESET);
 			goto transition_to_ready;
 		}
 
 		/* Now try to reset the chip */
 		for (i = 0; i < MEGASAS_FUSION_MAX_RESET_TRIES; i++) {
 
-			if (instance->instancet->adp_reset
-				(instance, instance->reg_set))
+			ret_wait = instance->instancet->adp_reset
+				(instance, instance->reg_set);
+			megasas_ocr_phase_done(fusion, MEGASAS_OCR_PHASE_CHIP_RESET);
+			if (ret_wait)
 				continue;
 transition_to_ready:
 			/* Wait for FW to become ready */
-			if (megasas_transition_to_ready(instance, 1)) {
+			ret_wait = megasas_transition_to_ready(instance, 1);
+			megasas_ocr_phase_done(fusion, MEGASAS_OCR_PHASE_READY);
+			if (ret_wait) {
 	            dev_info(&instance->pdev->dev, "Failed to transition controller to ready for "
 				       "scsi%d.\n", instance->host->host_no);
 				if(instance->requestorId && !reason )
@@ -4645,7 +5616,9 @@ transition_to_ready:
 			megasas_reset_reply_desc(instance);
 			megasas_fusion_update_can_queue(instance, OCR_CONTEXT);
 
-			if (megasas_ioc_init_fusion(instance)) {
+			ret_wait = megasas_ioc_init_fusion(instance);
+			megasas_ocr_phase_done(fusion, MEGASAS_OCR_PHASE_IOC_INIT);
+			if (ret_wait) {
 				if( instance->requestorId && !reason )
 					goto fail_kill_adapter;
 				else
@@ -4664,9 +5637,7 @@ transition_to_ready:
 			megasas_refire_mgmt_cmd(instance);
 			
 			/* Reset load balance info */
-			if (fusion->load_balance_info)
-				memset(fusion->load_balance_info, 0,
-					sizeof(LD_LOAD_BALANCE_INFO) * MAX_LOGICAL_DRIVES_EXT);
+			megasas_reset_load_balance_info(fusion);
 
 			if (!megasas_get_map_info(instance))
 				megasas_sync_map_info(instance);
@@ -4675,10 +5646,9 @@ transition_to_ready:
 
 			//reset stream detection array
 			if (instance->adapter_type == VENTURA_SERIES) {
-				for(j=0; j< MAX_LOGICAL_DRIVES_EXT; ++j) {
-					memset(fusion->streamDetectByLD[j], 0, sizeof(LD_STREAM_DETECT));
-					fusion->streamDetectByLD[j]->mruBitMap = MR_STREAM_BITMAP;
-				}
+				for(j=0; j< MAX_LOGICAL_DRIVES_EXT; ++j)
+					megasas_init_stream_detect(instance,
+						fusion->streamDetectByLD[j]);
 			}
 
 			clear_bit(MEGASAS_FUSION_IN_RESET, &instance->reset_flags);
@@ -4717,6 +5687,9 @@ transition_to_ready:
 					MR_CRASH_BUF_TURN_OFF);
 			
 			retval = SUCCESS;
+			megasas_ocr_phase_done(fusion, MEGASAS_OCR_PHASE_RESTORE);
+			megasas_ocr_phase_report(instance, false);
+			megasas_qd_restart(instance);
 			
 			/* Adapter reset completed successfully */
             dev_info(&instance->pdev->dev, "Reset successful for scsi%d.\n",
@@ -4725,6 +5698,7 @@ transition_to_ready:
 			goto out;
 		}
 fail_kill_adapter:
+		megasas_ocr_phase_report(instance, true);
 		/* Reset failed, kill the adapter */
         dev_info(&instance->pdev->dev, "Reset failed, killing adapter scsi%d.\n",
             instance->host->host_no);
@@ -4742,6 +5716,7 @@ fail_kill_adapter:
 		clear_bit(MEGASAS_FUSION_IN_RESET, &instance->reset_flags);
 		instance->instancet->enable_intr(instance);
 		atomic_set(&instance->adprecovery, MEGASAS_HBA_OPERATIONAL);
+		megasas_qd_restart(instance);
 	}
 out:
 	clear_bit(MEGASAS_FUSION_IN_RESET, &instance->reset_flags);
@@ -4823,6 +5798,47 @@ void megasas_fusion_ocr_wq(struct work_struct *work)
 	megasas_reset_fusion(instance->host, 0);
 }
 
+/*
+ * Fusion RAID map update work queue
+ *
+ * Converts the map FW returned for the pended MR_DCMD_LD_MAP_GET_INFO into
+ * the spare driver map, swaps it in and pends the next map request.
+ */
+void megasas_fusion_map_update_wq(struct work_struct *work)
+{
+	struct megasas_instance *instance =
+		container_of(work, struct megasas_instance, map_update_work);
+	struct fusion_context *fusion = instance->ctrl_context;
+	unsigned long flags;
+	u8 map_valid;
+
+	mutex_lock(&instance->reset_mutex);
+
+	/*
+	 * An OCR since the completion has refetched the map and pended a new
+	 * map request (map_update_cmd) itself; nothing left to do.
+	 */
+	if (instance->unload || instance->map_update_cmd ||
+	    (atomic_read(&instance->adprecovery) != MEGASAS_HBA_OPERATIONAL)) {
+		mutex_unlock(&instance->reset_mutex);
+		return;
+	}
+
+	map_valid = MR_ValidateMapInfo(instance, instance->map_id + 1);
+
+	spin_lock_irqsave(instance->host->host_lock, flags);
+	if (map_valid) {
+		instance->map_id++;
+		fusion->fast_path_io = 1;
+	} else
+		fusion->fast_path_io = 0;
+
+	megasas_sync_map_info(instance);
+	spin_unlock_irqrestore(instance->host->host_lock, flags);
+
+	mutex_unlock(&instance->reset_mutex);
+}
+
 /* Allocate fusion context */
 int
 megasas_alloc_fusion_context(struct megasas_instance *instance)
@@ -4844,20 +5860,20 @@ megasas_alloc_fusion_context(struct megasas_instance *instance)
 
 	fusion = instance->ctrl_context;
 
-	fusion->load_balance_info_pages = get_order(MAX_LOGICAL_DRIVES_EXT *
-		sizeof(LD_LOAD_BALANCE_INFO));
-	fusion->load_balance_info = (PLD_LOAD_BALANCE_INFO) __get_free_pages(GFP_KERNEL | __GFP_ZERO,
-		fusion->load_balance_info_pages);
-	if (!fusion->load_balance_info) {
-		fusion->load_balance_info = vmalloc(MAX_LOGICAL_DRIVES_EXT *
-			sizeof(LD_LOAD_BALANCE_INFO));
-		if (!fusion->load_balance_info)
-			dev_err(&instance->pdev->dev, "Failed to allocate load_balance_info, "
-				"continuing without Load Balance support\n");
-		else
-			memset(fusion->load_balance_info, 0,
-				(MAX_LOGICAL_DRIVES_EXT * sizeof(LD_LOAD_BALANCE_INFO)));
-	}
+	mutex_init(&fusion->drv_map_mutex);
+	spin_lock_init(&fusion->chain_lock);
+
+	fusion->lat_hist = alloc_percpu(struct megasas_lat_hist);
+	if (!fusion->lat_hist)
+		dev_err(&instance->pdev->dev, "Failed to allocate latency histograms, "
+			"continuing without them\n");
+
+	/* per arm state is only allocated for balanced LDs, at map validation */
+	fusion->load_balance_info = kcalloc(MAX_LOGICAL_DRIVES_EXT,
+		sizeof(LD_LOAD_BALANCE_INFO), GFP_KERNEL);
+	if (!fusion->load_balance_info)
+		dev_err(&instance->pdev->dev, "Failed to allocate load_balance_info, "
+			"continuing without Load Balance support\n");
 
 	return 0;
 }
@@ -4866,14 +5882,16 @@ void
 megasas_free_fusion_context(struct megasas_instance *instance)
 {
 	struct fusion_context *fusion = instance->ctrl_context;
+	int i;
 
 	if (fusion) {
+		free_percpu(fusion->lat_hist);
+		vfree(fusion->fp_stats);
+
 		if (fusion->load_balance_info) {
-			if (is_vmalloc_addr(fusion->load_balance_info))
-				vfree(fusion->load_balance_info);
-			else
-				free_pages((ulong)fusion->load_balance_info,
-				fusion->load_balance_info_pages);
+			for (i = 0; i < MAX_LOGICAL_DRIVES_EXT; i++)
+				kfree(fusion->load_balance_info[i].slots);
+			kfree(fusion->load_balance_info);
 		}
 
 		if (is_vmalloc_addr(fusion))
@@ -34,6 +34,11 @@
 
 /* Fusion defines */
 #define MEGASAS_CHAIN_FRAME_SZ_MIN 1024
+/* chain frames held back for forward progress when allocated on demand */
+#define MEGASAS_CHAIN_FRAME_RESERVE 32
+/* chain frames each CPU keeps for reuse, and how often idle ones are freed */
+#define MEGASAS_CHAIN_CACHE_SZ 8
+#define MEGASAS_CHAIN_TRIM_TICK HZ
 #define MFI_FUSION_ENABLE_INTERRUPT_MASK (0x00000009)
 #define MEGASAS_MAX_CHAIN_SIZE_UNITS_MASK	0x400000
 #define MEGASAS_MAX_CHAIN_SIZE_MASK		0x3E0
@@ -47,6 +52,80 @@
 #define HOST_DIAG_WRITE_ENABLE			    0x80
 #define HOST_DIAG_RESET_ADAPTER			    0x4
 #define MEGASAS_FUSION_MAX_RESET_TRIES		    3
+
+/* OCR register polling: interval, first read after chip reset, budgets */
+#define MEGASAS_OCR_POLL_MS			    10
+#define MEGASAS_ADP_RESET_FIRST_READ_MS		    3000
+#define MEGASAS_DIAG_UNLOCK_WAIT_MS		    (10 * 1000)
+#define MEGASAS_DIAG_RESET_WAIT_MS		    (100 * 1000)
+#define MEGASAS_FW_INIT_WAIT_MS			    (100 * 1000)
+#define MEGASAS_CRASH_DUMP_OCR_WAIT_MS		    (120 * 1000)
+#define MEGASAS_CRASH_DUMP_NOTICE_MS		    (3 * 1000)
+
+/* OCR stages timed by megasas_reset_fusion() */
+enum MEGASAS_OCR_PHASE {
+	MEGASAS_OCR_PHASE_QUIESCE,	/* wait for outstanding commands */
+	MEGASAS_OCR_PHASE_FLUSH,	/* return pending commands to the OS */
+	MEGASAS_OCR_PHASE_CHIP_RESET,
+	MEGASAS_OCR_PHASE_READY,	/* transition FW to ready */
+	MEGASAS_OCR_PHASE_IOC_INIT,
+	MEGASAS_OCR_PHASE_RESTORE,	/* ctrl info, DCMD refire, maps, devices */
+	MEGASAS_OCR_PHASE_MAX,
+};
+
+/*
+ * SCSI IO latency histograms, LATENCY_HIST debug level only. The first
+ * three categories are bit combinations, R1 mirrored FP writes are kept
+ * apart together with the skew between their two legs.
+ */
+#define MEGASAS_LAT_WRITE		(1 << 0)
+#define MEGASAS_LAT_FP			(1 << 1)
+#define MEGASAS_LAT_SYSPD		(1 << 2)
+#define MEGASAS_LAT_R1_WRITE		8	/* both legs of an R1 FP write */
+#define MEGASAS_LAT_R1_PEER		9	/* first to second leg completion */
+#define MEGASAS_LAT_HIST_MAX		10
+
+/*
+ * Log-linear buckets in usecs: 8 linear ones, then 8 per power of two.
+ * Bucket 200 starts at 2^27 us (~134s), and the last one (207) takes
+ * everything from 15 * 2^24 us (~252s) on.
+ */
+#define MEGASAS_LAT_SUB_BITS		3
+#define MEGASAS_LAT_BUCKETS		208
+
+struct megasas_lat_hist {
+	u64 bucket[MEGASAS_LAT_HIST_MAX][MEGASAS_LAT_BUCKETS];
+};
+
+/* Why megasas_build_ldio_fusion() sent a read/write LD IO to FW */
+enum MEGASAS_FP_MISS {
+	MEGASAS_FP_MISS_NONE,
+	MEGASAS_FP_MISS_NO_MAP,		/* map sync pending or LD not in map */
+	MEGASAS_FP_MISS_NOT_CAPABLE,	/* LD not FP capable for this direction */
+	MEGASAS_FP_MISS_CROSS_STRIPE,	/* IO spans strips, LD does not allow it */
+	MEGASAS_FP_MISS_SPAN,		/* uneven span lookup failed */
+	MEGASAS_FP_MISS_PD_INVALID,	/* target arm has no valid device handle */
+	MEGASAS_FP_MISS_R1_LARGE,	/* R1 write above 64K or within LD IO hint */
+	MEGASAS_FP_MISS_R1_CREDIT,	/* no FW credit left for the R1 peer */
+	MEGASAS_FP_MISS_STREAM,		/* sequential stream, FW caches it */
+	MEGASAS_FP_MISS_MAX,
+};
+
+/*
+ * Fast path accounting of one LD, kept per CPU and indexed by target id.
+ * region_lock counts FP IOs that still had FW take a region lock,
+ * ldio_busy the IOs requeued because ldio_threshold was reached.
+ */
+struct megasas_fp_stats {
+	u64 fp_ops;
+	u64 fp_bytes;
+	u64 fw_ops;
+	u64 fw_bytes;
+	u64 region_lock;
+	u64 ldio_busy;
+	u64 miss[MEGASAS_FP_MISS_MAX];
+};
+
 #define MAX_MSIX_QUEUES_FUSION			    128
 #define RDPQ_MAX_INDEX_IN_ONE_CHUNK		    16
 #define RDPQ_MAX_CHUNK_COUNT (MAX_MSIX_QUEUES_FUSION / RDPQ_MAX_INDEX_IN_ONE_CHUNK)
@@ -97,9 +176,23 @@ typedef enum MR_RAID_FLAGS_IO_SUB_TYPE {
 #define MEGASAS_REQ_DESCRIPT_FLAGS_NO_LOCK	   0x2
 #define MEGASAS_REQ_DESCRIPT_FLAGS_TYPE_SHIFT      1
 
+#define MEGASAS_REQ_DESCRIPT_TYPE(flags)	\
+	(((flags) & MPI2_REQ_DESCRIPT_FLAGS_TYPE_MASK) >> \
+	 MEGASAS_REQ_DESCRIPT_FLAGS_TYPE_SHIFT)
+/* descriptor types laid out as MPI2_SCSI_IO_REQUEST_DESCRIPTOR */
+#define MEGASAS_REQ_DESCRIPT_IS_SCSI_IO(flags)	\
+	((MEGASAS_REQ_DESCRIPT_TYPE(flags) == MPI2_REQ_DESCRIPT_FLAGS_SCSI_IO) || \
+	 (MEGASAS_REQ_DESCRIPT_TYPE(flags) == MEGASAS_REQ_DESCRIPT_FLAGS_NO_LOCK) || \
+	 (MEGASAS_REQ_DESCRIPT_TYPE(flags) == MPI2_REQ_DESCRIPT_FLAGS_FP_IO) || \
+	 (MEGASAS_REQ_DESCRIPT_TYPE(flags) == MEGASAS_REQ_DESCRIPT_FLAGS_LD_IO))
+
 #define MEGASAS_FP_CMD_LEN	16
 #define MEGASAS_FUSION_IN_RESET 0
 #define THRESHOLD_REPLY_COUNT 50
+#define MEGASAS_IRQ_POLL_BUDGET 64
+#define MEGASAS_HYBRID_POLL_MAX_QD 16
+#define MEGASAS_HYBRID_POLL_MAX_US 100
+#define MEGASAS_HYBRID_POLL_MIN_NS 1000
 #define RAID_1_PEER_CMDS 2
 #define MEGASAS_REDUCE_QD_COUNT 64
 #define IOC_INIT_FRAME_SIZE	4096
@@ -261,12 +354,13 @@ static inline bool is_stream_detected(RAID_CONTEXT_G35 *raid_context_g35)
 #define RAID_CTX_SPANARM_SPAN_MASK	(0xE0)
 
 
-#define BITS_PER_INDEX_STREAM		4/* number of bits per index in U32 TrackStream */
 #define INVALID_STREAM_NUM              16 
-#define MR_STREAM_BITMAP		0x76543210
-#define STREAM_MASK			((1 << BITS_PER_INDEX_STREAM) - 1)
-#define ZERO_LAST_STREAM		0x0fffffff
-#define MAX_STREAMS_TRACKED 		8
+#define MAX_STREAMS_TRACKED 		8	/* default streams tracked per LD */
+#define MEGASAS_MAX_STREAMS_TRACKED	256
+/* streams are hashed by nextSeqLBA in granules of 1 << MEGASAS_STREAM_HASH_SHIFT blocks */
+#define MEGASAS_STREAM_HASH_BUCKETS	64
+#define MEGASAS_STREAM_HASH_SHIFT	12
+#define MEGASAS_STREAM_MAX_GAP		((1 << MEGASAS_STREAM_HASH_SHIFT) - 1)
 /*    
  * define region lock types
  */
@@ -557,6 +651,10 @@ typedef struct _MPI2_RAID_SCSI_IO_REQUEST
 } MEGASAS_RAID_SCSI_IO_REQUEST, MPI2_POINTER PTR_MEGASAS_RAID_SCSI_IO_REQUEST,
 	MEGASASRaidSCSIIORequest_t, MPI2_POINTER pMEGASASRaidSCSIIORequest_t;
 
+/* Per device frame template covers everything in front of the SGL */
+#define MEGASAS_IO_FRAME_TEMPLATE_SIZE \
+	offsetof(MEGASAS_RAID_SCSI_IO_REQUEST, SGL)
+
 /*
  * MR-MPI2 MFA Descriptor format.  This is used to pass MFI frames prior
  * to the queues being initialized(MFI_CMD_OP_INIT).  The PCI address
@@ -1130,7 +1228,8 @@ struct IO_REQUEST_INFO {
 	u8  span_arm;            
 	u8  pd_after_lb;
 	u16 r1_alt_dev_handle; /* raid 1/10 only */
-	bool raCapable; 
+	bool raCapable;
+	u8 fp_miss;		/* MEGASAS_FP_MISS_* when !fpOkForIo */
 };
 
 typedef struct _MR_LD_TARGET_SYNC {
@@ -1265,23 +1364,75 @@ struct megasas_cmd_fusion {
 	 */
 	u32 sync_cmd_idx;
 	u32 index;
-	u8 pd_r1_lb; /*PD after R1 load balancing*/
+	u8 r1_lb_slot; /* span_arm after R1 load balancing */
+	u64 issue_ns; /* fire time if latency LB or LATENCY_HIST wants it, else 0 */
 	atomic_t refcount;
 	struct completion done;
 	u8 pdInterface;
 	u16 r1_alt_dev_handle; /* raid 1/10 only*/
 	bool cmd_completed;  /* raid 1/10 fp writes status holder */
 	int sge_count;
+	u8 sg_frame_reserved; /* sg_frame came from the chain frame reserve */
 };
 
+/*
+ * Load balance state is kept per span/arm slot of the LD, indexed by the
+ * RAID context spanArm value (span << RAID_CTX_SPANARM_SPAN_SHIFT | arm).
+ */
+#define MR_LB_SLOTS	(RAID_CTX_SPANARM_SPAN_MASK + RAID_CTX_SPANARM_ARM_MASK + 1)
+
+struct megasas_chain_frame {
+	MPI2_SGE_IO_UNION *frame;
+	dma_addr_t phys_addr;
+};
+
+/*
+ * Chain frames released on a CPU, reused by the next chained IO there
+ * without taking the sg_dma_pool lock. The lock is only ever contended
+ * by megasas_chain_trim_work().
+ */
+struct megasas_chain_cache {
+	spinlock_t lock;
+	u32 count;
+	u32 low;	/* fewest frames cached since the last trim */
+	struct megasas_chain_frame frame[MEGASAS_CHAIN_CACHE_SZ];
+};
+
+/* Load balance state of one span/arm */
+typedef struct _MR_LB_SLOT {
+	atomic_t	scsi_pending_cmds;
+	/* EWMA of fast path read completion time, in ns */
+	u32	pd_latency;
+	u64	last_accessed_block;
+	/* reads sent to this span/arm */
+	atomic_t	arm_reads;
+} MR_LB_SLOT;
+
 typedef struct _LD_LOAD_BALANCE_INFO
 {
 	u8	loadBalanceFlag;
 	u8	reserved1;
-	atomic_t     scsi_pending_cmds[MAX_PHYSICAL_DEVICES];
-	u64     last_accessed_block[MAX_PHYSICAL_DEVICES];
+	/* reads balanced by latency, paces arm re-sampling */
+	atomic_t	latency_reads;
+	/*
+	 * MR_LB_SLOTS entries, allocated the first time the LD qualifies
+	 * for load balancing and kept until the driver lets go of the
+	 * adapter, so completions never race with a free.
+	 */
+	MR_LB_SLOT	*slots;
 } LD_LOAD_BALANCE_INFO, *PLD_LOAD_BALANCE_INFO;
 
+/* RAID-1 read load balancing policies, see lb_policy module parameter */
+#define MR_LB_POLICY_SEEK	0	/* nearest head, pending count cap */
+#define MR_LB_POLICY_QUEUE	1	/* fewest pending commands */
+#define MR_LB_POLICY_LATENCY	2	/* lowest issue to completion EWMA */
+#define MR_LB_POLICY_MAX	MR_LB_POLICY_LATENCY
+
+/* a new latency sample carries 1/2^MR_LB_LATENCY_SHIFT of the EWMA */
+#define MR_LB_LATENCY_SHIFT	3
+/* one in MR_LB_LATENCY_EXPLORE reads re-samples the slowest arm, power of 2 */
+#define MR_LB_LATENCY_EXPLORE	64
+
 /* SPAN_SET is info caclulated from span info from Raid map per ld */
 typedef struct _LD_SPAN_SET {
     u64  log_start_lba;
@@ -1302,7 +1453,6 @@ typedef struct LOG_BLOCK_SPAN_INFO {
     LD_SPAN_SET  span_set[MAX_SPAN_DEPTH];
 }LD_SPAN_INFO, *PLD_SPAN_INFO;
 
-
 /*
  *  * define MR_PD_CFG_SEQ structure for system PDs
  *   */
@@ -1339,6 +1489,8 @@ typedef struct _STREAM_DETECT {
 	u8 groupDepth; // total number of host commands in group
 	bool groupFlush; // TRUE if cannot add any more commands to this group
 	u8 reserved[7]; // pad to 64-bit alignment
+	struct hlist_node hashNode; // in hashTable while nextSeqLBA is valid
+	struct list_head lruNode; // position in lruList
 } STREAM_DETECT, *PTR_STREAM_DETECT;
 
 typedef struct _LD_STREAM_DETECT {
@@ -1346,11 +1498,15 @@ typedef struct _LD_STREAM_DETECT {
 	bool FPWriteEnabled;
 	bool membersSSDs;
 	bool fpCacheBypassCapable;
-	u32 mruBitMap; // bitmap used to track MRU and LRU stream indicies
+	u16 numStreams; // entries in streamTrack
 	volatile long iosToFware; // current count of RW IOs sent to Fware
 	volatile long writeBytesOutstanding; // not used in first implementation
+	u64 streamHits; // IOs that continued a tracked stream
+	u64 streamMisses; // IOs that recycled the least recently used stream
+	struct list_head lruList; // most recently used stream first
+	struct hlist_head hashTable[MEGASAS_STREAM_HASH_BUCKETS];
 	// this is the array of stream detect structures (one per stream)
-	STREAM_DETECT streamTrack[MAX_STREAMS_TRACKED];
+	STREAM_DETECT streamTrack[0];
 }LD_STREAM_DETECT, *PTR_LD_STREAM_DETECT;
 
 /* Reply Descriptor Post Queue Array Entry */
@@ -1382,6 +1538,36 @@ struct fusion_context
 	struct dma_pool *sg_dma_pool;
 	struct dma_pool *sense_dma_pool;
 
+	/*
+	 * SG chain frames attached to commands only while in use, taken
+	 * from sg_dma_pool and from chain_reserve when that fails.
+	 */
+	bool chain_on_demand;
+	spinlock_t chain_lock;
+	struct megasas_chain_frame chain_reserve[MEGASAS_CHAIN_FRAME_RESERVE];
+	u32 chain_reserve_free;
+	u32 chain_reserve_low;
+	atomic_t chain_frames_in_use;
+	u32 chain_frames_hwm;
+	atomic_t chain_frame_fails;
+	/* NULL if it could not be allocated, every frame goes to the pool */
+	struct megasas_chain_cache __percpu *chain_cache;
+	struct delayed_work chain_trim_work;
+
+	/* time spent in each stage of the OCR in progress, in ms */
+	u32 ocr_phase_ms[MEGASAS_OCR_PHASE_MAX];
+	u64 ocr_phase_start_ns;
+	/* copy of the above for the last finished OCR, for sysfs */
+	u32 ocr_last_phase_ms[MEGASAS_OCR_PHASE_MAX];
+	u32 ocr_count;
+	bool ocr_last_failed;
+
+	/* per CPU SCSI IO latency histograms, NULL if allocation failed */
+	struct megasas_lat_hist __percpu *lat_hist;
+
+	/* nr_cpu_ids x MAX_LOGICAL_DRIVES_EXT, NULL until debugfs fast_path is opened */
+	struct megasas_fp_stats *fp_stats;
+
 	u8 *sense;
 	dma_addr_t sense_phys_addr;
 
@@ -1410,6 +1596,10 @@ struct fusion_context
 	
 	/*Non dma-able memory. Driver local copy.*/
 	MR_DRV_RAID_MAP_ALL *ld_drv_map[2];
+	/* ld_drv_map[] entry fast path IOs use, swapped under RCU */
+	MR_DRV_RAID_MAP_ALL __rcu *cur_drv_map;
+	/* serializes rebuilds of the spare driver map */
+	struct mutex drv_map_mutex;
 
 	dma_addr_t ld_map_phys[2];
 
@@ -1423,14 +1613,20 @@ struct fusion_context
 	dma_addr_t pd_seq_phys[2];
 	u8 fast_path_io;
 	PLD_LOAD_BALANCE_INFO load_balance_info;
-	u32 load_balance_info_pages;
-	LD_SPAN_INFO log_to_span[MAX_LOGICAL_DRIVES_EXT];
+	LD_SPAN_INFO log_to_span[2][MAX_LOGICAL_DRIVES_EXT];
 	PTR_LD_STREAM_DETECT  *streamDetectByLD;
 	dma_addr_t ioc_init_request_phys;
 	pMpi2IOCInitRequest_t	ioc_init_request;
 	struct megasas_cmd *ioc_init_cmd;
 };
 
+/* Fast path accounting of @device_id on @cpu, fusion->fp_stats must be set */
+static inline struct megasas_fp_stats *
+megasas_fp_stats_get(struct fusion_context *fusion, int cpu, u32 device_id)
+{
+	return &fusion->fp_stats[cpu * MAX_LOGICAL_DRIVES_EXT + device_id];
+}
+
 union desc_value {
 	u64 word;
 	struct {
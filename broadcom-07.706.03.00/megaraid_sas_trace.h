@@ -0,0 +1,271 @@
+/*
+ *  Linux MegaRAID driver for SAS based RAID controllers
+ *
+ *  Copyright (c) 2009-2017  LSI Corporation.
+ *  Copyright (c) 2009-2017  Avago Technologies.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  FILE: megaraid_sas_trace.h
+ *
+ *  Tracepoints of the fusion IO submit/complete path, instantiated in
+ *  megaraid_sas_fusion.c. tools/megasas_trace_report.py summarizes a
+ *  recorded trace.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM megaraid_sas
+
+#if !defined(_MEGARAID_SAS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MEGARAID_SAS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* SCSI command built and handed to megasas_submit_req_descs */
+TRACE_EVENT(megasas_io_submit,
+
+	TP_PROTO(struct megasas_instance *instance, struct scsi_cmnd *scmd,
+		 struct megasas_cmd_fusion *cmd, u8 msix,
+		 struct megasas_cmd_fusion *r1_cmd),
+
+	TP_ARGS(instance, scmd, cmd, msix, r1_cmd),
+
+	TP_STRUCT__entry(
+		__field(u32, host_no)
+		__field(u16, smid)
+		__field(u16, peer_smid)
+		__field(u16, dev_handle)
+		__field(u8, msix)
+		__field(u8, fp)
+		__field(u8, opcode)
+		__field(u64, lba)
+		__field(u32, len)
+	),
+
+	TP_fast_assign(
+		__entry->host_no = instance->host->host_no;
+		__entry->smid = cmd->index;
+		__entry->peer_smid = r1_cmd ? r1_cmd->index : 0;
+		__entry->dev_handle = le16_to_cpu(cmd->io_request->DevHandle);
+		__entry->msix = msix;
+		__entry->fp = (cmd->io_request->Function ==
+			       MPI2_FUNCTION_SCSI_IO_REQUEST);
+		__entry->opcode = scmd->cmnd[0];
+		__entry->lba = blk_rq_pos(scmd->request);
+		__entry->len = scsi_bufflen(scmd);
+	),
+
+	TP_printk("host=%u smid=%u msix=%u dev_handle=0x%04x fp=%u opcode=0x%02x lba=%llu len=%u peer_smid=%u",
+		  __entry->host_no, __entry->smid, __entry->msix,
+		  __entry->dev_handle, __entry->fp, __entry->opcode,
+		  (unsigned long long)__entry->lba, __entry->len,
+		  __entry->peer_smid)
+);
+
+/*
+ * Request descriptor written to the inbound queue port. MFA descriptors
+ * carry a frame address and no SMID, and only SCSI IO descriptors carry
+ * a device handle; fields a descriptor lacks read as 0 and 0xffff.
+ */
+TRACE_EVENT(megasas_fire_cmd,
+
+	TP_PROTO(struct megasas_instance *instance,
+		 MEGASAS_REQUEST_DESCRIPTOR_UNION *req_desc),
+
+	TP_ARGS(instance, req_desc),
+
+	TP_STRUCT__entry(
+		__field(u32, host_no)
+		__field(u16, smid)
+		__field(u16, dev_handle)
+		__field(u8, msix)
+		__field(u8, flags)
+	),
+
+	TP_fast_assign(
+		__entry->host_no = instance->host->host_no;
+		__entry->flags = req_desc->Default.RequestFlags;
+		__entry->smid = (MEGASAS_REQ_DESCRIPT_TYPE(__entry->flags) !=
+				 MEGASAS_REQ_DESCRIPT_FLAGS_MFA) ?
+			le16_to_cpu(req_desc->Default.SMID) : 0;
+		__entry->msix = (MEGASAS_REQ_DESCRIPT_TYPE(__entry->flags) !=
+				 MEGASAS_REQ_DESCRIPT_FLAGS_MFA) ?
+			req_desc->Default.MSIxIndex : 0;
+		__entry->dev_handle =
+			MEGASAS_REQ_DESCRIPT_IS_SCSI_IO(__entry->flags) ?
+			le16_to_cpu(req_desc->SCSIIO.DevHandle) :
+			MR_DEVHANDLE_INVALID;
+	),
+
+	TP_printk("host=%u smid=%u msix=%u dev_handle=0x%04x flags=0x%02x",
+		  __entry->host_no, __entry->smid, __entry->msix,
+		  __entry->dev_handle, __entry->flags)
+);
+
+/* Reply descriptor consumed by complete_cmd_fusion */
+TRACE_EVENT(megasas_io_complete,
+
+	TP_PROTO(struct megasas_instance *instance, u32 msix, u16 smid,
+		 MEGASAS_RAID_SCSI_IO_REQUEST *io_req),
+
+	TP_ARGS(instance, msix, smid, io_req),
+
+	TP_STRUCT__entry(
+		__field(u32, host_no)
+		__field(u16, smid)
+		__field(u16, dev_handle)
+		__field(u8, msix)
+		__field(u8, function)
+		__field(u8, status)
+		__field(u8, ex_status)
+	),
+
+	TP_fast_assign(
+		__entry->host_no = instance->host->host_no;
+		__entry->smid = smid;
+		__entry->dev_handle = le16_to_cpu(io_req->DevHandle);
+		__entry->msix = msix;
+		__entry->function = io_req->Function;
+		__entry->status = io_req->RaidContext.raid_context.status;
+		__entry->ex_status = io_req->RaidContext.raid_context.exStatus;
+	),
+
+	TP_printk("host=%u smid=%u msix=%u dev_handle=0x%04x function=0x%02x status=0x%02x ex_status=0x%02x",
+		  __entry->host_no, __entry->smid, __entry->msix,
+		  __entry->dev_handle, __entry->function, __entry->status,
+		  __entry->ex_status)
+);
+
+/* End of one pass over a reply queue */
+TRACE_EVENT(megasas_reply_queue,
+
+	TP_PROTO(struct megasas_instance *instance, u32 msix, int completed,
+		 u16 reply_idx, u32 depth),
+
+	TP_ARGS(instance, msix, completed, reply_idx, depth),
+
+	TP_STRUCT__entry(
+		__field(u32, host_no)
+		__field(int, completed)
+		__field(u32, depth)
+		__field(u16, reply_idx)
+		__field(u8, msix)
+	),
+
+	TP_fast_assign(
+		__entry->host_no = instance->host->host_no;
+		__entry->completed = completed;
+		__entry->reply_idx = reply_idx;
+		__entry->depth = depth;
+		__entry->msix = msix;
+	),
+
+	TP_printk("host=%u msix=%u completed=%d reply_idx=%u depth=%u",
+		  __entry->host_no, __entry->msix, __entry->completed,
+		  __entry->reply_idx, __entry->depth)
+);
+
+/* One leg of a R1 fast path write completed */
+TRACE_EVENT(megasas_r1_complete,
+
+	TP_PROTO(struct megasas_instance *instance,
+		 struct megasas_cmd_fusion *cmd,
+		 struct megasas_cmd_fusion *r1_cmd),
+
+	TP_ARGS(instance, cmd, r1_cmd),
+
+	TP_STRUCT__entry(
+		__field(u32, host_no)
+		__field(u16, smid)
+		__field(u16, peer_smid)
+		__field(u8, peer_done)
+		__field(u8, status)
+	),
+
+	TP_fast_assign(
+		__entry->host_no = instance->host->host_no;
+		__entry->smid = cmd->index;
+		__entry->peer_smid = r1_cmd->index;
+		__entry->peer_done = r1_cmd->cmd_completed;
+		__entry->status = cmd->io_request->RaidContext.raid_context.status;
+	),
+
+	TP_printk("host=%u smid=%u peer_smid=%u peer_done=%u status=0x%02x",
+		  __entry->host_no, __entry->smid, __entry->peer_smid,
+		  __entry->peer_done, __entry->status)
+);
+
+/* Outcome of sequential stream detection for a Ventura LD IO */
+TRACE_EVENT(megasas_stream_detect,
+
+	TP_PROTO(struct megasas_instance *instance,
+		 struct IO_REQUEST_INFO *io_info, bool hit),
+
+	TP_ARGS(instance, io_info, hit),
+
+	TP_STRUCT__entry(
+		__field(u32, host_no)
+		__field(u32, ld)
+		__field(u64, lba)
+		__field(u32, blocks)
+		__field(u8, is_read)
+		__field(u8, hit)
+	),
+
+	TP_fast_assign(
+		__entry->host_no = instance->host->host_no;
+		__entry->ld = io_info->ldTgtId;
+		__entry->lba = io_info->ldStartBlock;
+		__entry->blocks = io_info->numBlocks;
+		__entry->is_read = io_info->isRead;
+		__entry->hit = hit;
+	),
+
+	TP_printk("host=%u ld=%u lba=%llu blocks=%u is_read=%u hit=%u",
+		  __entry->host_no, __entry->ld,
+		  (unsigned long long)__entry->lba, __entry->blocks,
+		  __entry->is_read, __entry->hit)
+);
+
+/* LD map sync DCMD posted to FW */
+TRACE_EVENT(megasas_map_sync,
+
+	TP_PROTO(struct megasas_instance *instance, u16 num_lds, u32 map_sz),
+
+	TP_ARGS(instance, num_lds, map_sz),
+
+	TP_STRUCT__entry(
+		__field(u32, host_no)
+		__field(u64, map_id)
+		__field(u32, map_sz)
+		__field(u16, num_lds)
+	),
+
+	TP_fast_assign(
+		__entry->host_no = instance->host->host_no;
+		__entry->map_id = instance->map_id;
+		__entry->map_sz = map_sz;
+		__entry->num_lds = num_lds;
+	),
+
+	TP_printk("host=%u map_id=%llu num_lds=%u map_sz=%u",
+		  __entry->host_no, (unsigned long long)__entry->map_id,
+		  __entry->num_lds, __entry->map_sz)
+);
+
+#endif /* _MEGARAID_SAS_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE megaraid_sas_trace
+#include <trace/define_trace.h>
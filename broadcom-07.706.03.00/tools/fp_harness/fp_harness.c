@@ -0,0 +1,832 @@
+/*
+ * fp_harness.c: userspace harness for the megaraid_sas fast path mapping.
+ *
+ * Builds a synthetic firmware RAID map holding one LD of each layout in
+ * fp_layouts[], loads it through MR_ValidateMapInfo() as the driver does,
+ * then
+ *
+ *   - maps a generated workload, and optionally a replayed trace, with
+ *     MR_BuildRaidContext() and checks fast path eligibility, span, arm,
+ *     PD block and device handle against fp_ref_map(), a reference mapper
+ *     that works from the layout description instead of the RAID map;
+ *   - walks every row of the spanned LDs through MR_GetSpanBlock() and
+ *     mr_spanset_get_span_block(), and every strip of the uneven span
+ *     RAID-1 LD through get_arm();
+ *   - drives get_updated_dev_handle() (megasas_get_best_arm_pd()) under
+ *     each lb_policy and checks the copy it reads from;
+ *   - reports ns per mapping for the driver and the reference mapper.
+ *
+ * Usage: fp_harness [-n ios_per_ld] [-s seed] [trace.txt]
+ *
+ * trace.txt is "trace-cmd report" output holding megasas_stream_detect
+ * events; their ld=, lba=, blocks= and is_read= fields are replayed, with
+ * the target id folded onto the synthetic LDs and the LBA onto the LD
+ * size. Exits non zero on any mismatch.
+ */
+
+#include <unistd.h>
+
+#include "megaraid_sas_fusion.h"
+#include "megaraid_sas.h"
+
+u32 mr_spanset_get_span_block(struct megasas_instance *instance, u32 ld,
+	u64 row, u64 *span_blk, MR_DRV_RAID_MAP_ALL *map);
+u32 MR_GetSpanBlock(u32 ld, u64 row, u64 *span_blk, MR_DRV_RAID_MAP_ALL *map);
+u8 get_arm(struct megasas_instance *instance, u32 ld, u8 span, u64 stripe,
+	MR_DRV_RAID_MAP_ALL *map);
+u8 MR_ValidateMapInfo(struct megasas_instance *instance, u64 map_id);
+u16 get_updated_dev_handle(struct megasas_instance *instance,
+	PLD_LOAD_BALANCE_INFO lbInfo, struct IO_REQUEST_INFO *in_info,
+	MR_DRV_RAID_MAP_ALL *drv_map);
+void mr_update_pd_latency(PLD_LOAD_BALANCE_INFO lbInfo, u8 slot, u64 issue_ns);
+
+#define FP_MAX_SPANS		4
+#define FP_DEV_HANDLE(pd)	((u16)(0x1000 + (pd)))
+#define FP_LD_STATE_OPTIMAL	3
+#define FP_LD_STATE_DEGRADED	2
+/* lb_pending_cmds default in megaraid_sas_fp.c */
+#define FP_LB_PENDING_CMDS	4
+
+struct fp_layout {
+	const char *name;
+	u8 level;			/* RAID map level: 0, 1, 5 or 6 */
+	u8 copies;			/* RAID-1: arms holding each strip */
+	u8 spans;
+	u8 uneven;
+	u8 quads;			/* quads per span, even spans only */
+	u8 stripe_shift;
+	u8 data[FP_MAX_SPANS];		/* data arms per span row */
+	u32 rows;			/* rows per span */
+	s8 missing_span;		/* arm without a PD, -1 if none */
+	s8 missing_arm;
+};
+
+static const struct fp_layout fp_layouts[] = {
+	{ "R0 4 disk",		0, 0, 1, 0, 1, 7, { 4 },	 8192, -1, -1 },
+	{ "R1 2 disk",		1, 2, 1, 0, 1, 7, { 1 },	 8192, -1, -1 },
+	{ "R1 4 disk",		1, 2, 1, 0, 1, 8, { 2 },	 8192, -1, -1 },
+	{ "R1 3 way",		1, 3, 1, 0, 1, 7, { 1 },	 8192, -1, -1 },
+	{ "R5 5 disk",		5, 0, 1, 0, 1, 7, { 4 },	 8192, -1, -1 },
+	{ "R6 6 disk",		6, 0, 1, 0, 1, 9, { 4 },	 8192, -1, -1 },
+	{ "R10 3x2",		1, 2, 3, 0, 1, 7, { 1, 1, 1 },	 8192, -1, -1 },
+	{ "R50 2x4",		5, 0, 2, 0, 1, 7, { 3, 3 },	 8192, -1, -1 },
+	{ "R50 2x4 2 quads",	5, 0, 2, 0, 2, 7, { 3, 3 },	 8192, -1, -1 },
+	{ "R60 2x6",		6, 0, 2, 0, 1, 8, { 4, 4 },	 8192, -1, -1 },
+	{ "R60 4x5",		6, 0, 4, 0, 1, 7, { 3, 3, 3, 3 }, 4096, -1, -1 },
+	{ "R10 uneven 4+6+4",	1, 2, 3, 1, 1, 7, { 2, 3, 2 },	 8192, -1, -1 },
+	{ "R60 uneven 6+7",	6, 0, 2, 1, 1, 7, { 4, 5 },	 8192, -1, -1 },
+	{ "R1 degraded",	1, 2, 1, 0, 1, 7, { 1 },	 8192,  0,  0 },
+	{ "R5 degraded",	5, 0, 1, 0, 1, 7, { 4 },	 8192,  0,  2 },
+};
+
+#define FP_NR_LDS	ARRAY_SIZE(fp_layouts)
+
+/* where each LD of the synthetic map landed */
+struct fp_ld {
+	const struct fp_layout *lay;
+	u16 pd[FP_MAX_SPANS][MAX_RAIDMAP_ROW_SIZE];
+	u64 start_blk[FP_MAX_SPANS];
+	u64 size;			/* LD size in blocks */
+	u32 row_width;			/* data strips per row of all spans */
+};
+
+static struct fp_ld fp_lds[FP_NR_LDS];
+
+struct fp_io {
+	u64 lba;
+	u32 blocks;
+	u16 ld;
+	u8 is_read;
+};
+
+struct fp_ref {
+	u8 fp;
+	u8 span;
+	u8 arm;
+	u64 pd_block;
+	u16 dev_handle;
+	u16 alt_dev_handle;		/* RAID-1 write: the next copy */
+};
+
+struct fp_stats {
+	u32 ios;
+	u32 fp;
+	u32 mismatch;
+	u32 lb_reads;
+	u64 map_ns;
+	u64 ref_ns;
+	u64 lb_ns;
+};
+
+static struct megasas_instance *instance;
+static struct fusion_context *fusion;
+static MR_DRV_RAID_MAP_ALL *drv_map;
+static u64 fp_seed = 0x9e3779b97f4a7c15ULL;
+static volatile u64 fp_sink;
+static u32 fp_errors;
+
+static u64 fp_rand(void)
+{
+	fp_seed ^= fp_seed << 13;
+	fp_seed ^= fp_seed >> 7;
+	fp_seed ^= fp_seed << 17;
+	return fp_seed;
+}
+
+static u8 fp_row_size(const struct fp_layout *lay, u32 span)
+{
+	switch (lay->level) {
+	case 1:
+		return lay->data[span] * lay->copies;
+	case 5:
+		return lay->data[span] + 1;
+	case 6:
+		return lay->data[span] + 2;
+	default:
+		return lay->data[span];
+	}
+}
+
+/*
+ * Fill in the firmware map entry of one LD. Rows go round robin over the
+ * spans; a span holding several quads splits its rows evenly between them.
+ */
+static void fp_build_ld(MR_FW_RAID_MAP_EXT *fw_map, u16 ld, u16 *next_pd,
+	u16 *next_array)
+{
+	const struct fp_layout *lay = &fp_layouts[ld];
+	struct fp_ld *l = &fp_lds[ld];
+	MR_LD_SPAN_MAP *span_map = &fw_map->ldSpanMap[ld];
+	MR_LD_RAID *raid = &span_map->ldRaid;
+	MR_SPAN_BLOCK_INFO *span_block;
+	MR_QUAD_ELEMENT *quad;
+	u32 span, arm, q, rows_per_quad;
+	u16 pd, ar;
+
+	l->lay = lay;
+	l->row_width = 0;
+	for (span = 0; span < lay->spans; span++)
+		l->row_width += lay->data[span];
+	l->size = ((u64)lay->rows * (lay->uneven ? l->row_width :
+		lay->spans * lay->data[0])) << lay->stripe_shift;
+
+	fw_map->ldTgtIdToLd[ld] = ld;
+	raid->capability.fpCapable = 1;
+	raid->capability.fpReadCapable = 1;
+	raid->capability.fpWriteCapable = 1;
+	raid->size = l->size;
+	raid->spanDepth = lay->spans;
+	raid->level = lay->level;
+	raid->stripeShift = lay->stripe_shift;
+	raid->targetId = ld;
+	raid->seqNum = ld;
+	raid->ldState = (lay->missing_span >= 0) ?
+		FP_LD_STATE_DEGRADED : FP_LD_STATE_OPTIMAL;
+	if (!lay->uneven) {
+		raid->rowSize = fp_row_size(lay, 0);
+		raid->rowDataSize = lay->data[0];
+		/* R5 data rotates over every arm, the others use data arm order */
+		raid->modFactor = (lay->level == 5) ? raid->rowSize : lay->data[0];
+		for (arm = 0; arm < raid->modFactor; arm++)
+			span_map->dataArmMap[arm] = (lay->level == 1) ?
+				arm * lay->copies : arm;
+	}
+
+	for (span = 0; span < lay->spans; span++) {
+		span_block = &span_map->spanBlock[span];
+		ar = (*next_array)++;
+		l->start_blk[span] = 0x800 + ((u64)span << 30) + ((u64)ld << 20);
+
+		span_block->num_rows = lay->rows;
+		span_block->span.startBlk = l->start_blk[span];
+		span_block->span.numBlks = (u64)lay->rows << lay->stripe_shift;
+		span_block->span.arrayRef = ar;
+		span_block->span.spanRowSize = fp_row_size(lay, span);
+		span_block->span.spanRowDataSize = lay->data[span];
+
+		span_block->block_span_info.noElements = lay->quads;
+		rows_per_quad = lay->rows / lay->quads;
+		for (q = 0; q < lay->quads; q++) {
+			quad = &span_block->block_span_info.quad[q];
+			quad->diff = lay->spans;
+			quad->logStart = (u64)q * rows_per_quad * lay->spans + span;
+			quad->logEnd = quad->logStart +
+				(u64)(rows_per_quad - 1) * lay->spans;
+			quad->offsetInSpan = (u64)q * rows_per_quad;
+		}
+
+		for (arm = 0; arm < MAX_RAIDMAP_ROW_SIZE; arm++) {
+			l->pd[span][arm] = MR_PD_INVALID;
+			fw_map->arMapInfo[ar].pd[arm] = MR_PD_INVALID;
+		}
+		for (arm = 0; arm < fp_row_size(lay, span); arm++) {
+			pd = (*next_pd)++;
+			fw_map->devHndlInfo[pd].curDevHdl = FP_DEV_HANDLE(pd);
+			fw_map->devHndlInfo[pd].validHandles = 1;
+			fw_map->devHndlInfo[pd].interfaceType = pd % 3;
+			if ((span == lay->missing_span) && (arm == lay->missing_arm))
+				continue;
+			l->pd[span][arm] = pd;
+			fw_map->arMapInfo[ar].pd[arm] = pd;
+		}
+	}
+}
+
+static void fp_setup(void)
+{
+	MR_FW_RAID_MAP_EXT *fw_map;
+	u16 ld, next_pd = 0, next_array = 0;
+	int i;
+
+	instance = calloc(1, sizeof(*instance));
+	fusion = calloc(1, sizeof(*fusion));
+	fw_map = calloc(1, sizeof(*fw_map));
+	if (!instance || !fusion || !fw_map)
+		exit(2);
+
+	instance->ctrl_context = fusion;
+	instance->adapter_type = VENTURA_SERIES;
+	instance->supportmax256vd = 1;
+	instance->UnevenSpanSupport = 1;
+
+	fusion->drv_map_sz = sizeof(MR_DRV_RAID_MAP_ALL);
+	fusion->ld_map[0] = (MR_FW_RAID_MAP_DYNAMIC *)fw_map;
+	for (i = 0; i < 2; i++) {
+		fusion->ld_drv_map[i] = calloc(1, sizeof(MR_DRV_RAID_MAP_ALL));
+		if (!fusion->ld_drv_map[i])
+			exit(2);
+	}
+	fusion->load_balance_info = calloc(MAX_LOGICAL_DRIVES_EXT,
+		sizeof(LD_LOAD_BALANCE_INFO));
+	if (!fusion->load_balance_info)
+		exit(2);
+
+	memset(fw_map->ldTgtIdToLd, 0xff, sizeof(fw_map->ldTgtIdToLd));
+	fw_map->ldCount = FP_NR_LDS;
+	fw_map->fpPdIoTimeoutSec = 10;
+	for (ld = 0; ld < FP_NR_LDS; ld++)
+		fp_build_ld(fw_map, ld, &next_pd, &next_array);
+
+	if (!MR_ValidateMapInfo(instance, 0)) {
+		fprintf(stderr, "fp_harness: MR_ValidateMapInfo() rejected the map\n");
+		exit(1);
+	}
+	drv_map = fusion->cur_drv_map;
+	free(fw_map);
+}
+
+/*
+ * Reference mapping of one IO from the layout description: rows go round
+ * robin over the spans (for uneven spans, each span takes its own number
+ * of strips of a row), R5 data rotates over every arm, R6 data follows
+ * the Q arm and RAID-1 keeps the copies of a strip on adjacent arms.
+ */
+static void fp_ref_map(const struct fp_io *io, struct fp_ref *ref)
+{
+	const struct fp_ld *l = &fp_lds[io->ld];
+	const struct fp_layout *lay = l->lay;
+	u64 strip, end_strip, row, span_row;
+	u32 log_arm, off, n, arm, span;
+	u16 pd;
+
+	memset(ref, 0, sizeof(*ref));
+	ref->dev_handle = MR_DEVHANDLE_INVALID;
+	ref->alt_dev_handle = MR_DEVHANDLE_INVALID;
+
+	strip = io->lba >> lay->stripe_shift;
+	end_strip = (io->lba + io->blocks - 1) >> lay->stripe_shift;
+	if (strip != end_strip)
+		return;
+
+	if (lay->uneven) {
+		span_row = strip / l->row_width;
+		off = strip % l->row_width;
+		for (span = 0; off >= lay->data[span]; span++)
+			off -= lay->data[span];
+		log_arm = off;
+		row = span_row * lay->spans + span;
+	} else {
+		row = strip / lay->data[0];
+		log_arm = strip % lay->data[0];
+		span = row % lay->spans;
+		span_row = row / lay->spans;
+	}
+
+	n = fp_row_size(lay, span);
+	switch (lay->level) {
+	case 1:
+		arm = log_arm * lay->copies;
+		break;
+	case 5:
+		arm = strip % n;
+		break;
+	case 6:
+		arm = ((n - 1 - row % n) + 1 + log_arm) % n;
+		break;
+	default:
+		arm = log_arm;
+		break;
+	}
+
+	pd = l->pd[span][arm];
+	if ((pd == MR_PD_INVALID) && (lay->level == 1))
+		pd = l->pd[span][++arm];
+	if (pd == MR_PD_INVALID)
+		return;
+
+	ref->fp = 1;
+	ref->span = span;
+	ref->arm = arm;
+	ref->pd_block = (span_row << lay->stripe_shift) +
+		(io->lba & ((1 << lay->stripe_shift) - 1)) + l->start_blk[span];
+	ref->dev_handle = FP_DEV_HANDLE(pd);
+	if ((lay->level == 1) && !io->is_read && (arm + 1 < n) &&
+	    (l->pd[span][arm + 1] != MR_PD_INVALID))
+		ref->alt_dev_handle = FP_DEV_HANDLE(l->pd[span][arm + 1]);
+}
+
+static u8 fp_map(const struct fp_io *io, struct IO_REQUEST_INFO *io_info)
+{
+	RAID_CONTEXT_UNION ctx;
+	u8 *raid_lun;
+
+	memset(io_info, 0, sizeof(*io_info));
+	memset(&ctx, 0, sizeof(ctx));
+	io_info->ldStartBlock = io->lba;
+	io_info->numBlocks = io->blocks;
+	io_info->ldTgtId = io->ld;
+	io_info->isRead = io->is_read;
+	io_info->r1_alt_dev_handle = MR_DEVHANDLE_INVALID;
+	return MR_BuildRaidContext(instance, io_info, &ctx.raid_context,
+		drv_map, &raid_lun);
+}
+
+static u8 fp_is_lb(const struct fp_io *io)
+{
+	return fusion->load_balance_info[io->ld].loadBalanceFlag && io->is_read;
+}
+
+/* load balance a mapped read, as megasas_build_ldio_fusion() does */
+static u16 fp_balance(const struct fp_io *io, struct IO_REQUEST_INFO *io_info)
+{
+	PLD_LOAD_BALANCE_INFO lbInfo = &fusion->load_balance_info[io->ld];
+	u16 dev_handle;
+
+	dev_handle = get_updated_dev_handle(instance, lbInfo, io_info, drv_map);
+	/* complete it straight away */
+	atomic_dec(&lbInfo->slots[io_info->span_arm].scsi_pending_cmds);
+	return dev_handle;
+}
+
+static void fp_fail(const struct fp_io *io, const char *what, u64 got, u64 want)
+{
+	if (fp_errors++ < 20)
+		fprintf(stderr, "MISMATCH %s: ld %u lba %llu blocks %u %s: "
+			"%s 0x%llx, reference 0x%llx\n", fp_lds[io->ld].lay->name,
+			io->ld, (unsigned long long)io->lba, io->blocks,
+			io->is_read ? "read" : "write", what,
+			(unsigned long long)got, (unsigned long long)want);
+}
+
+static u32 fp_check_io(const struct fp_io *io)
+{
+	struct IO_REQUEST_INFO io_info;
+	struct fp_ref ref;
+	const struct fp_ld *l = &fp_lds[io->ld];
+	u32 bad = 0, copies, span, arm, base;
+	u16 dev_handle;
+
+	fp_map(io, &io_info);
+	fp_ref_map(io, &ref);
+
+	if (io_info.fpOkForIo != ref.fp) {
+		fp_fail(io, "fast path", io_info.fpOkForIo, ref.fp);
+		return 1;
+	}
+	if (!ref.fp)
+		return 0;
+
+	span = (io_info.span_arm & RAID_CTX_SPANARM_SPAN_MASK) >>
+		RAID_CTX_SPANARM_SPAN_SHIFT;
+	arm = io_info.span_arm & RAID_CTX_SPANARM_ARM_MASK;
+	if (span != ref.span)
+		bad++, fp_fail(io, "span", span, ref.span);
+	if (arm != ref.arm)
+		bad++, fp_fail(io, "arm", arm, ref.arm);
+	if (io_info.pdBlock != ref.pd_block)
+		bad++, fp_fail(io, "pd block", io_info.pdBlock, ref.pd_block);
+	if (io_info.devHandle != ref.dev_handle)
+		bad++, fp_fail(io, "dev handle", io_info.devHandle, ref.dev_handle);
+	if (!io->is_read && (io_info.r1_alt_dev_handle != ref.alt_dev_handle))
+		bad++, fp_fail(io, "r1 alt dev handle", io_info.r1_alt_dev_handle,
+			ref.alt_dev_handle);
+
+	if (!bad && fp_is_lb(io) && l->lay->copies) {
+		/* any copy of the strip will do, as long as it has a PD */
+		dev_handle = fp_balance(io, &io_info);
+		copies = l->lay->copies;
+		base = ref.arm - ref.arm % copies;
+		span = (io_info.span_arm & RAID_CTX_SPANARM_SPAN_MASK) >>
+			RAID_CTX_SPANARM_SPAN_SHIFT;
+		arm = io_info.span_arm & RAID_CTX_SPANARM_ARM_MASK;
+		if ((span != ref.span) || (arm < base) || (arm >= base + copies))
+			bad++, fp_fail(io, "balanced span_arm", io_info.span_arm,
+				(ref.span << RAID_CTX_SPANARM_SPAN_SHIFT) | base);
+		else if (dev_handle != FP_DEV_HANDLE(l->pd[span][arm]))
+			bad++, fp_fail(io, "balanced dev handle", dev_handle,
+				FP_DEV_HANDLE(l->pd[span][arm]));
+	}
+	return bad;
+}
+
+/*
+ * Per LD: random 4K and 8K IOs, small IOs at any offset within a strip,
+ * IOs straddling a strip boundary and a sequential 64K run.
+ */
+static struct fp_io *fp_gen_ios(u16 ld, u32 nr)
+{
+	const struct fp_ld *l = &fp_lds[ld];
+	u32 strip_blocks = 1 << l->lay->stripe_shift;
+	struct fp_io *ios, *io;
+	u64 seq = 0;
+	u32 i;
+
+	ios = calloc(nr, sizeof(*ios));
+	if (!ios)
+		exit(2);
+
+	for (i = 0; i < nr; i++) {
+		io = &ios[i];
+		io->ld = ld;
+		io->is_read = (fp_rand() % 100) < 70;
+		switch (i % 8) {
+		case 0:
+		case 1:
+		case 2:
+			io->blocks = 8;
+			io->lba = (fp_rand() % (l->size / 8)) * 8;
+			break;
+		case 3:
+			io->blocks = 16;
+			io->lba = (fp_rand() % (l->size / 16)) * 16;
+			break;
+		case 4:
+			io->blocks = 1 + fp_rand() % 7;
+			io->lba = fp_rand() % (l->size - io->blocks);
+			break;
+		case 5:
+			/* straddles a strip boundary */
+			io->blocks = 8;
+			io->lba = (fp_rand() % (l->size / strip_blocks - 1)) *
+				strip_blocks + strip_blocks - 4;
+			break;
+		default:
+			io->blocks = 128;
+			io->lba = seq;
+			seq += 128;
+			if (seq + 128 > l->size)
+				seq = 0;
+			break;
+		}
+	}
+	return ios;
+}
+
+/*
+ * Replay megasas_stream_detect events; IOs are appended to the per LD
+ * lists the target id folds onto.
+ */
+static u32 fp_load_trace(const char *path, struct fp_io **trace, u32 *nr)
+{
+	char line[512];
+	const char *p;
+	struct fp_io io, **list;
+	const struct fp_ld *l;
+	u32 total = 0, tgt;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(2);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (!strstr(line, "megasas_stream_detect"))
+			continue;
+		if (!(p = strstr(line, " ld=")))
+			continue;
+		tgt = strtoul(p + 4, NULL, 0);
+		if (!(p = strstr(line, " lba=")))
+			continue;
+		io.lba = strtoull(p + 5, NULL, 0);
+		if (!(p = strstr(line, " blocks=")))
+			continue;
+		io.blocks = strtoul(p + 8, NULL, 0);
+		if (!(p = strstr(line, " is_read=")))
+			continue;
+		io.is_read = !!strtoul(p + 9, NULL, 0);
+
+		io.ld = tgt % FP_NR_LDS;
+		l = &fp_lds[io.ld];
+		if (!io.blocks || (io.blocks >= l->size))
+			continue;
+		if (io.lba + io.blocks > l->size)
+			io.lba %= l->size - io.blocks;
+
+		list = &trace[io.ld];
+		*list = realloc(*list, (nr[io.ld] + 1) * sizeof(**list));
+		if (!*list)
+			exit(2);
+		(*list)[nr[io.ld]++] = io;
+		total++;
+	}
+	fclose(f);
+	return total;
+}
+
+static void fp_run(const struct fp_io *ios, u32 nr, struct fp_stats *st)
+{
+	struct IO_REQUEST_INFO io_info;
+	struct fp_ref ref;
+	ktime_t start;
+	u64 sum = 0;
+	u32 i;
+
+	if (!nr)
+		return;
+
+	for (i = 0; i < nr; i++)
+		st->mismatch += fp_check_io(&ios[i]);
+
+	start = ktime_get();
+	for (i = 0; i < nr; i++) {
+		fp_map(&ios[i], &io_info);
+		sum += io_info.pdBlock ^ io_info.devHandle;
+		st->fp += io_info.fpOkForIo;
+	}
+	st->map_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < nr; i++) {
+		fp_ref_map(&ios[i], &ref);
+		sum += ref.pd_block ^ ref.dev_handle;
+	}
+	st->ref_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	/* balancing cost on its own, over reads already mapped */
+	for (i = 0; i < nr; i++) {
+		if (!fp_is_lb(&ios[i]))
+			continue;
+		if (!fp_map(&ios[i], &io_info) || !io_info.fpOkForIo)
+			continue;
+		start = ktime_get();
+		sum += fp_balance(&ios[i], &io_info);
+		st->lb_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+		st->lb_reads++;
+	}
+
+	st->ios += nr;
+	fp_sink += sum;
+}
+
+/* every row of a spanned LD through the span lookups the mapping uses */
+static u32 fp_check_span_helpers(u16 ld)
+{
+	const struct fp_ld *l = &fp_lds[ld];
+	const struct fp_layout *lay = l->lay;
+	struct fp_io io = { .ld = ld };
+	u64 row, blk, want_blk, strip;
+	u32 span, want_span, bad = 0, off, s;
+	u8 arm;
+
+	if (lay->spans < 2)
+		return 0;
+
+	for (row = 0; row < (u64)lay->rows * lay->spans; row++) {
+		want_span = row % lay->spans;
+		want_blk = (row / lay->spans) << lay->stripe_shift;
+		blk = ~0ULL;
+		span = lay->uneven ?
+			mr_spanset_get_span_block(instance, ld, row, &blk, drv_map) :
+			MR_GetSpanBlock(ld, row, &blk, drv_map);
+		if ((span != want_span) || (blk != want_blk)) {
+			io.lba = row;
+			fp_fail(&io, lay->uneven ? "spanset span/block of row" :
+				"span/block of row", ((u64)span << 48) | blk,
+				((u64)want_span << 48) | want_blk);
+			bad++;
+		}
+	}
+
+	if (!lay->uneven || (lay->level != 1))
+		return bad;
+
+	for (strip = 0; strip < (u64)lay->rows * l->row_width; strip++) {
+		off = strip % l->row_width;
+		for (s = 0; off >= lay->data[s]; s++)
+			off -= lay->data[s];
+		arm = get_arm(instance, ld, s, strip, drv_map);
+		if (arm != off * 2) {
+			io.lba = strip << lay->stripe_shift;
+			fp_fail(&io, "get_arm", arm, off * 2);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+/* arm a single block read at lba is balanced to under the current state */
+static u32 fp_lb_pick(u16 ld, u64 lba, u16 *dev_handle)
+{
+	struct IO_REQUEST_INFO io_info;
+	struct fp_io io = { .lba = lba, .blocks = 1, .ld = ld, .is_read = 1 };
+
+	fp_map(&io, &io_info);
+	*dev_handle = fp_balance(&io, &io_info);
+	return io_info.span_arm & RAID_CTX_SPANARM_ARM_MASK;
+}
+
+static void fp_lb_reset(PLD_LOAD_BALANCE_INFO lbInfo)
+{
+	atomic_set(&lbInfo->latency_reads, 0);
+	memset(lbInfo->slots, 0, MR_LB_SLOTS * sizeof(MR_LB_SLOT));
+}
+
+#define FP_LB_EXPECT(cond, fmt, ...) do {				\
+	if (!(cond)) {							\
+		fprintf(stderr, "LB MISMATCH %s: " fmt "\n",		\
+			lay->name, ##__VA_ARGS__);			\
+		bad++;							\
+	}								\
+} while (0)
+
+/*
+ * Steer a read of strip 0 (span 0, data arm 0) with each policy: the
+ * nearest head and its pending cap, the shortest queue, and the lowest
+ * expected completion time with its periodic re-sampling of the slowest
+ * copy.
+ */
+static u32 fp_check_lb(u16 ld)
+{
+	const struct fp_ld *l = &fp_lds[ld];
+	const struct fp_layout *lay = l->lay;
+	PLD_LOAD_BALANCE_INFO lbInfo = &fusion->load_balance_info[ld];
+	u32 copies = lay->copies, last = copies - 1;
+	u32 picks[MAX_RAIDMAP_ROW_SIZE] = { 0 };
+	u32 i, arm, bad = 0, reads = 8 * MR_LB_LATENCY_EXPLORE;
+	u64 lba = 0, now;
+	u16 dev_handle;
+
+	/* only optimal RAID-1 and RAID-10 LDs are balanced */
+	FP_LB_EXPECT(lbInfo->loadBalanceFlag == ((lay->level == 1) &&
+		(lay->missing_span < 0)), "loadBalanceFlag %u",
+		lbInfo->loadBalanceFlag);
+	FP_LB_EXPECT(!lbInfo->loadBalanceFlag || lbInfo->slots,
+		"balanced without per arm state");
+	if (!lbInfo->loadBalanceFlag || !copies)
+		return bad;
+
+	/* seek: the head of the last copy sits on the block */
+	instance->lb_policy = MR_LB_POLICY_SEEK;
+	fp_lb_reset(lbInfo);
+	for (i = 0; i < copies; i++)
+		lbInfo->slots[i].last_accessed_block = lba + 1000000;
+	lbInfo->slots[last].last_accessed_block = lba;
+	arm = fp_lb_pick(ld, lba, &dev_handle);
+	FP_LB_EXPECT(arm == last, "seek picked arm %u, want %u", arm, last);
+	FP_LB_EXPECT(dev_handle == FP_DEV_HANDLE(l->pd[0][arm]),
+		"seek dev handle 0x%x", dev_handle);
+
+	/* ... until it has lb_pending_cmds more queued than the idlest */
+	fp_lb_reset(lbInfo);
+	for (i = 0; i < copies; i++)
+		lbInfo->slots[i].last_accessed_block = lba + 1000000;
+	lbInfo->slots[last].last_accessed_block = lba;
+	atomic_set(&lbInfo->slots[last].scsi_pending_cmds, FP_LB_PENDING_CMDS + 1);
+	arm = fp_lb_pick(ld, lba, &dev_handle);
+	FP_LB_EXPECT(arm == 0, "seek over the pending cap picked arm %u, want 0",
+		arm);
+
+	/* queue: fewest pending wins */
+	instance->lb_policy = MR_LB_POLICY_QUEUE;
+	fp_lb_reset(lbInfo);
+	for (i = 0; i < copies; i++)
+		atomic_set(&lbInfo->slots[i].scsi_pending_cmds, 3 + i);
+	atomic_set(&lbInfo->slots[last].scsi_pending_cmds, 1);
+	arm = fp_lb_pick(ld, lba, &dev_handle);
+	FP_LB_EXPECT(arm == last, "queue picked arm %u, want %u", arm, last);
+
+	/*
+	 * latency: copy 0 answers in 400us, the others in 100us and the last
+	 * in 50us. The last takes every read but each MR_LB_LATENCY_EXPLORE'th,
+	 * which re-samples copy 0.
+	 */
+	instance->lb_policy = MR_LB_POLICY_LATENCY;
+	fp_lb_reset(lbInfo);
+	now = ktime_to_ns(ktime_get());
+	mr_update_pd_latency(lbInfo, 0, now - 400000);
+	for (i = 1; i < last; i++)
+		mr_update_pd_latency(lbInfo, i, now - 100000);
+	mr_update_pd_latency(lbInfo, last, now - 50000);
+	for (i = 0; i < reads; i++)
+		picks[fp_lb_pick(ld, lba, &dev_handle)]++;
+	FP_LB_EXPECT(picks[last] == reads - reads / MR_LB_LATENCY_EXPLORE,
+		"latency sent %u of %u reads to the fastest copy", picks[last],
+		reads);
+	FP_LB_EXPECT(picks[0] == reads / MR_LB_LATENCY_EXPLORE,
+		"latency re-sampled the slowest copy %u times, want %u",
+		picks[0], reads / MR_LB_LATENCY_EXPLORE);
+
+	printf("  lb %-18s seek/cap/queue ok%s, latency %u/%u reads to the "
+		"fastest copy, %u re-samples\n", lay->name, bad ? " (FAILED)" : "",
+		picks[last], reads, picks[0]);
+
+	instance->lb_policy = MR_LB_POLICY_SEEK;
+	fp_lb_reset(lbInfo);
+	return bad;
+}
+
+static void fp_report(const char *name, const struct fp_stats *st)
+{
+	printf("%-20s %8u %6.1f%% %8u %9.1f %9.1f",
+		name, st->ios, st->ios ? 100.0 * st->fp / st->ios : 0.0,
+		st->mismatch, st->ios ? (double)st->map_ns / st->ios : 0.0,
+		st->ios ? (double)st->ref_ns / st->ios : 0.0);
+	if (st->lb_reads)
+		printf(" %9.1f", (double)st->lb_ns / st->lb_reads);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct fp_io *ios, *trace[FP_NR_LDS] = { NULL };
+	u32 trace_nr[FP_NR_LDS] = { 0 };
+	struct fp_stats st[FP_NR_LDS], total, trace_total;
+	u32 nr_ios = 100000, nr_trace = 0, bad = 0;
+	u16 ld;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_ios = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			fp_seed = strtoull(optarg, NULL, 0) | 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n ios_per_ld] [-s seed] "
+				"[trace.txt]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	fp_setup();
+	if (optind < argc)
+		nr_trace = fp_load_trace(argv[optind], trace, trace_nr);
+
+	memset(st, 0, sizeof(st));
+	memset(&total, 0, sizeof(total));
+	memset(&trace_total, 0, sizeof(trace_total));
+
+	printf("%-20s %8s %7s %8s %9s %9s %9s\n", "layout", "ios", "fp",
+		"mismatch", "map ns", "ref ns", "lb ns");
+	for (ld = 0; ld < FP_NR_LDS; ld++) {
+		ios = fp_gen_ios(ld, nr_ios);
+		fp_run(ios, nr_ios, &st[ld]);
+		free(ios);
+		fp_run(trace[ld], trace_nr[ld], &trace_total);
+		fp_report(fp_layouts[ld].name, &st[ld]);
+
+		total.ios += st[ld].ios;
+		total.fp += st[ld].fp;
+		total.mismatch += st[ld].mismatch;
+		total.map_ns += st[ld].map_ns;
+		total.ref_ns += st[ld].ref_ns;
+		total.lb_ns += st[ld].lb_ns;
+		total.lb_reads += st[ld].lb_reads;
+	}
+	fp_report("all", &total);
+	if (nr_trace)
+		fp_report("trace replay", &trace_total);
+	bad += total.mismatch + trace_total.mismatch;
+
+	printf("\nspan helpers and load balancing:\n");
+	for (ld = 0; ld < FP_NR_LDS; ld++) {
+		u32 span_bad = fp_check_span_helpers(ld);
+
+		if (fp_layouts[ld].spans > 1)
+			printf("  span %-16s %u rows%s\n", fp_layouts[ld].name,
+				fp_layouts[ld].rows * fp_layouts[ld].spans,
+				span_bad ? " FAILED" : " ok");
+		bad += span_bad;
+		bad += fp_check_lb(ld);
+	}
+
+	for (ld = 0; ld < FP_NR_LDS; ld++)
+		free(trace[ld]);
+
+	printf("\n%s: %u mismatches\n", bad ? "FAIL" : "PASS", bad);
+	return bad ? 1 : 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * megasas_shim.h: just enough of the kernel API to build
+ * megaraid_sas_fp.c (and the two driver headers it includes) as a
+ * userspace object for fp_harness.
+ *
+ * The harness is single threaded, so locks and RCU are no-ops and the
+ * atomics are plain integers. Types that only appear embedded in
+ * megasas_instance or fusion_context are opaque placeholders.
+ */
+#ifndef MEGASAS_SHIM_H
+#define MEGASAS_SHIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE	KERNEL_VERSION(5, 4, 0)
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+#define __BIG_ENDIAN_BITFIELD
+#define MFI_BIG_ENDIAN
+#else
+#define __LITTLE_ENDIAN_BITFIELD
+#endif
+
+typedef uint8_t		u8;
+typedef uint16_t	u16;
+typedef uint32_t	u32;
+typedef uint64_t	u64;
+typedef int8_t		s8;
+typedef int16_t		s16;
+typedef int32_t		s32;
+typedef int64_t		s64;
+typedef u8		__u8;
+typedef u16		__u16;
+typedef u32		__u32;
+typedef u64		__u64;
+typedef u16		__le16;
+typedef u32		__le32;
+typedef u64		__le64;
+typedef u16		__be16;
+typedef u32		__be32;
+typedef u64		__be64;
+typedef u64		dma_addr_t;
+typedef u64		resource_size_t;
+typedef s64		ktime_t;
+typedef unsigned int	gfp_t;
+typedef unsigned int	fmode_t;
+typedef int		irqreturn_t;
+typedef int		blk_status_t;
+typedef unsigned int	uint;
+
+#define __iomem
+#define __user
+#define __rcu
+#define __percpu
+#define __packed		__attribute__((packed))
+#define __aligned(x)		__attribute__((aligned(x)))
+#define ____cacheline_aligned_in_smp	__attribute__((aligned(64)))
+#define ____cacheline_aligned		__attribute__((aligned(64)))
+#define __maybe_unused		__attribute__((unused))
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define BUG_ON(x)		do { if (x) abort(); } while (0)
+#define WARN_ON(x)		(!!(x))
+#define READ_ONCE(x)		(x)
+#define WRITE_ONCE(x, v)	((x) = (v))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define BIT(n)			(1UL << (n))
+#define PAGE_SIZE		4096UL
+#define S_IRUGO			0444
+#define S_IWUSR			0200
+
+#define min_t(t, a, b)	((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)	((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+
+#define cpu_to_le16(x)	htole16(x)
+#define cpu_to_le32(x)	htole32(x)
+#define cpu_to_le64(x)	htole64(x)
+#define le16_to_cpu(x)	le16toh(x)
+#define le32_to_cpu(x)	le32toh(x)
+#define le64_to_cpu(x)	le64toh(x)
+#define le32_to_cpus(p)	(*(p) = le32toh(*(p)))
+
+/* quotient in n, returns the remainder */
+#define do_div(n, base) ({				\
+	u32 __base = (base);				\
+	u32 __rem = (u32)((u64)(n) % __base);		\
+	(n) = (u64)(n) / __base;			\
+	__rem;						\
+})
+
+#define KERN_ERR	""
+#define KERN_INFO	""
+#define KERN_DEBUG	""
+#define KERN_WARNING	""
+#define KERN_NOTICE	""
+#define printk(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define dev_err(dev, fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define dev_info(dev, fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define dev_warn(dev, fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+#define EXPORT_SYMBOL(sym)
+
+/* single threaded: atomics, locks and RCU collapse to plain accesses */
+typedef struct { int counter; } atomic_t;
+typedef struct { s64 counter; } atomic64_t;
+#define ATOMIC_INIT(i)		{ (i) }
+#define atomic_read(v)		((v)->counter)
+#define atomic_set(v, i)	((v)->counter = (i))
+#define atomic_inc(v)		((v)->counter++)
+#define atomic_dec(v)		((v)->counter--)
+#define atomic_add(i, v)	((v)->counter += (i))
+#define atomic_sub(i, v)	((v)->counter -= (i))
+#define atomic_inc_return(v)	(++(v)->counter)
+#define atomic_dec_return(v)	(--(v)->counter)
+static inline int atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+	int cur = v->counter;
+
+	if (cur == old)
+		v->counter = new;
+	return cur;
+}
+#define atomic64_read(v)	((v)->counter)
+#define atomic64_set(v, i)	((v)->counter = (i))
+#define atomic64_inc(v)		((v)->counter++)
+#define atomic64_add(i, v)	((v)->counter += (i))
+
+typedef struct { int unused; } spinlock_t;
+struct mutex { int unused; };
+struct semaphore { int unused; };
+#define mutex_lock(m)		do { (void)(m); } while (0)
+#define mutex_unlock(m)		do { (void)(m); } while (0)
+#define spin_lock(l)		do { (void)(l); } while (0)
+#define spin_unlock(l)		do { (void)(l); } while (0)
+#define lockdep_is_held(l)	1
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+#define GFP_KERNEL		0
+#define kcalloc(n, size, gfp)	calloc(n, size)
+#define kfree(p)		free(p)
+
+#define synchronize_rcu()		do { } while (0)
+#define rcu_read_lock()			do { } while (0)
+#define rcu_read_unlock()		do { } while (0)
+#define rcu_dereference(p)		(p)
+#define rcu_dereference_protected(p, c)	(p)
+#define rcu_assign_pointer(p, v)	((p) = (v))
+#define RCU_INIT_POINTER(p, v)		((p) = (v))
+
+static inline ktime_t ktime_get(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ktime_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+#define ktime_sub(a, b)		((a) - (b))
+#define ktime_to_ns(t)		((s64)(t))
+
+/* embedded by value in the driver structures, never touched by fp.c */
+struct list_head { struct list_head *next, *prev; };
+struct hlist_node { struct hlist_node *next, **pprev; };
+struct hlist_head { struct hlist_node *first; };
+struct msix_entry { u32 vector; u16 entry; };
+struct iovec { void *iov_base; size_t iov_len; };
+struct work_struct { int unused; };
+struct delayed_work { int unused; };
+struct timer_list { int unused; };
+struct completion { int unused; };
+struct tasklet_struct { int unused; };
+struct kref { int unused; };
+struct device { int unused; };
+struct pci_dev { struct device dev; };
+struct scsi_device;
+struct scsi_cmnd;
+struct Scsi_Host;
+typedef struct { int unused; } wait_queue_head_t;
+
+#endif /* MEGASAS_SHIM_H */
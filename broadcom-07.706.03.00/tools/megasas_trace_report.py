@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#
+# megasas_trace_report.py: summarize a megaraid_sas event trace.
+#
+# Record with e.g.
+#   trace-cmd record -e megaraid_sas -- sleep 10 && trace-cmd report > trace.txt
+# or
+#   echo 1 > /sys/kernel/tracing/events/megaraid_sas/enable
+#   cat /sys/kernel/tracing/trace_pipe > trace.txt
+# then run
+#   megasas_trace_report.py trace.txt
+#
+# Reports, per host:
+#   - submit to completion latency per reply queue (MSI-x index)
+#   - fast path hit rate for reads, writes and everything else
+#   - reply ring occupancy: replies drained per reply queue pass
+#   - stream detection hit rate
+#
+
+import re
+import sys
+from collections import defaultdict
+
+LINE_RE = re.compile(r'\s(?P<ts>\d+\.\d+):\s+(?P<event>megasas_\w+):\s+(?P<args>.*)$')
+ARG_RE = re.compile(r'(\w+)=(\S+)')
+
+READ_OPCODES = (0x08, 0x28, 0x88, 0xa8)
+WRITE_OPCODES = (0x0a, 0x2a, 0x8a, 0xaa)
+
+
+def percentile(sorted_vals, pct):
+    if not sorted_vals:
+        return 0
+    idx = int(round(pct / 100.0 * (len(sorted_vals) - 1)))
+    return sorted_vals[idx]
+
+
+def parse(stream):
+    for line in stream:
+        m = LINE_RE.search(line)
+        if not m:
+            continue
+        args = dict((k, int(v, 0)) for k, v in ARG_RE.findall(m.group('args')))
+        yield float(m.group('ts')), m.group('event'), args
+
+
+def main():
+    src = open(sys.argv[1]) if len(sys.argv) > 1 else sys.stdin
+
+    inflight = {}                       # (host, smid) -> submit time
+    latency = defaultdict(list)         # (host, msix) -> [us]
+    fp = defaultdict(lambda: [0, 0])    # (host, kind) -> [fast path, total]
+    ring = defaultdict(list)            # (host, msix) -> [replies per pass]
+    ring_depth = {}
+    stream = defaultdict(lambda: [0, 0])  # host -> [hits, total]
+    unmatched = 0
+
+    for ts, event, a in parse(src):
+        host = a.get('host', 0)
+        if event == 'megasas_io_submit':
+            inflight[(host, a['smid'])] = ts
+            if a['peer_smid']:
+                inflight[(host, a['peer_smid'])] = ts
+            op = a['opcode']
+            kind = 'read' if op in READ_OPCODES else \
+                   'write' if op in WRITE_OPCODES else 'other'
+            fp[(host, kind)][0] += a['fp']
+            fp[(host, kind)][1] += 1
+        elif event == 'megasas_io_complete':
+            start = inflight.pop((host, a['smid']), None)
+            if start is None:
+                unmatched += 1
+                continue
+            latency[(host, a['msix'])].append((ts - start) * 1e6)
+        elif event == 'megasas_reply_queue':
+            ring[(host, a['msix'])].append(a['completed'])
+            ring_depth[(host, a['msix'])] = a['depth']
+        elif event == 'megasas_stream_detect':
+            stream[host][0] += a['hit']
+            stream[host][1] += 1
+
+    print('== latency per reply queue (us, submit to reply) ==')
+    print('%-5s %-5s %10s %10s %10s %10s %10s' %
+          ('host', 'msix', 'count', 'avg', 'p50', 'p99', 'p999'))
+    for key in sorted(latency):
+        vals = sorted(latency[key])
+        print('%-5d %-5d %10d %10.1f %10.1f %10.1f %10.1f' %
+              (key[0], key[1], len(vals), sum(vals) / len(vals),
+               percentile(vals, 50), percentile(vals, 99),
+               percentile(vals, 99.9)))
+    if unmatched:
+        print('(%d completions without a submit in the trace)' % unmatched)
+
+    print('\n== fast path hit rate ==')
+    print('%-5s %-6s %10s %10s %8s' % ('host', 'kind', 'ios', 'fp', 'rate'))
+    for key in sorted(fp):
+        hits, total = fp[key]
+        print('%-5d %-6s %10d %10d %7.1f%%' %
+              (key[0], key[1], total, hits, 100.0 * hits / total))
+
+    print('\n== reply ring occupancy (replies drained per pass) ==')
+    print('%-5s %-5s %8s %8s %8s %8s %8s' %
+          ('host', 'msix', 'passes', 'avg', 'p99', 'max', 'depth'))
+    for key in sorted(ring):
+        vals = sorted(ring[key])
+        print('%-5d %-5d %8d %8.1f %8d %8d %8d' %
+              (key[0], key[1], len(vals), float(sum(vals)) / len(vals),
+               percentile(vals, 99), vals[-1], ring_depth[key]))
+
+    if stream:
+        print('\n== stream detection ==')
+        for host in sorted(stream):
+            hits, total = stream[host]
+            print('host %d: %d of %d LD IOs continued a stream (%.1f%%)' %
+                  (host, hits, total, 100.0 * hits / total))
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())